@@ -1,10 +1,10 @@
-/* clonefile on apfs
+/* clonefile on apfs, FICLONE reflinks on Linux
  * This file is part of jdupes; see jdupes.c for license information */
 
 #include "jdupes.h"
 
 /* Compile out the code if no linking support is built in */
-#if ENABLE_APFS
+#ifdef ENABLE_APFS
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -18,6 +18,7 @@
 #include <sys/clonefile.h>
 #include <fcntl.h>
 #include "act_clonefiles.h"
+#include "jody_win_unicode.h"
 
 #define COPYFILE_FLAGS (COPYFILE_CLONE_FORCE | COPYFILE_STAT | COPYFILE_ACL | COPYFILE_SECURITY | COPYFILE_XATTR | COPYFILE_METADATA | COPYFILE_DATA)
 
@@ -250,3 +251,207 @@ extern void clonefiles(file_t *files)
   return;
 }
 #endif /* ENABLE_APFS */
+
+
+#ifdef ENABLE_REFLINK
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <linux/fs.h>
+#include "act_clonefiles.h"
+#include "jody_win_unicode.h"
+
+/* FICLONE is the generic version of the btrfs clone ioctl (same number) */
+#ifndef FICLONE
+ #define FICLONE _IOW(0x94, 9, int)
+#endif
+
+/* Copy every extended attribute of the file open as fromfd to tofd.
+ * This covers POSIX ACLs, security labels and file capabilities too,
+ * since Linux keeps all of them in xattrs. Returns 0 on success or -1
+ * with errno set if any attribute could not be copied. */
+static int copy_xattrs(const int fromfd, const int tofd)
+{
+  char *names = NULL, *value = NULL;
+  ssize_t names_len, len;
+  size_t value_alloc = 0;
+  int err = 0;
+
+  names_len = flistxattr(fromfd, NULL, 0);
+  if (names_len < 0) return (errno == ENOTSUP) ? 0 : -1;
+  if (names_len == 0) return 0;
+  names = (char *)malloc((size_t)names_len);
+  if (names == NULL) oom("copy_xattrs()");
+  names_len = flistxattr(fromfd, names, (size_t)names_len);
+  if (names_len < 0) err = errno;
+
+  for (char *name = names; err == 0 && name < names + names_len; name += strlen(name) + 1) {
+    len = fgetxattr(fromfd, name, NULL, 0);
+    if (len < 0) {
+      err = errno;
+      break;
+    }
+    if ((size_t)len > value_alloc || value == NULL) {
+      free(value);
+      value_alloc = (size_t)len + 1;
+      value = (char *)malloc(value_alloc);
+      if (value == NULL) oom("copy_xattrs()");
+    }
+    len = fgetxattr(fromfd, name, value, value_alloc);
+    if (len < 0 || fsetxattr(tofd, name, value, (size_t)len, 0) != 0) err = errno;
+    LOUD(fprintf(stderr, "reflink: copy xattr '%s' => %s\n", name, strerror(err));)
+  }
+
+  free(names);
+  free(value);
+  if (err != 0) {
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
+
+
+/* Make a reflink copy of srcname as tmpname with the metadata of the
+ * file it replaces, dstname, whose stat() is st: owner, permissions,
+ * times and all extended attributes. Returns 0 on success; on failure
+ * tmpname is removed and errno is set */
+static int reflink_to_temp(const char * const restrict srcname, const char * const restrict dstname,
+                const char * const restrict tmpname, const struct stat * const restrict st)
+{
+  struct timespec times[2];
+  int srcfd, dstfd, tmpfd, err = 0;
+
+  srcfd = open(srcname, O_RDONLY);
+  if (srcfd == -1) return -1;
+  tmpfd = open(tmpname, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+  if (tmpfd == -1) {
+    err = errno;
+    close(srcfd);
+    errno = err;
+    return -1;
+  }
+
+  /* The clone is pure metadata; no file data is read or written */
+  if (ioctl(tmpfd, FICLONE, srcfd) != 0) err = errno;
+  LOUD(fprintf(stderr, "reflink: ioctl('%s', FICLONE, '%s') => %s\n", tmpname, srcname, strerror(err));)
+  close(srcfd);
+
+  /* Carry over the owner, permissions, xattrs and times of the replaced
+   * file; the xattrs go last because a chown drops file capabilities */
+  if (err == 0 && fchown(tmpfd, st->st_uid, st->st_gid) != 0) err = errno;
+  if (err == 0 && fchmod(tmpfd, st->st_mode & 07777) != 0) err = errno;
+  if (err == 0) {
+    dstfd = open(dstname, O_RDONLY);
+    if (dstfd == -1 || copy_xattrs(dstfd, tmpfd) != 0) err = errno;
+    if (dstfd != -1) close(dstfd);
+  }
+  times[0] = st->st_atim;
+  times[1] = st->st_mtim;
+  if (err == 0 && futimens(tmpfd, times) != 0) err = errno;
+
+  if (close(tmpfd) != 0 && err == 0) err = errno;
+  if (err != 0) {
+    unlink(tmpname);
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
+
+
+extern void clonefiles(file_t *files)
+{
+  file_t *srcfile, *curfile;
+  struct stat st;
+  size_t name_len;
+  int i;
+
+  LOUD(fprintf(stderr, "Running clonefiles (reflink)\n");)
+
+  while (files) {
+    if (ISFLAG(files->flags, F_HAS_DUPES)) {
+      /* Clone every file from the first file */
+      srcfile = files;
+      if (!ISFLAG(flags, F_HIDEPROGRESS)) {
+        printf("[SRC] "); fwprint(stdout, srcfile->d_name, 1);
+      }
+      for (curfile = files->duplicates; curfile; curfile = curfile->duplicates) {
+        /* Reflinks can't cross filesystems */
+        if (srcfile->device != curfile->device) {
+          fprintf(stderr, "warning: reflink target on different device, not cloning:\n-//-> ");
+          fwprint(stderr, curfile->d_name, 1);
+          continue;
+        }
+        /* Hard links already share everything */
+        if (srcfile->inode == curfile->inode) {
+          if (ISFLAG(flags, F_CONSIDERHARDLINKS) && !ISFLAG(flags, F_HIDEPROGRESS)) {
+            printf("-==-> "); fwprint(stdout, curfile->d_name, 1);
+          }
+          continue;
+        }
+
+        /* Do not attempt to replace files for which we don't have write access */
+        if (access(curfile->d_name, W_OK) != 0) {
+          fprintf(stderr, "warning: reflink target is a read-only file, not cloning:\n-//-> ");
+          fwprint(stderr, curfile->d_name, 1);
+          continue;
+        }
+
+        /* Check file pairs for modification before cloning */
+        i = file_has_changed(srcfile);
+        if (i) {
+          fprintf(stderr, "warning: source file modified since scanned; changing source file:\n[SRC] ");
+          fwprint(stderr, curfile->d_name, 1);
+          LOUD(fprintf(stderr, "file_has_changed: %d\n", i);)
+          srcfile = curfile;
+          continue;
+        }
+        if (file_has_changed(curfile) || stat(curfile->d_name, &st) != 0) {
+          fprintf(stderr, "warning: target file modified since scanned, not cloning:\n-//-> ");
+          fwprint(stderr, curfile->d_name, 1);
+          continue;
+        }
+
+        /* Make sure the name will fit in the buffer before trying */
+        name_len = strlen(curfile->d_name) + 14;
+        if (name_len > PATHBUF_SIZE) continue;
+        /* Assemble a temporary file name */
+        strcpy(tempname, curfile->d_name);
+        strcat(tempname, ".__jdupes__.tmp");
+
+        /* Build the clone next to the target, then atomically replace it;
+         * the target is never missing or partially written */
+        i = 0;
+        if (reflink_to_temp(srcfile->d_name, curfile->d_name, tempname, &st) != 0) i = errno;
+        else if (rename(tempname, curfile->d_name) != 0) {
+          i = errno;
+          unlink(tempname);
+        }
+        if (i != 0) {
+          if (!ISFLAG(flags, F_HIDEPROGRESS)) {
+            printf("-//-> "); fwprint(stdout, curfile->d_name, 1);
+          }
+          fprintf(stderr, "warning: unable to reflink '"); fwprint(stderr, curfile->d_name, 0);
+          fprintf(stderr, "' -> '"); fwprint(stderr, srcfile->d_name, 0);
+          fprintf(stderr, "': %s\n", strerror(i));
+          continue;
+        }
+
+        if (!ISFLAG(flags, F_HIDEPROGRESS)) {
+          printf("----> ");
+          fwprint(stdout, curfile->d_name, 1);
+        }
+      }
+      if (!ISFLAG(flags, F_HIDEPROGRESS)) printf("\n");
+    }
+    files = files->next;
+  }
+  return;
+}
+#endif /* ENABLE_REFLINK */
@@ -1,4 +1,4 @@
-/* jdupes action for APFS clonefile
+/* jdupes action for APFS clonefile and Linux reflinks
  * This file is part of jdupes; see jdupes.c for license information */
 
 #ifndef ACT_CLONEFILES_H
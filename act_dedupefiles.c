@@ -1,9 +1,10 @@
-/* BTRFS deduplication of file blocks
+/* Deduplication of file blocks using the FIDEDUPERANGE ioctl
+ * Works on any Linux filesystem that supports it (btrfs, XFS, ...)
  * This file is part of jdupes; see jdupes.c for license information */
 
 #include "jdupes.h"
 
-#ifdef ENABLE_BTRFS
+#ifdef ENABLE_DEDUPE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -11,173 +12,500 @@
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 
-#include <linux/btrfs.h>
 #include <sys/ioctl.h>
 #include <sys/utsname.h>
+#include <linux/fs.h>
+#ifdef FS_IOC_FIEMAP
+ #include <linux/fiemap.h>
+#endif
 #include "act_dedupefiles.h"
 
-/* Message to append to BTRFS warnings based on write permissions */
+/* Kernel headers older than 4.5 only have the btrfs version of the ioctl,
+ * which has the same number and structure layout as FIDEDUPERANGE */
+#ifndef FIDEDUPERANGE
+ #include <linux/btrfs.h>
+ #define FIDEDUPERANGE BTRFS_IOC_FILE_EXTENT_SAME
+ #define FILE_DEDUPE_RANGE_DIFFERS BTRFS_SAME_DATA_DIFFERS
+ #define file_dedupe_range btrfs_ioctl_same_args
+ #define file_dedupe_range_info btrfs_ioctl_same_extent_info
+ #define dest_fd fd
+ #define dest_offset logical_offset
+ #define src_offset logical_offset
+ #define src_length length
+#endif
+
+/* The kernel refuses dedupe arguments larger than a page, which limits
+ * how many destination files can go into a single request */
+#define DEDUPE_ARGS_SIZE 4096
+#define DEDUPE_BATCH ((DEDUPE_ARGS_SIZE - sizeof(struct file_dedupe_range)) \
+    / sizeof(struct file_dedupe_range_info))
+/* Bytes per request; large files are submitted as a series of ranges so
+ * that inodes aren't locked for the whole file and per-call caps aren't hit */
+#define DEDUPE_CHUNK_SIZE (16 * 1048576)
+/* Maximum number of duplicate sets being deduplicated at the same time */
+#define DEDUPE_MAX_THREADS 8
+
+#ifdef FS_IOC_FIEMAP
+/* Extents fetched per range; ranges with more are always submitted */
+#define FIEMAP_EXTENTS 256
+#define FIEMAP_SIZE (sizeof(struct fiemap) + sizeof(struct fiemap_extent) * FIEMAP_EXTENTS)
+/* Extents that don't have a fixed on-disk location that can be compared */
+#define FIEMAP_UNSTABLE (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | \
+    FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_DATA_TAIL | \
+    FIEMAP_EXTENT_NOT_ALIGNED | FIEMAP_EXTENT_UNWRITTEN)
+#endif
+
+/* Devices whose filesystem was found not to support dedupe */
+#define MAX_NODEDUPE_DEVS 64
+static dev_t nodedupe_devs[MAX_NODEDUPE_DEVS];
+static unsigned int nodedupe_cnt = 0;
+
+/* Duplicate sets to process; workers take the next one under the lock */
+static file_t **dedupe_sets = NULL;
+static unsigned int set_cnt = 0, next_set = 0;
+static pthread_mutex_t dedupe_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct dedupe_dest {
+  const file_t *file;
+  int fd;
+  int readonly;
+  int failed;
+};
+
+struct dedupe_worker {
+  pthread_t thread;
+  struct file_dedupe_range *same;
+  struct dedupe_dest dest[DEDUPE_BATCH];
+  unsigned int dest_map[DEDUPE_BATCH];  /* same->info index => dest index */
+  unsigned int total_files;
+  uintmax_t shared_bytes;  /* Bytes skipped because they were already shared */
+#ifdef FS_IOC_FIEMAP
+  struct fiemap *src_extents;
+  struct fiemap *dest_extents;
+#endif
+};
+
+/* Message to append to dedupe warnings based on write permissions */
 static const char *readonly_msg[] = {
    "",
    " (no write permission)"
 };
 
-static char *dedupeerrstr(int err) {
-  tempname[sizeof(tempname)-1] = '\0';
-  if (err == BTRFS_SAME_DATA_DIFFERS) {
-    snprintf(tempname, sizeof(tempname), "BTRFS_SAME_DATA_DIFFERS (data modified in the meantime?)");
-    return tempname;
+static const char *dedupeerrstr(int err, char * const restrict buf, const size_t size) {
+  if (err == FILE_DEDUPE_RANGE_DIFFERS) {
+    return "FILE_DEDUPE_RANGE_DIFFERS (data modified in the meantime?)";
   } else if (err < 0) {
     return strerror(-err);
   } else {
-    snprintf(tempname, sizeof(tempname), "Unknown error %d", err);
-    return tempname;
+    snprintf(buf, size, "Unknown error %d", err);
+    return buf;
   }
 }
 
-extern void dedupefiles(file_t * restrict files)
+/* The ioctl errors that mean the filesystem can't dedupe at all */
+static inline int dedupe_unsupported(const int err)
 {
-  struct utsname utsname;
-  struct btrfs_ioctl_same_args *same;
-  char **dupe_filenames; /* maps to same->info indices */
+  return (err == EOPNOTSUPP || err == ENOTTY || err == ENOSYS);
+}
 
-  file_t *curfile;
-  unsigned int n_dupes, max_dupes, cur_info;
-  unsigned int cur_file = 0, max_files, total_files = 0;
 
-  int fd;
-  int ret, status, readonly;
+/* Must be called with dedupe_lock held */
+static int device_nodedupe(const dev_t device)
+{
+  for (unsigned int i = 0; i < nodedupe_cnt; i++)
+    if (nodedupe_devs[i] == device) return 1;
+  return 0;
+}
 
-  LOUD(fprintf(stderr, "\nRunning dedupefiles()\n");)
 
-  /* Refuse to dedupe on 2.x kernels; they could damage user data */
-  if (uname(&utsname)) {
-    fprintf(stderr, "Failed to get kernel version! Aborting.\n");
-    exit(EXIT_FAILURE);
-  }
-  LOUD(fprintf(stderr, "dedupefiles: uname got release '%s'\n", utsname.release));
-  if (*(utsname.release) == '2' && *(utsname.release + 1) == '.') {
-    fprintf(stderr, "Refusing to dedupe on a 2.x kernel; data loss could occur. Aborting.\n");
-    exit(EXIT_FAILURE);
+#ifdef FS_IOC_FIEMAP
+/* Read the extent map of a file range. Returns 0 only if every byte of
+ * the range is in a stable extent that is flagged as shared. */
+static int get_shared_extents(const int fd, const uint64_t offset, const uint64_t length,
+                struct fiemap * const restrict map)
+{
+  uint64_t pos = offset;
+
+  memset(map, 0, sizeof(struct fiemap));
+  map->fm_start = offset;
+  map->fm_length = length;
+  map->fm_extent_count = FIEMAP_EXTENTS;
+  if (ioctl(fd, FS_IOC_FIEMAP, map) < 0) return -1;
+
+  for (unsigned int i = 0; i < map->fm_mapped_extents && pos < offset + length; i++) {
+    const struct fiemap_extent * const fe = &map->fm_extents[i];
+
+    if (fe->fe_flags & FIEMAP_UNSTABLE) return -1;
+    if (!(fe->fe_flags & FIEMAP_EXTENT_SHARED)) return -1;
+    /* A hole or a gap in the returned extents */
+    if (fe->fe_logical > pos) return -1;
+    pos = fe->fe_logical + fe->fe_length;
   }
+  return (pos < offset + length) ? -1 : 0;
+}
 
-  /* Find the largest dupe set, alloc space to hold structs for it */
-  get_max_dupes(files, &max_dupes, &max_files);
-  /* Kernel dupe count is a uint16_t so exit if the type's limit is exceeded */
-  if (max_dupes > 65535) {
-    fprintf(stderr, "Largest duplicate set (%d) exceeds the 65535-file dedupe limit.\n", max_dupes);
-    fprintf(stderr, "Ask the program author to add this feature if you really need it. Exiting!\n");
-    exit(EXIT_FAILURE);
+
+/* Find the extent holding a file position, starting at *i */
+static inline const struct fiemap_extent *extent_at(const struct fiemap * const restrict map,
+                unsigned int * const restrict i, const uint64_t pos)
+{
+  while (*i < map->fm_mapped_extents && map->fm_extents[*i].fe_logical
+      + map->fm_extents[*i].fe_length <= pos) (*i)++;
+  if (*i == map->fm_mapped_extents) return NULL;
+  return &map->fm_extents[*i];
+}
+
+
+/* Returns 1 if a range of two files already points at the same blocks.
+ * Both maps must have passed get_shared_extents() for the range. */
+static int extents_same(const struct fiemap * const restrict m1, const struct fiemap * const restrict m2,
+                const uint64_t offset, const uint64_t length)
+{
+  const struct fiemap_extent *e1, *e2;
+  unsigned int i1 = 0, i2 = 0;
+  uint64_t pos = offset, end1, end2;
+
+  while (pos < offset + length) {
+    e1 = extent_at(m1, &i1, pos);
+    e2 = extent_at(m2, &i2, pos);
+    if (e1 == NULL || e2 == NULL) return 0;
+    /* Physical offsets into encoded (compressed) extents are meaningless */
+    if ((e1->fe_flags | e2->fe_flags) & FIEMAP_EXTENT_ENCODED) {
+      if (e1->fe_logical != e2->fe_logical || e1->fe_physical != e2->fe_physical
+          || e1->fe_length != e2->fe_length) return 0;
+    } else if (e1->fe_physical - e1->fe_logical != e2->fe_physical - e2->fe_logical) return 0;
+    end1 = e1->fe_logical + e1->fe_length;
+    end2 = e2->fe_logical + e2->fe_length;
+    pos = (end1 < end2) ? end1 : end2;
   }
-  same = calloc(sizeof(struct btrfs_ioctl_same_args) +
-                sizeof(struct btrfs_ioctl_same_extent_info) * max_dupes, 1);
-  dupe_filenames = malloc(max_dupes * sizeof(char *));
-  LOUD(fprintf(stderr, "dedupefiles structs: alloc1 size %lu => %p, alloc2 size %lu => %p\n",
-        sizeof(struct btrfs_ioctl_same_args) + sizeof(struct btrfs_ioctl_same_extent_info) * max_dupes,
-        (void *)same, max_dupes * sizeof(char *), (void *)dupe_filenames);)
-  if (!same || !dupe_filenames) oom("dedupefiles() structures");
-
-  /* Main dedupe loop */
-  while (files) {
-    if (ISFLAG(files->flags, F_HAS_DUPES) && files->size) {
-      cur_file++;
-      if (!ISFLAG(flags, F_HIDEPROGRESS)) {
-        fprintf(stderr, "Dedupe [%u/%u] %u%% \r", cur_file, max_files,
-            cur_file * 100 / max_files);
+  return 1;
+}
+#endif /* FS_IOC_FIEMAP */
+
+
+/* Dedupe a batch of open destination files against the source file,
+ * one chunk of the file at a time. Returns -1 if the set should be
+ * abandoned or 0 otherwise. */
+static int dedupe_batch(struct dedupe_worker * const restrict w, const int src,
+                const file_t * const restrict files, const unsigned int n_dest)
+{
+  struct file_dedupe_range * const same = w->same;
+  char errbuf[64];
+  uint64_t offset, length;
+  unsigned int i, cur_info, n_active;
+  int status;
+#ifdef FS_IOC_FIEMAP
+  int src_shared;
+#endif
+
+  for (offset = 0; offset < (uint64_t)files->size; offset += length) {
+    length = (uint64_t)files->size - offset;
+    if (length > DEDUPE_CHUNK_SIZE) length = DEDUPE_CHUNK_SIZE;
+
+#ifdef FS_IOC_FIEMAP
+    /* Nothing can already be shared with the source if it shares nothing */
+    src_shared = (get_shared_extents(src, offset, length, w->src_extents) == 0);
+#endif
+
+    /* Files that failed a previous chunk are not sent again */
+    memset(same, 0, sizeof(struct file_dedupe_range));
+    cur_info = 0;
+    n_active = 0;
+    for (i = 0; i < n_dest; i++) {
+      if (w->dest[i].failed) continue;
+      n_active++;
+#ifdef FS_IOC_FIEMAP
+      /* Skip ranges that already point at the same blocks as the source */
+      if (src_shared && w->dest[i].file->device == files->device
+          && get_shared_extents(w->dest[i].fd, offset, length, w->dest_extents) == 0
+          && extents_same(w->src_extents, w->dest_extents, offset, length)) {
+        LOUD(fprintf(stderr, "dedupe: already shared at %" PRIu64 ": %s => %s\n",
+              offset, files->d_name, w->dest[i].file->d_name);)
+        w->shared_bytes += length;
+        continue;
       }
+#endif
+      memset(&same->info[cur_info], 0, sizeof(struct file_dedupe_range_info));
+      same->info[cur_info].dest_fd = w->dest[i].fd;
+      same->info[cur_info].dest_offset = offset;
+      w->dest_map[cur_info] = i;
+      cur_info++;
+    }
+    if (n_active == 0) return 0;
+    if (cur_info == 0) continue;
 
-      /* Open each file to be deduplicated */
-      cur_info = 0;
-      for (curfile = files->duplicates; curfile; curfile = curfile->duplicates) {
-        int errno2;
+    same->src_offset = offset;
+    same->src_length = length;
+    same->dest_count = (uint16_t)cur_info;  /* kernel type is __u16 */
 
-        /* Never allow hard links to be passed to dedupe */
-        if (curfile->device == files->device && curfile->inode == files->inode) {
-          LOUD(fprintf(stderr, "skipping hard linked file pair: '%s' = '%s'\n", curfile->d_name, files->d_name);)
-          continue;
+    /* Call dedupe ioctl to pass the files to the kernel */
+    if (ioctl(src, FIDEDUPERANGE, same) < 0) {
+      status = errno;
+      LOUD(fprintf(stderr, "dedupe: ioctl('%s' [%d], FIDEDUPERANGE, same) failed at %" PRIu64 ": %s\n",
+            files->d_name, src, offset, strerror(status));)
+      /* Remember filesystems without dedupe support and skip them later */
+      if (dedupe_unsupported(status)) {
+        pthread_mutex_lock(&dedupe_lock);
+        if (!device_nodedupe(files->device)) {
+          fprintf(stderr, "warning: filesystem does not support dedupe, skipping its files: '%s'\n", files->d_name);
+          if (nodedupe_cnt < MAX_NODEDUPE_DEVS) nodedupe_devs[nodedupe_cnt++] = files->device;
         }
+        pthread_mutex_unlock(&dedupe_lock);
+      } else fprintf(stderr, "dedupe failed against file '%s' (%u matches): %s\n", files->d_name, cur_info, strerror(status));
+      return -1;
+    }
 
-        dupe_filenames[cur_info] = curfile->d_name;
-        readonly = 0;
-        if (access(curfile->d_name, W_OK) != 0) readonly = 1;
-        fd = open(curfile->d_name, O_RDWR);
-        LOUD(fprintf(stderr, "opening loop: open('%s', O_RDWR) [%d]\n", curfile->d_name, fd);)
+    for (cur_info = 0; cur_info < same->dest_count; cur_info++) {
+      struct dedupe_dest * const dest = &w->dest[w->dest_map[cur_info]];
+
+      status = same->info[cur_info].status;
+      if (status == 0) continue;
+      dest->failed = 1;
+      if (same->info[cur_info].bytes_deduped == 0) {
+        fprintf(stderr, "warning: dedupe failed: %s => %s: %s [%d]%s\n",
+          files->d_name, dest->file->d_name, dedupeerrstr(status, errbuf, sizeof(errbuf)),
+          status, readonly_msg[dest->readonly]);
+      } else {
+        fprintf(stderr, "warning: dedupe only did %" PRIdMAX " bytes: %s => %s: %s [%d]%s\n",
+          (intmax_t)(offset + same->info[cur_info].bytes_deduped), files->d_name,
+          dest->file->d_name, dedupeerrstr(status, errbuf, sizeof(errbuf)), status,
+          readonly_msg[dest->readonly]);
+      }
+    }
+  }
+  return 0;
+}
 
-        /* If read-write open fails, privileged users can dedupe in read-only mode */
-        if (fd == -1) {
-          /* Preserve errno in case read-only fallback fails */
-          LOUD(fprintf(stderr, "opening loop: open('%s', O_RDWR) failed: %s\n", curfile->d_name, strerror(errno));)
-          errno2 = errno;
-          fd = open(curfile->d_name, O_RDONLY);
-          if (fd == -1) {
-            LOUD(fprintf(stderr, "opening loop: fallback open('%s', O_RDONLY) failed: %s\n", curfile->d_name, strerror(errno));)
-            fprintf(stderr, "Unable to open '%s': %s%s\n", curfile->d_name,
-                strerror(errno2), readonly_msg[readonly]);
-            continue;
-          }
-          LOUD(fprintf(stderr, "opening loop: fallback open('%s', O_RDONLY) succeeded\n", curfile->d_name);)
-        }
 
-        same->info[cur_info].fd = fd;
-        same->info[cur_info].logical_offset = 0;
-        cur_info++;
-        total_files++;
+/* Dedupe all files in one duplicate set against the first one */
+static void dedupe_set(struct dedupe_worker * const restrict w, const file_t * const restrict files)
+{
+  const file_t *curfile = files->duplicates;
+  unsigned int n_dest, i;
+  int src, fd, ret = 0;
+
+  src = open(files->d_name, O_RDONLY);
+  LOUD(fprintf(stderr, "source: open('%s', O_RDONLY) [%d]\n", files->d_name, src);)
+  if (src == -1) {
+    fprintf(stderr, "unable to open(\"%s\", O_RDONLY): %s\n", files->d_name, strerror(errno));
+    return;
+  }
+
+  /* Destinations are opened in batches to bound the number of open files */
+  while (curfile != NULL && ret == 0) {
+    n_dest = 0;
+    for (; curfile != NULL && n_dest < DEDUPE_BATCH; curfile = curfile->duplicates) {
+      int errno2, readonly;
+
+      /* Never allow hard links to be passed to dedupe */
+      if (curfile->device == files->device && curfile->inode == files->inode) {
+        LOUD(fprintf(stderr, "skipping hard linked file pair: '%s' = '%s'\n", curfile->d_name, files->d_name);)
+        continue;
       }
-      n_dupes = cur_info;
 
-      same->logical_offset = 0;
-      same->length = (uint64_t)files->size;
-      same->dest_count = (uint16_t)n_dupes;  /* kernel type is __u16 */
+      readonly = 0;
+      if (access(curfile->d_name, W_OK) != 0) readonly = 1;
+      fd = open(curfile->d_name, O_RDWR);
+      LOUD(fprintf(stderr, "opening loop: open('%s', O_RDWR) [%d]\n", curfile->d_name, fd);)
 
-      fd = open(files->d_name, O_RDONLY);
-      LOUD(fprintf(stderr, "source: open('%s', O_RDONLY) [%d]\n", files->d_name, fd);)
+      /* If read-write open fails, privileged users can dedupe in read-only mode */
       if (fd == -1) {
-        fprintf(stderr, "unable to open(\"%s\", O_RDONLY): %s\n", files->d_name, strerror(errno));
-        goto cleanup;
+        /* Preserve errno in case read-only fallback fails */
+        LOUD(fprintf(stderr, "opening loop: open('%s', O_RDWR) failed: %s\n", curfile->d_name, strerror(errno));)
+        errno2 = errno;
+        fd = open(curfile->d_name, O_RDONLY);
+        if (fd == -1) {
+          LOUD(fprintf(stderr, "opening loop: fallback open('%s', O_RDONLY) failed: %s\n", curfile->d_name, strerror(errno));)
+          fprintf(stderr, "Unable to open '%s': %s%s\n", curfile->d_name,
+              strerror(errno2), readonly_msg[readonly]);
+          continue;
+        }
+        LOUD(fprintf(stderr, "opening loop: fallback open('%s', O_RDONLY) succeeded\n", curfile->d_name);)
       }
 
-      /* Call dedupe ioctl to pass the files to the kernel */
-      ret = ioctl(fd, BTRFS_IOC_FILE_EXTENT_SAME, same);
-      LOUD(fprintf(stderr, "dedupe: ioctl('%s' [%d], BTRFS_IOC_FILE_EXTENT_SAME, same) => %d\n", files->d_name, fd, ret);)
-      if (close(fd) == -1) fprintf(stderr, "Unable to close(\"%s\"): %s\n", files->d_name, strerror(errno));
+      w->dest[n_dest].file = curfile;
+      w->dest[n_dest].fd = fd;
+      w->dest[n_dest].readonly = readonly;
+      w->dest[n_dest].failed = 0;
+      n_dest++;
+      w->total_files++;
+    }
 
-      if (ret < 0) {
-        fprintf(stderr, "dedupe failed against file '%s' (%d matches): %s\n", files->d_name, n_dupes, strerror(errno));
-        goto cleanup;
-      }
+    if (n_dest > 0) ret = dedupe_batch(w, src, files, n_dest);
 
-      for (cur_info = 0; cur_info < n_dupes; cur_info++) {
-        status = same->info[cur_info].status;
-        if (status != 0) {
-          if (same->info[cur_info].bytes_deduped == 0) {
-            fprintf(stderr, "warning: dedupe failed: %s => %s: %s [%d]%s\n",
-              files->d_name, dupe_filenames[cur_info], dedupeerrstr(status),
-              status, readonly_msg[readonly]);
-          } else {
-            fprintf(stderr, "warning: dedupe only did %" PRIdMAX " bytes: %s => %s: %s [%d]%s\n",
-              (intmax_t)same->info[cur_info].bytes_deduped, files->d_name,
-              dupe_filenames[cur_info], dedupeerrstr(status), status, readonly_msg[readonly]);
-          }
-        }
+    for (i = 0; i < n_dest; i++) {
+      if (close(w->dest[i].fd) == -1) {
+        fprintf(stderr, "unable to close(\"%s\"): %s", w->dest[i].file->d_name,
+          strerror(errno));
       }
+    }
+  }
 
-cleanup:
-      for (cur_info = 0; cur_info < n_dupes; cur_info++) {
-        if (close((int)same->info[cur_info].fd) == -1) {
-          fprintf(stderr, "unable to close(\"%s\"): %s", dupe_filenames[cur_info],
-            strerror(errno));
-        }
+  if (close(src) == -1) fprintf(stderr, "Unable to close(\"%s\"): %s\n", files->d_name, strerror(errno));
+  return;
+}
+
+
+/* Take duplicate sets off the list until none are left */
+static void *dedupe_worker(void *arg)
+{
+  struct dedupe_worker * const w = (struct dedupe_worker *)arg;
+  const file_t *files;
+  int skip;
+
+  while (1) {
+    pthread_mutex_lock(&dedupe_lock);
+    if (next_set == set_cnt) {
+      pthread_mutex_unlock(&dedupe_lock);
+      break;
+    }
+    files = dedupe_sets[next_set++];
+    if (!ISFLAG(flags, F_HIDEPROGRESS)) {
+      fprintf(stderr, "Dedupe [%u/%u] %u%% \r", next_set, set_cnt,
+          next_set * 100 / set_cnt);
+    }
+    /* Don't bother with filesystems that already refused to dedupe */
+    skip = device_nodedupe(files->device);
+    pthread_mutex_unlock(&dedupe_lock);
+
+    if (skip) {
+      LOUD(fprintf(stderr, "skipping set on no-dedupe device: '%s'\n", files->d_name);)
+      continue;
+    }
+    dedupe_set(w, files);
+  }
+  return NULL;
+}
+
+
+/* Dedupe one range of a file against a range of another file in
+ * DEDUPE_CHUNK_SIZE pieces. Returns the number of bytes deduplicated,
+ * or -1 with errno set if the kernel refused the first request. */
+extern int64_t dedupe_range(const int src_fd, const uint64_t src_offset,
+                const int dest_fd, const uint64_t dest_offset, const uint64_t length)
+{
+  uint64_t args[(sizeof(struct file_dedupe_range) + sizeof(struct file_dedupe_range_info)) / sizeof(uint64_t) + 1];
+  struct file_dedupe_range * const same = (struct file_dedupe_range *)args;
+  uint64_t done = 0, len;
+
+  while (done < length) {
+    len = length - done;
+    if (len > DEDUPE_CHUNK_SIZE) len = DEDUPE_CHUNK_SIZE;
+    memset(args, 0, sizeof(args));
+    same->src_offset = src_offset + done;
+    same->src_length = len;
+    same->dest_count = 1;
+    same->info[0].dest_fd = dest_fd;
+    same->info[0].dest_offset = dest_offset + done;
+
+    if (ioctl(src_fd, FIDEDUPERANGE, same) < 0) {
+      if (done == 0) return -1;
+      break;
+    }
+    LOUD(fprintf(stderr, "dedupe_range: %" PRIuMAX " => %" PRIuMAX " (%" PRIuMAX "): status %d, %" PRIuMAX " bytes\n",
+          (uintmax_t)same->src_offset, (uintmax_t)same->info[0].dest_offset, (uintmax_t)len,
+          same->info[0].status, (uintmax_t)same->info[0].bytes_deduped);)
+    done += same->info[0].bytes_deduped;
+    if (same->info[0].status != 0 || same->info[0].bytes_deduped < len) {
+      if (done == 0) {
+        errno = (same->info[0].status < 0) ? -same->info[0].status : EILSEQ;
+        return -1;
       }
+      break;
+    }
+  }
+  return (int64_t)done;
+}
+
 
-    } /* has dupes */
+extern void dedupefiles(file_t * restrict files)
+{
+  struct utsname utsname;
+  struct dedupe_worker *workers;
+  unsigned int max_dupes, max_files, total_files = 0;
+  uintmax_t shared_bytes = 0;
+  unsigned int n_workers, n_threads, i;
+  long cpus;
+  int err;
+
+  LOUD(fprintf(stderr, "\nRunning dedupefiles()\n");)
 
-    files = files->next;
+  /* Refuse to dedupe on 2.x kernels; they could damage user data */
+  if (uname(&utsname)) {
+    fprintf(stderr, "Failed to get kernel version! Aborting.\n");
+    exit(EXIT_FAILURE);
   }
+  LOUD(fprintf(stderr, "dedupefiles: uname got release '%s'\n", utsname.release));
+  if (*(utsname.release) == '2' && *(utsname.release + 1) == '.') {
+    fprintf(stderr, "Refusing to dedupe on a 2.x kernel; data loss could occur. Aborting.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  /* Collect every non-empty duplicate set */
+  get_max_dupes(files, &max_dupes, &max_files);
+  if (max_files == 0) return;
+  dedupe_sets = (file_t **)malloc(sizeof(file_t *) * max_files);
+  if (!dedupe_sets) oom("dedupefiles() sets");
+  set_cnt = 0;
+  next_set = 0;
+  for (; files; files = files->next)
+    if (ISFLAG(files->flags, F_HAS_DUPES) && files->size) dedupe_sets[set_cnt++] = files;
+
+  /* Sets are independent, so several can be handed to the kernel at once */
+  cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  n_workers = (cpus < 1) ? 1 : (unsigned int)cpus;
+  if (n_workers > DEDUPE_MAX_THREADS) n_workers = DEDUPE_MAX_THREADS;
+  if (n_workers > set_cnt) n_workers = set_cnt;
+
+  workers = (struct dedupe_worker *)calloc(n_workers, sizeof(struct dedupe_worker));
+  if (!workers) oom("dedupefiles() workers");
+  for (i = 0; i < n_workers; i++) {
+    workers[i].same = (struct file_dedupe_range *)calloc(1, DEDUPE_ARGS_SIZE);
+    if (!workers[i].same) oom("dedupefiles() structures");
+#ifdef FS_IOC_FIEMAP
+    workers[i].src_extents = (struct fiemap *)malloc(FIEMAP_SIZE);
+    workers[i].dest_extents = (struct fiemap *)malloc(FIEMAP_SIZE);
+    if (!workers[i].src_extents || !workers[i].dest_extents) oom("dedupefiles() extent maps");
+#endif
+  }
+  LOUD(fprintf(stderr, "dedupefiles: %u sets, largest %u files, %u threads, batch %u\n",
+        set_cnt, max_dupes, n_workers, (unsigned int)DEDUPE_BATCH);)
 
-  if (!ISFLAG(flags, F_HIDEPROGRESS)) fprintf(stderr, "Deduplication done (%d files processed)\n", total_files);
-  free(same);
-  free(dupe_filenames);
+  /* The calling thread is worker 0; if a thread can't be started the
+   * remaining workers simply pick up its share of the sets */
+  for (i = 1; i < n_workers; i++) {
+    err = pthread_create(&workers[i].thread, NULL, dedupe_worker, &workers[i]);
+    if (err != 0) {
+      LOUD(fprintf(stderr, "dedupefiles: pthread_create failed: %s\n", strerror(err));)
+      break;
+    }
+  }
+  n_threads = i;
+  dedupe_worker(&workers[0]);
+  for (i = 1; i < n_threads; i++) pthread_join(workers[i].thread, NULL);
+
+  for (i = 0; i < n_threads; i++) {
+    total_files += workers[i].total_files;
+    shared_bytes += workers[i].shared_bytes;
+  }
+  if (!ISFLAG(flags, F_HIDEPROGRESS)) {
+    fprintf(stderr, "Deduplication done (%u files processed", total_files);
+    if (shared_bytes != 0) fprintf(stderr, ", %" PRIuMAX " bytes already shared", shared_bytes);
+    fprintf(stderr, ")\n");
+  }
+
+  for (i = 0; i < n_workers; i++) {
+    free(workers[i].same);
+#ifdef FS_IOC_FIEMAP
+    free(workers[i].src_extents);
+    free(workers[i].dest_extents);
+#endif
+  }
+  free(workers);
+  free(dedupe_sets);
+  dedupe_sets = NULL;
   return;
 }
-#endif /* ENABLE_BTRFS */
+#endif /* ENABLE_DEDUPE */
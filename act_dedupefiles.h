@@ -1,4 +1,4 @@
-/* jdupes action for BTRFS block-level deduplication
+/* jdupes action for block-level deduplication (FIDEDUPERANGE)
  * This file is part of jdupes; see jdupes.c for license information */
 
 #ifndef ACT_DEDUPEFILES_H
@@ -8,8 +8,11 @@
 extern "C" {
 #endif
 
+#include <stdint.h>
 #include "jdupes.h"
 extern void dedupefiles(file_t * restrict files);
+extern int64_t dedupe_range(const int src_fd, const uint64_t src_offset,
+                const int dest_fd, const uint64_t dest_offset, const uint64_t length);
 
 #ifdef __cplusplus
 }
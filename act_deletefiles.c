@@ -8,6 +8,8 @@
 #include <string.h>
 #include "jdupes.h"
 #include "jody_win_unicode.h"
+#include "runstats.h"
+#include "outbuf.h"
 #include "act_deletefiles.h"
 
 /* For interactive deletion input */
@@ -45,7 +47,7 @@ extern void deletefiles(file_t *files, int prompt, FILE *tty)
       dupelist[counter] = files;
 
       if (prompt) {
-        printf("[%u] ", counter); fwprint(stdout, files->d_name, 1);
+        outbuf_printf("[%u] ", counter); outbuf_path(files->d_name, 1);
       }
 
       tmpfile = files->duplicates;
@@ -53,12 +55,12 @@ extern void deletefiles(file_t *files, int prompt, FILE *tty)
       while (tmpfile) {
         dupelist[++counter] = tmpfile;
         if (prompt) {
-          printf("[%u] ", counter); fwprint(stdout, tmpfile->d_name, 1);
+          outbuf_printf("[%u] ", counter); outbuf_path(tmpfile->d_name, 1);
         }
         tmpfile = tmpfile->duplicates;
       }
 
-      if (prompt) printf("\n");
+      if (prompt) outbuf_putc('\n');
 
       /* preserve only the first file */
       if (!prompt) {
@@ -66,6 +68,7 @@ extern void deletefiles(file_t *files, int prompt, FILE *tty)
         for (x = 2; x <= counter; x++) preserve[x] = 0;
       } else do {
         /* prompt for files to preserve */
+        outbuf_flush();
         printf("Set %u of %u: keep which files? (1 - %u, [a]ll, [n]one)",
           curgroup, groups, counter);
         if (ISFLAG(flags, F_SHOWSIZE)) printf(" (%" PRIuMAX " byte%c each)", (uintmax_t)files->size,
@@ -112,37 +115,43 @@ extern void deletefiles(file_t *files, int prompt, FILE *tty)
       } while (sum < 1); /* save at least one file */
 preserve_none:
 
-      printf("\n");
+      outbuf_putc('\n');
 
       for (x = 1; x <= counter; x++) {
         if (preserve[x]) {
-          printf("   [+] "); fwprint(stdout, dupelist[x]->d_name, 1);
+          outbuf_puts("   [+] "); outbuf_path(dupelist[x]->d_name, 1);
         } else {
 #ifdef UNICODE
           if (!M2W(dupelist[x]->d_name, wstr)) {
-            printf("   [!] "); fwprint(stdout, dupelist[x]->d_name, 0);
-            printf("-- MultiByteToWideChar failed\n");
+            outbuf_puts("   [!] "); outbuf_path(dupelist[x]->d_name, 0);
+            outbuf_puts("-- MultiByteToWideChar failed\n");
             continue;
           }
 #endif
           if (file_has_changed(dupelist[x])) {
-            printf("   [!] "); fwprint(stdout, dupelist[x]->d_name, 0);
-            printf("-- file changed since being scanned\n");
+            outbuf_puts("   [!] "); outbuf_path(dupelist[x]->d_name, 0);
+            outbuf_puts("-- file changed since being scanned\n");
 #ifdef UNICODE
           } else if (DeleteFileW(wstr) != 0) {
 #else
           } else if (remove(dupelist[x]->d_name) == 0) {
 #endif
-            printf("   [-] "); fwprint(stdout, dupelist[x]->d_name, 1);
+            STATS_SYSCALL(1);
+            outbuf_puts("   [-] "); outbuf_path(dupelist[x]->d_name, 1);
           } else {
-            printf("   [!] "); fwprint(stdout, dupelist[x]->d_name, 0);
-            printf("-- unable to delete file\n");
+            STATS_SYSCALL(1);
+            outbuf_puts("   [!] "); outbuf_path(dupelist[x]->d_name, 0);
+            outbuf_puts("-- unable to delete file\n");
           }
         }
       }
-      printf("\n");
+      outbuf_putc('\n');
+      /* This is a log of what was done; don't let a crash or a kill
+       * lose it, and keep it next to any warnings on stderr */
+      outbuf_flush();
     }
   }
+  outbuf_flush();
   free(dupelist);
   free(preserve);
   free(preservestr);
@@ -12,6 +12,8 @@
 #include <errno.h>
 #include "act_linkfiles.h"
 #include "jody_win_unicode.h"
+#include "runstats.h"
+#include "outbuf.h"
 #ifdef ON_WINDOWS
  #include "win_stat.h"
 #endif
@@ -98,7 +100,7 @@ extern void linkfiles(file_t *files, const int hard)
 #endif
       }
       if (!ISFLAG(flags, F_HIDEPROGRESS)) {
-        printf("[SRC] "); fwprint(stdout, srcfile->d_name, 1);
+        outbuf_puts("[SRC] "); outbuf_path(srcfile->d_name, 1);
       }
       for (; x <= counter; x++) {
         if (hard == 1) {
@@ -114,7 +116,7 @@ extern void linkfiles(file_t *files, const int hard)
               /* Don't show == arrows when not matching against other hard links */
               if (ISFLAG(flags, F_CONSIDERHARDLINKS))
                 if (!ISFLAG(flags, F_HIDEPROGRESS)) {
-                  printf("-==-> "); fwprint(stdout, dupelist[x]->d_name, 1);
+                  outbuf_puts("-==-> "); outbuf_path(dupelist[x]->d_name, 1);
                 }
             continue;
             }
@@ -190,6 +192,7 @@ extern void linkfiles(file_t *files, const int hard)
         strcpy(tempname, dupelist[x]->d_name);
         strcat(tempname, ".__jdupes__.tmp");
         /* Rename the source file to the temporary name */
+        STATS_SYSCALL(1);
 #ifdef UNICODE
         if (!M2W(tempname, wname2)) {
           fprintf(stderr, "error: MultiByteToWideChar failed: "); fwprint(stderr, srcfile->d_name, 1);
@@ -214,6 +217,7 @@ extern void linkfiles(file_t *files, const int hard)
         /* Create the desired hard link with the original file's name */
         errno = 0;
         success = 0;
+        STATS_SYSCALL(1);
 #ifdef ON_WINDOWS
  #ifdef UNICODE
         if (!M2W(srcfile->d_name, wname2)) {
@@ -243,13 +247,13 @@ extern void linkfiles(file_t *files, const int hard)
 #endif /* ON_WINDOWS */
         if (success) {
           if (!ISFLAG(flags, F_HIDEPROGRESS)) {
-            printf("%s ", hard ? "---->" : "-@@->");
-            fwprint(stdout, dupelist[x]->d_name, 1);
+            outbuf_puts(hard ? "----> " : "-@@-> ");
+            outbuf_path(dupelist[x]->d_name, 1);
           }
         } else {
           /* The link failed. Warn the user and put the link target back */
           if (!ISFLAG(flags, F_HIDEPROGRESS)) {
-            printf("-//-> "); fwprint(stdout, dupelist[x]->d_name, 1);
+            outbuf_puts("-//-> "); outbuf_path(dupelist[x]->d_name, 1);
           }
           fprintf(stderr, "warning: unable to link '"); fwprint(stderr, dupelist[x]->d_name, 0);
           fprintf(stderr, "' -> '"); fwprint(stderr, srcfile->d_name, 0);
@@ -272,6 +276,7 @@ extern void linkfiles(file_t *files, const int hard)
         }
 
         /* Remove temporary file to clean up; if we can't, reverse the linking */
+        STATS_SYSCALL(1);
 #ifdef UNICODE
           if (!M2W(tempname, wname2)) {
             fprintf(stderr, "error: MultiByteToWideChar failed: "); fwprint(stderr, tempname, 1);
@@ -307,11 +312,14 @@ extern void linkfiles(file_t *files, const int hard)
           }
         }
       }
-      if (!ISFLAG(flags, F_HIDEPROGRESS)) printf("\n");
+      if (!ISFLAG(flags, F_HIDEPROGRESS)) outbuf_putc('\n');
+      /* Show each set once it is linked, as it was before buffering */
+      outbuf_flush();
     }
     files = files->next;
   }
 
+  outbuf_flush();
   free(dupelist);
   return;
 }
@@ -0,0 +1,284 @@
+/* Print matched file sets as JSON, newline-delimited JSON or binary
+ *
+ * The plain text list only has paths in it and is awkward to parse when
+ * names can contain anything. These formats carry the size, hashes, inode,
+ * device and mtime of every file along with its path, and everything goes
+ * through the buffered writer. See act_output.h for the binary layout.
+ *
+ * JSON strings have to be valid UTF-8. A path that isn't gets U+FFFD in
+ * place of each bad byte and an extra "path_hex" member with the exact
+ * bytes of the name.
+ *
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#ifdef ON_WINDOWS
+ #include <io.h>
+ #include <fcntl.h>
+#endif
+#include "jdupes.h"
+#include "outbuf.h"
+#include "act_output.h"
+
+enum output_format output_format = OUTPUT_TEXT;
+
+static int started = 0;
+static uintmax_t sets_written = 0;
+
+static const char hexdigits[] = "0123456789abcdef";
+
+
+/* Select the format from its name; returns -1 for an unknown name */
+extern int output_set_format(const char * const restrict name)
+{
+  if (strcmp(name, "text") == 0) output_format = OUTPUT_TEXT;
+  else if (strcmp(name, "json") == 0) output_format = OUTPUT_JSON;
+  else if (strcmp(name, "ndjson") == 0) output_format = OUTPUT_NDJSON;
+  else if (strcmp(name, "binary") == 0) output_format = OUTPUT_BINARY;
+  else return -1;
+  return 0;
+}
+
+
+/* Length of the valid UTF-8 sequence at p, or 0 if it isn't one */
+static size_t utf8_len(const unsigned char * const restrict p)
+{
+  if (p[0] < 0x80) return 1;
+  if (p[0] >= 0xc2 && p[0] <= 0xdf) return ((p[1] & 0xc0) == 0x80) ? 2 : 0;
+  if (p[0] >= 0xe0 && p[0] <= 0xef) {
+    if ((p[1] & 0xc0) != 0x80 || (p[2] & 0xc0) != 0x80) return 0;
+    /* No overlong forms or UTF-16 surrogates */
+    if (p[0] == 0xe0 && p[1] < 0xa0) return 0;
+    if (p[0] == 0xed && p[1] > 0x9f) return 0;
+    return 3;
+  }
+  if (p[0] >= 0xf0 && p[0] <= 0xf4) {
+    if ((p[1] & 0xc0) != 0x80 || (p[2] & 0xc0) != 0x80 || (p[3] & 0xc0) != 0x80) return 0;
+    if (p[0] == 0xf0 && p[1] < 0x90) return 0;
+    if (p[0] == 0xf4 && p[1] > 0x8f) return 0;
+    return 4;
+  }
+  return 0;
+}
+
+
+/* Write a JSON string; returns 1 if bytes had to be replaced */
+static int json_string(const char * const restrict str)
+{
+  const unsigned char *p = (const unsigned char *)str;
+  const unsigned char *run = p;
+  int replaced = 0;
+
+  outbuf_putc('"');
+  while (*p != '\0') {
+    const size_t len = utf8_len(p);
+
+    /* Plain characters are copied in runs */
+    if (len > 1 || (len == 1 && *p >= 0x20 && *p != '"' && *p != '\\')) {
+      p += len;
+      continue;
+    }
+    outbuf_write(run, (size_t)(p - run));
+    if (len == 0) {
+      outbuf_puts("\\ufffd");
+      replaced = 1;
+    } else if (*p == '"' || *p == '\\') {
+      outbuf_putc('\\');
+      outbuf_putc((char)*p);
+    } else if (*p == '\n') outbuf_puts("\\n");
+    else if (*p == '\t') outbuf_puts("\\t");
+    else if (*p == '\r') outbuf_puts("\\r");
+    else {
+      char esc[7] = "\\u00";
+
+      esc[4] = hexdigits[*p >> 4];
+      esc[5] = hexdigits[*p & 0x0f];
+      outbuf_write(esc, 6);
+    }
+    run = ++p;
+  }
+  outbuf_write(run, (size_t)(p - run));
+  outbuf_putc('"');
+  return replaced;
+}
+
+
+static void json_hash(const char * const restrict name, const jdupes_hash_t hash, const int valid)
+{
+  char buf[64];
+
+  if (valid) snprintf(buf, sizeof(buf), ", \"%s\": \"%016" PRIx64 "\"", name, (uint64_t)hash);
+  else snprintf(buf, sizeof(buf), ", \"%s\": null", name);
+  outbuf_puts(buf);
+  return;
+}
+
+
+static void json_file(const file_t * const restrict file)
+{
+  char buf[128];
+
+  outbuf_puts("{\"path\": ");
+  if (json_string(file->d_name)) {
+    outbuf_puts(", \"path_hex\": \"");
+    for (const unsigned char *p = (const unsigned char *)file->d_name; *p != '\0'; p++) {
+      outbuf_putc(hexdigits[*p >> 4]);
+      outbuf_putc(hexdigits[*p & 0x0f]);
+    }
+    outbuf_putc('"');
+  }
+  snprintf(buf, sizeof(buf), ", \"inode\": %" PRIuMAX ", \"device\": %" PRIuMAX ", \"mtime\": %" PRIdMAX,
+      (uintmax_t)file->inode, (uintmax_t)file->device, (intmax_t)file->mtime);
+  outbuf_puts(buf);
+  json_hash("partial_hash", file->filehash_partial, ISFLAG(file->flags, F_HASH_PARTIAL));
+  json_hash("hash", file->filehash, ISFLAG(file->flags, F_HASH_FULL));
+  outbuf_putc('}');
+  return;
+}
+
+
+/* One set as a JSON object on a single line */
+static void json_set(const file_t * const restrict head)
+{
+  char buf[64];
+  const file_t *file = ISFLAG(flags, F_OMITFIRST) ? head->duplicates : head;
+
+  snprintf(buf, sizeof(buf), "{\"size\": %" PRIdMAX ", \"files\": [", (intmax_t)head->size);
+  outbuf_puts(buf);
+  for (; file != NULL; file = file->duplicates) {
+    json_file(file);
+    if (file->duplicates != NULL) outbuf_puts(", ");
+  }
+  outbuf_puts("]}");
+  return;
+}
+
+
+static void put_le32(unsigned char * const restrict p, const uint32_t v)
+{
+  for (int i = 0; i < 4; i++) p[i] = (unsigned char)(v >> (i * 8));
+  return;
+}
+
+
+static void put_le64(unsigned char * const restrict p, const uint64_t v)
+{
+  for (int i = 0; i < 8; i++) p[i] = (unsigned char)(v >> (i * 8));
+  return;
+}
+
+
+static size_t binary_file_len(const file_t * const restrict file)
+{
+  return (OUTPUT_BINARY_FILE + strlen(file->d_name) + 1 + 7) & ~(size_t)7;
+}
+
+
+static void binary_set(const file_t * const restrict head)
+{
+  static const unsigned char pad[8] = { 0 };
+  unsigned char rec[OUTPUT_BINARY_FILE];
+  const file_t * const first = ISFLAG(flags, F_OMITFIRST) ? head->duplicates : head;
+  size_t len = OUTPUT_BINARY_SET;
+  uint32_t count = 0;
+
+  for (const file_t *file = first; file != NULL; file = file->duplicates) {
+    len += binary_file_len(file);
+    count++;
+  }
+  if (len > UINT32_MAX) {
+    fprintf(stderr, "\nwarning: set of %" PRIu32 " files is too large for --output=binary, skipped\n", count);
+    return;
+  }
+  put_le32(rec, (uint32_t)len);
+  put_le32(rec + 4, count);
+  put_le64(rec + 8, (uint64_t)head->size);
+  outbuf_write(rec, OUTPUT_BINARY_SET);
+
+  for (const file_t *file = first; file != NULL; file = file->duplicates) {
+    const size_t path_len = strlen(file->d_name);
+    uint32_t hash_flags = 0;
+
+    if (ISFLAG(file->flags, F_HASH_PARTIAL)) hash_flags |= OUTPUT_HASH_PARTIAL;
+    if (ISFLAG(file->flags, F_HASH_FULL)) hash_flags |= OUTPUT_HASH_FULL;
+    put_le64(rec, (uint64_t)file->inode);
+    put_le64(rec + 8, (uint64_t)file->device);
+    put_le64(rec + 16, (uint64_t)(int64_t)file->mtime);
+    put_le64(rec + 24, (uint64_t)file->filehash_partial);
+    put_le64(rec + 32, (uint64_t)file->filehash);
+    put_le32(rec + 40, hash_flags);
+    put_le32(rec + 44, (uint32_t)path_len);
+    outbuf_write(rec, OUTPUT_BINARY_FILE);
+    outbuf_write(file->d_name, path_len + 1);
+    outbuf_write(pad, binary_file_len(file) - OUTPUT_BINARY_FILE - path_len - 1);
+  }
+  return;
+}
+
+
+static void output_start(void)
+{
+  unsigned char header[OUTPUT_BINARY_HEADER];
+
+  started = 1;
+  if (output_format == OUTPUT_JSON) outbuf_puts("{\"sets\": [\n");
+  else if (output_format == OUTPUT_BINARY) {
+#ifdef ON_WINDOWS
+    fflush(stdout);
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    memcpy(header, OUTPUT_BINARY_MAGIC, 8);
+    put_le32(header + 8, OUTPUT_BINARY_VERSION);
+    put_le32(header + 12, OUTPUT_BINARY_HEADER);
+    outbuf_write(header, OUTPUT_BINARY_HEADER);
+  }
+  return;
+}
+
+
+/* Write every duplicate set in a file list */
+extern void output_sets(const file_t * restrict files)
+{
+  if (!started) output_start();
+  for (; files != NULL; files = files->next) {
+    if (!ISFLAG(files->flags, F_HAS_DUPES)) continue;
+    switch (output_format) {
+      case OUTPUT_JSON:
+        if (sets_written != 0) outbuf_puts(",\n");
+        json_set(files);
+        break;
+      case OUTPUT_NDJSON:
+        json_set(files);
+        outbuf_putc('\n');
+        break;
+      case OUTPUT_BINARY:
+        binary_set(files);
+        break;
+      case OUTPUT_TEXT:
+      default:
+        return;
+    }
+    sets_written++;
+  }
+  return;
+}
+
+
+/* Close the output once all sets are written; an empty run still gets a
+ * complete document */
+extern void output_finish(void)
+{
+  unsigned char end[OUTPUT_BINARY_SET] = { 0 };
+
+  if (!started) output_start();
+  if (output_format == OUTPUT_JSON) outbuf_puts((sets_written != 0) ? "\n]}\n" : "]}\n");
+  else if (output_format == OUTPUT_BINARY) {
+    put_le32(end, OUTPUT_BINARY_SET);
+    outbuf_write(end, OUTPUT_BINARY_SET);
+  }
+  outbuf_flush();
+  return;
+}
@@ -0,0 +1,45 @@
+/* jdupes action for printing matched file sets in machine-readable formats
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#ifndef ACT_OUTPUT_H
+#define ACT_OUTPUT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "jdupes.h"
+
+enum output_format { OUTPUT_TEXT, OUTPUT_JSON, OUTPUT_NDJSON, OUTPUT_BINARY };
+extern enum output_format output_format;
+
+/* --output=binary layout; all integers are little-endian
+ *
+ * Header (16 bytes): the magic "JDUPESB\0", uint32 format version (1)
+ * and uint32 header length (16).
+ *
+ * Each duplicate set follows as one record: uint32 record length in bytes
+ * (header included, always a multiple of 8), uint32 number of files and
+ * uint64 file size, then one entry per file: uint64 inode, uint64 device,
+ * int64 mtime, uint64 partial hash, uint64 full hash, uint32 hash flags
+ * (1 = partial hash valid, 2 = full hash valid), uint32 path length, and
+ * the path with a NUL after it, zero padded to a multiple of 8 bytes.
+ *
+ * A record with no files marks the end of the output. */
+#define OUTPUT_BINARY_MAGIC "JDUPESB"
+#define OUTPUT_BINARY_VERSION 1
+#define OUTPUT_BINARY_HEADER 16
+#define OUTPUT_BINARY_SET 16
+#define OUTPUT_BINARY_FILE 48
+#define OUTPUT_HASH_PARTIAL 1U
+#define OUTPUT_HASH_FULL 2U
+
+extern int output_set_format(const char * const restrict name);
+extern void output_sets(const file_t * restrict files);
+extern void output_finish(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ACT_OUTPUT_H */
@@ -6,6 +6,7 @@
 #include <inttypes.h>
 #include "jdupes.h"
 #include "jody_win_unicode.h"
+#include "outbuf.h"
 #include "act_printmatches.h"
 
 extern void printmatches(file_t * restrict files)
@@ -22,23 +23,25 @@ extern void printmatches(file_t * restrict files)
     if (ISFLAG(files->flags, F_HAS_DUPES)) {
       printed = 1;
       if (!ISFLAG(flags, F_OMITFIRST)) {
-        if (ISFLAG(flags, F_SHOWSIZE)) printf("%" PRIdMAX " byte%c each:\n", (intmax_t)files->size,
+        if (ISFLAG(flags, F_SHOWSIZE)) outbuf_printf("%" PRIdMAX " byte%c each:\n", (intmax_t)files->size,
          (files->size != 1) ? 's' : ' ');
-        fwprint(stdout, files->d_name, cr);
+        outbuf_path(files->d_name, cr);
       }
       tmpfile = files->duplicates;
       while (tmpfile != NULL) {
-        fwprint(stdout, tmpfile->d_name, cr);
+        outbuf_path(tmpfile->d_name, cr);
         tmpfile = tmpfile->duplicates;
       }
-      if (files->next != NULL) fwprint(stdout, "", cr);
+      /* --stream prints one size group at a time, so any set might not be the last */
+      if (files->next != NULL || ISFLAG(flags, F_STREAM)) outbuf_path("", cr);
 
     }
 
     files = files->next;
   }
 
-  if (printed == 0) fwprint(stderr, "No duplicates found.", 1);
+  outbuf_flush();
+  if (printed == 0 && !ISFLAG(flags, F_STREAM)) fwprint(stderr, "No duplicates found.", 1);
 
   return;
 }
@@ -7,12 +7,15 @@
 #include "jdupes.h"
 #include "act_summarize.h"
 
-extern void summarizematches(const file_t * restrict files)
-{
-  unsigned int numsets = 0;
-  off_t numbytes = 0;
-  int numfiles = 0;
+/* Totals so far; --stream adds to them one size group at a time */
+static unsigned int numsets = 0;
+static off_t numbytes = 0;
+static int numfiles = 0;
 
+
+/* Add the duplicate sets in a file list to the totals */
+extern void summarize_add(const file_t * restrict files)
+{
   while (files != NULL) {
     file_t *tmpfile;
 
@@ -27,7 +30,12 @@ extern void summarizematches(const file_t * restrict files)
     }
     files = files->next;
   }
+  return;
+}
+
 
+extern void summarize_print(void)
+{
   if (numsets == 0)
     printf("No duplicates found.\n");
   else
@@ -39,3 +47,11 @@ extern void summarizematches(const file_t * restrict files)
   }
   return;
 }
+
+
+extern void summarizematches(const file_t * restrict files)
+{
+  summarize_add(files);
+  summarize_print();
+  return;
+}
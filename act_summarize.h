@@ -9,6 +9,8 @@ extern "C" {
 #endif
 
 #include "jdupes.h"
+extern void summarize_add(const file_t * restrict files);
+extern void summarize_print(void);
 extern void summarizematches(const file_t * restrict files);
 
 #ifdef __cplusplus
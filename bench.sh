@@ -0,0 +1,90 @@
+#!/bin/sh
+
+# Runs jdupes against a set of generated file trees and records per-phase
+# timing, throughput and peak memory use. Trees are generated once by
+# bench_corpus and reused until their parameters change.
+#
+# Environment variables:
+#   BENCH_DIR      where the trees are kept (default: ./bench_data)
+#   BENCH_RESULTS  where results go (default: ./bench_results)
+#   BENCH_CORPORA  which trees to run (default: all of them)
+#   BENCH_RUNS     measured runs per tree after one warm-up run (default: 3)
+#   BENCH_OPTS     extra jdupes options, e.g. "-Q" or "--size-prepass"
+#   BENCH_COLD=1   drop the page cache before every run (needs root, Linux)
+
+test -z "$BENCH_DIR" && BENCH_DIR=./bench_data
+test -z "$BENCH_RESULTS" && BENCH_RESULTS=./bench_results
+test -z "$BENCH_RUNS" && BENCH_RUNS=3
+test -z "$BENCH_CORPORA" && BENCH_CORPORA="small large headers links sparse deep"
+
+test ! -x ./jdupes && echo "Build jdupes first, silly" && exit 1
+test ! -x ./bench_corpus && echo "Build bench_corpus first ('make bench_corpus')" && exit 1
+
+# Tree parameters: bench_corpus options for each named corpus
+corpus_params () {
+	case "$1" in
+		small)   echo "-n 50000 -s log:64:65536 -d 0.3 -D 3 -F 8" ;;
+		large)   echo "-n 200 -s log:1048576:67108864 -d 0.4 -D 1 -F 4" ;;
+		headers) echo "-n 5000 -s fixed:262144 -d 0.1 -H 0.6" ;;
+		links)   echo "-n 20000 -s log:1024:262144 -d 0.5 -l 0.5" ;;
+		sparse)  echo "-n 500 -s log:1048576:67108864 -d 0.3 -S 0.8 -D 1" ;;
+		deep)    echo "-n 20000 -s log:512:32768 -d 0.2 -D 5 -F 6" ;;
+		*)       return 1 ;;
+	esac
+}
+
+# Pull a number out of a --stats JSON report; "phase" is optional
+stat_value () {
+	if [ -z "$3" ]
+		then sed -n "s/^  \"$2\": \([0-9.]*\),*$/\1/p" "$1"
+		else sed -n "s/^    \"$3\": {.*\"$2\": \([0-9.]*\).*/\1/p" "$1"
+	fi
+}
+
+mkdir -p "$BENCH_DIR" "$BENCH_RESULTS" || exit 1
+RESULTS="$BENCH_RESULTS/results.txt"
+REV="$(git rev-parse --short HEAD 2>/dev/null || echo unknown)"
+STAMP="$(date +%Y%m%d-%H%M%S)"
+
+if [ ! -e "$RESULTS" ]
+	then echo "# stamp rev corpus run wall_s cpu_s files dupes bytes_read MB_per_s files_per_s max_rss_kib scan_s stat_s match_s partial_s full_s confirm_s action_s" > "$RESULTS"
+fi
+echo "# $STAMP jdupes $(./jdupes -v | head -n 1) opts: $BENCH_OPTS" >> "$RESULTS"
+
+for CORPUS in $BENCH_CORPORA
+	do PARAMS="$(corpus_params "$CORPUS")"
+	if [ -z "$PARAMS" ]
+		then echo "Unknown corpus '$CORPUS'"; exit 1
+	fi
+	TREE="$BENCH_DIR/$CORPUS"
+	if [ "$(cat "$TREE.params" 2>/dev/null)" != "$PARAMS" ]
+		then echo "Generating $CORPUS tree..."
+		rm -rf "$TREE" "$TREE.params"
+		./bench_corpus $PARAMS "$TREE" || exit 1
+		echo "$PARAMS" > "$TREE.params"
+	fi
+
+	# Warm-up run so that the first measured run isn't special
+	test "$BENCH_COLD" != "1" && ./jdupes -rq $BENCH_OPTS "$TREE" > /dev/null
+
+	RUN=1
+	while [ $RUN -le $BENCH_RUNS ]
+		do JSON="$BENCH_RESULTS/$STAMP-$CORPUS-$RUN.json"
+		if [ "$BENCH_COLD" = "1" ]
+			then sync; echo 3 > /proc/sys/vm/drop_caches || exit 1
+		fi
+		./jdupes -rq $BENCH_OPTS --stats="$JSON" "$TREE" > /dev/null || exit 1
+		WALL="$(stat_value "$JSON" wall_seconds)"
+		BYTES="$(stat_value "$JSON" bytes_read)"
+		FILES="$(stat_value "$JSON" files)"
+		LINE="$STAMP $REV $CORPUS $RUN $WALL $(stat_value "$JSON" cpu_seconds) $FILES"
+		LINE="$LINE $(stat_value "$JSON" duplicates) $BYTES"
+		LINE="$LINE $(echo "$BYTES $FILES $WALL" | awk '{ if ($3 > 0) printf "%.1f %.0f", $1 / $3 / 1048576, $2 / $3; else print "0 0" }')"
+		LINE="$LINE $(stat_value "$JSON" max_rss_kib)"
+		for PHASE in scan stat match partial_hash full_hash confirm action
+			do LINE="$LINE $(stat_value "$JSON" wall_seconds $PHASE)"
+		done
+		echo "$LINE" | tee -a "$RESULTS"
+		RUN=$((RUN + 1))
+	done
+done
@@ -0,0 +1,321 @@
+/* Synthetic file tree generator for jdupes benchmarks
+ *
+ * Builds a reproducible directory tree with a controlled number of files,
+ * file size distribution, duplicate ratio, shared file headers, hard
+ * links, sparse files and directory depth. All file data comes from a
+ * seeded pseudo-random generator, so the same options always produce the
+ * same tree.
+ *
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* Files with a shared header match on the partial hash but not beyond */
+#define HEADER_SIZE 4096
+/* Sparse files only hold data in this much space at each end */
+#define SPARSE_DATA 4096
+#define WRITE_BUFSIZE 1048576
+#define MAX_LEAVES 100000
+#define PATH_SIZE 4096
+
+enum size_dist { DIST_FIXED, DIST_UNIFORM, DIST_LOG };
+
+/* One file with unique content; duplicates point back to one of these */
+struct original {
+  off_t size;
+  uint64_t seed;
+  uint64_t header_seed;   /* 0 if the file has its own header */
+  int sparse;
+  uint32_t file;          /* Index of the file that holds this content */
+};
+
+static const char *program_name;
+static char *buf;
+static uint64_t rng_state;
+
+static enum size_dist dist = DIST_LOG;
+static off_t size_min = 1024, size_max = 1048576;
+static unsigned long file_count = 10000;
+static double dupe_ratio = 0.2, header_ratio = 0.05, link_ratio = 0.0, sparse_ratio = 0.0;
+static unsigned int depth = 2, fanout = 8;
+static uint64_t seed = 1;
+
+
+/* splitmix64; file data is a pure function of seed and offset, so any
+ * part of any file can be regenerated without writing what comes before */
+static inline uint64_t mix(uint64_t x)
+{
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+  return x ^ (x >> 31);
+}
+
+
+static inline uint64_t rng(void)
+{
+  rng_state += 0x9E3779B97F4A7C15ULL;
+  return mix(rng_state);
+}
+
+
+/* Uniform double in [0, 1) */
+static inline double rng_unit(void)
+{
+  return (double)(rng() >> 11) / 9007199254740992.0;
+}
+
+
+static void usage(void)
+{
+  printf("Usage: %s [options] DIRECTORY\n\n", program_name);
+  printf(" -n COUNT     number of files to create (default 10000)\n");
+  printf(" -s DIST      file size distribution: fixed:SIZE, uniform:MIN:MAX or\n");
+  printf("              log:MIN:MAX (log-uniform, the default, 1024 to 1048576)\n");
+  printf(" -d RATIO     fraction of files that duplicate an earlier file (0.2)\n");
+  printf(" -H RATIO     fraction of unique files sharing a %d byte header with\n", HEADER_SIZE);
+  printf("              another unique file of the same size (0.05)\n");
+  printf(" -l RATIO     fraction of duplicates made as hard links (0)\n");
+  printf(" -S RATIO     fraction of unique files made sparse (0)\n");
+  printf(" -D DEPTH     directory depth (default 2)\n");
+  printf(" -F FANOUT    subdirectories per directory (default 8)\n");
+  printf(" -r SEED      random seed (default 1)\n");
+  return;
+}
+
+
+static void fail(const char * const restrict what, const char * const restrict path)
+{
+  fprintf(stderr, "%s: %s '%s': %s\n", program_name, what, path, strerror(errno));
+  exit(EXIT_FAILURE);
+}
+
+
+static double get_ratio(const char * const restrict arg, const char opt)
+{
+  char *end;
+  const double r = strtod(arg, &end);
+
+  if (*arg == '\0' || *end != '\0' || r < 0.0 || r > 1.0) {
+    fprintf(stderr, "%s: -%c needs a ratio from 0 to 1: '%s'\n", program_name, opt, arg);
+    exit(EXIT_FAILURE);
+  }
+  return r;
+}
+
+
+static void parse_dist(const char * const restrict arg)
+{
+  long long a = 0, b = 0;
+
+  if (sscanf(arg, "fixed:%lld", &a) == 1 && a >= 0) {
+    dist = DIST_FIXED;
+    size_min = size_max = (off_t)a;
+  } else if (sscanf(arg, "uniform:%lld:%lld", &a, &b) == 2 && a >= 0 && b >= a) {
+    dist = DIST_UNIFORM;
+    size_min = (off_t)a;
+    size_max = (off_t)b;
+  } else if (sscanf(arg, "log:%lld:%lld", &a, &b) == 2 && a >= 1 && b >= a) {
+    dist = DIST_LOG;
+    size_min = (off_t)a;
+    size_max = (off_t)b;
+  } else {
+    fprintf(stderr, "%s: bad size distribution '%s'\n", program_name, arg);
+    exit(EXIT_FAILURE);
+  }
+  return;
+}
+
+
+static off_t pick_size(void)
+{
+  switch (dist) {
+    case DIST_FIXED:
+      return size_min;
+    case DIST_UNIFORM:
+      return size_min + (off_t)(rng_unit() * (double)(size_max - size_min + 1));
+    case DIST_LOG:
+      return (off_t)exp(log((double)size_min)
+          + rng_unit() * (log((double)size_max + 1.0) - log((double)size_min)));
+    default:
+      return size_min;
+  }
+}
+
+
+/* Path of a file's leaf directory and name, spread evenly over leaves */
+static void file_path(char * const restrict path, const char * const restrict root,
+                const unsigned long leaves, const uint32_t file)
+{
+  unsigned long leaf = (file * 2654435761UL) % leaves;
+  char *p = path;
+
+  p += snprintf(p, PATH_SIZE, "%s", root);
+  for (unsigned int i = 0; i < depth; i++) {
+    unsigned long div = 1;
+    for (unsigned int j = i + 1; j < depth; j++) div *= fanout;
+    p += snprintf(p, (size_t)(PATH_SIZE - (p - path)), "/d%lu", (leaf / div) % fanout);
+  }
+  snprintf(p, (size_t)(PATH_SIZE - (p - path)), "/f%07" PRIu32, file);
+  return;
+}
+
+
+static void make_dirs(char * const restrict path, const unsigned int level)
+{
+  const size_t len = strlen(path);
+
+  if (level == depth) return;
+  for (unsigned int i = 0; i < fanout; i++) {
+    snprintf(path + len, PATH_SIZE - len, "/d%u", i);
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) fail("cannot create directory", path);
+    make_dirs(path, level + 1);
+  }
+  path[len] = '\0';
+  return;
+}
+
+
+/* Fill [start, end) of an open file with the data for a seed; start
+ * must be a multiple of 8 */
+static void fill(const int fd, const char * const restrict path, const uint64_t data_seed,
+                off_t start, const off_t end)
+{
+  while (start < end) {
+    const size_t len = (end - start > WRITE_BUFSIZE) ? WRITE_BUFSIZE : (size_t)(end - start);
+    uint64_t word = (uint64_t)start / sizeof(uint64_t);
+
+    for (size_t i = 0; i < len; i += sizeof(uint64_t), word++) {
+      const uint64_t v = mix(data_seed + word * 0x9E3779B97F4A7C15ULL);
+      memcpy(buf + i, &v, (len - i < sizeof(uint64_t)) ? len - i : sizeof(uint64_t));
+    }
+    if (pwrite(fd, buf, len, start) != (ssize_t)len) fail("cannot write", path);
+    start += (off_t)len;
+  }
+  return;
+}
+
+
+static void write_file(const char * const restrict path, const struct original * const restrict o)
+{
+  int fd;
+
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) fail("cannot create", path);
+  if (o->sparse) {
+    /* Data at both ends with a hole in between */
+    if (ftruncate(fd, o->size) != 0) fail("cannot size", path);
+    fill(fd, path, o->seed, 0, (o->size < SPARSE_DATA) ? o->size : SPARSE_DATA);
+    if (o->size > SPARSE_DATA * 2) fill(fd, path, o->seed, (o->size - SPARSE_DATA) & ~(off_t)7, o->size);
+  } else if (o->header_seed != 0 && o->size > HEADER_SIZE) {
+    fill(fd, path, o->header_seed, 0, HEADER_SIZE);
+    fill(fd, path, o->seed, HEADER_SIZE, o->size);
+  } else fill(fd, path, o->seed, 0, o->size);
+  if (close(fd) != 0) fail("cannot close", path);
+  return;
+}
+
+
+int main(int argc, char **argv)
+{
+  struct original *orig;
+  uint32_t orig_cnt = 0;
+  unsigned long leaves = 1, dupes = 0, links = 0, sparse = 0, headers = 0;
+  char path[PATH_SIZE], target[PATH_SIZE];
+  const char *root;
+  int opt;
+
+  program_name = argv[0];
+  while ((opt = getopt(argc, argv, "n:s:d:H:l:S:D:F:r:h")) != -1) {
+    switch (opt) {
+      case 'n': file_count = strtoul(optarg, NULL, 10); break;
+      case 's': parse_dist(optarg); break;
+      case 'd': dupe_ratio = get_ratio(optarg, 'd'); break;
+      case 'H': header_ratio = get_ratio(optarg, 'H'); break;
+      case 'l': link_ratio = get_ratio(optarg, 'l'); break;
+      case 'S': sparse_ratio = get_ratio(optarg, 'S'); break;
+      case 'D': depth = (unsigned int)strtoul(optarg, NULL, 10); break;
+      case 'F': fanout = (unsigned int)strtoul(optarg, NULL, 10); break;
+      case 'r': seed = strtoull(optarg, NULL, 10); break;
+      case 'h': usage(); exit(EXIT_SUCCESS);
+      default: usage(); exit(EXIT_FAILURE);
+    }
+  }
+  if (optind != argc - 1 || file_count == 0 || file_count > UINT32_MAX || fanout == 0) {
+    usage();
+    exit(EXIT_FAILURE);
+  }
+  root = argv[optind];
+  for (unsigned int i = 0; i < depth; i++) {
+    leaves *= fanout;
+    if (leaves > MAX_LEAVES) {
+      fprintf(stderr, "%s: more than %d leaf directories; lower -D or -F\n", program_name, MAX_LEAVES);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  orig = (struct original *)malloc(sizeof(struct original) * file_count);
+  buf = (char *)malloc(WRITE_BUFSIZE);
+  if (orig == NULL || buf == NULL) {
+    fprintf(stderr, "%s: out of memory\n", program_name);
+    exit(EXIT_FAILURE);
+  }
+  rng_state = seed * 0x9E3779B97F4A7C15ULL + 1;
+
+  /* Never write into an existing tree: O_TRUNC on an old hard link
+   * would silently change other files too */
+  if (mkdir(root, 0755) != 0) fail("cannot create directory", root);
+  strcpy(path, root);
+  make_dirs(path, 0);
+
+  for (uint32_t file = 0; file < file_count; file++) {
+    file_path(path, root, leaves, file);
+    if (orig_cnt != 0 && rng_unit() < dupe_ratio) {
+      /* Duplicate (or hard link) of a random earlier original */
+      const struct original * const o = &orig[rng() % orig_cnt];
+
+      dupes++;
+      if (rng_unit() < link_ratio) {
+        file_path(target, root, leaves, o->file);
+        if (link(target, path) != 0) fail("cannot link", path);
+        links++;
+      } else write_file(path, o);
+      continue;
+    }
+
+    struct original * const o = &orig[orig_cnt];
+    o->size = pick_size();
+    o->seed = rng() | 1;
+    o->header_seed = 0;
+    o->sparse = 0;
+    o->file = file;
+    if (orig_cnt != 0 && rng_unit() < header_ratio) {
+      /* Same size and header as another original; only the tail differs */
+      struct original * const other = &orig[rng() % orig_cnt];
+      if (other->header_seed == 0) other->header_seed = other->seed;
+      o->size = other->size;
+      o->header_seed = other->header_seed;
+      headers++;
+    } else if (rng_unit() < sparse_ratio) {
+      o->sparse = 1;
+      sparse++;
+    }
+    write_file(path, o);
+    orig_cnt++;
+  }
+
+  printf("%s: %lu files (%" PRIu32 " unique, %lu duplicates, %lu hard links, %lu shared headers, %lu sparse) in %lu directories\n",
+      root, file_count, orig_cnt, dupes, links, headers, sparse, leaves);
+  free(orig);
+  free(buf);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,349 @@
+/* Micro-benchmarks for the hot jdupes kernels
+ *
+ * Times the same code jdupes runs (built from the same source files) in
+ * isolation: XXH64 hashing in I/O chunk sized pieces, numeric_sort() and
+ * sort keys on file names, string_malloc()/string_free(), and the
+ * read-and-memcmp() loop of confirmmatch(), over a sweep of input and
+ * chunk sizes. Useful for tuning values such as the I/O chunk size or
+ * SMA_MAX_FREE, which can be changed for this binary with
+ * CFLAGS_EXTRA='-DSMA_MAX_FREE=64'.
+ *
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include "xxhash.h"
+#include "jody_sort.h"
+#include "string_malloc.h"
+
+#define MAX_BUFSIZE 16777216
+#define MAX_CHUNK 4194304
+#define SMA_BATCH 4096
+#define SORT_NAMES 1024
+
+static const size_t chunk_sizes[] = { 4096, 16384, 65536, 262144, 1048576, 4194304, 0 };
+static const size_t data_sizes[] = { 4096, 65536, 1048576, 16777216, 0 };
+
+static const char *program_name;
+static uint64_t min_ns = 200000000;
+static char *buf1, *buf2;
+static volatile uint64_t sink;
+
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000U + (uint64_t)ts.tv_nsec;
+}
+
+
+/* Print one result line; bytes is per operation, 0 if not meaningful */
+static void report(const char * const restrict kernel, const char * const restrict param,
+                const uint64_t ns, const uint64_t ops, const size_t bytes)
+{
+  const double ns_op = (double)ns / (double)ops;
+
+  if (bytes != 0) printf("%-16s %-26s %14.1f %10.3f\n", kernel, param, ns_op, (double)bytes / ns_op);
+  else printf("%-16s %-26s %14.1f %10s\n", kernel, param, ns_op, "-");
+  fflush(stdout);
+  return;
+}
+
+
+/* Run a kernel with a doubling number of iterations until one batch
+ * takes at least min_ns; returns the time of that batch */
+#define MEASURE(iters, elapsed, ...) do { \
+  for (iters = 1; ; iters *= 2) { \
+    const uint64_t start_ = now_ns(); \
+    for (uint64_t i_ = 0; i_ < iters; i_++) { __VA_ARGS__; } \
+    elapsed = now_ns() - start_; \
+    if (elapsed >= min_ns) break; \
+  } \
+} while (0)
+
+
+/* Hash a "file" of data_size bytes in chunk sized pieces like get_filehash() */
+static void bench_hash(void)
+{
+  char param[64];
+  uint64_t iters, elapsed;
+
+  for (int d = 0; data_sizes[d] != 0; d++) {
+    for (int c = 0; chunk_sizes[c] != 0; c++) {
+      const size_t size = data_sizes[d], chunk = chunk_sizes[c];
+
+      /* Chunks past the data size all behave like the first one */
+      if (c > 0 && chunk_sizes[c - 1] >= size) break;
+      MEASURE(iters, elapsed, {
+        XXH64_state_t * const xxhstate = XXH64_createState();
+        XXH64_reset(xxhstate, 0);
+        for (size_t off = 0; off < size; off += chunk)
+          XXH64_update(xxhstate, buf1 + off, (size - off < chunk) ? size - off : chunk);
+        sink += XXH64_digest(xxhstate);
+        XXH64_freeState(xxhstate);
+      });
+      snprintf(param, sizeof(param), "size=%zu chunk=%zu", size, chunk);
+      report("xxh64", param, elapsed, iters, size);
+    }
+  }
+  return;
+}
+
+
+/* Compare typical file names that differ in numbers, text or length */
+static void bench_sort(void)
+{
+  static const char * const prefixes[] = {
+    "a", "/home/user/Pictures/2018", "/srv/backup/hosts/fileserver-01/home/user/projects/src", NULL
+  };
+  char **names;
+  static unsigned char keys[SORT_NAMES][NUMERIC_SORT_KEY_MAX(256)];
+  static size_t key_len[SORT_NAMES];
+  char param[64];
+  uint64_t iters, elapsed;
+
+  names = (char **)malloc(sizeof(char *) * SORT_NAMES);
+  if (names == NULL) {
+    fprintf(stderr, "%s: out of memory\n", program_name);
+    exit(EXIT_FAILURE);
+  }
+  for (int p = 0; prefixes[p] != NULL; p++) {
+    for (int s = 0; s < 3; s++) {
+      size_t len = 0;
+
+      for (unsigned int i = 0; i < SORT_NAMES; i++) {
+        names[i] = (char *)malloc(256);
+        if (names[i] == NULL) {
+          fprintf(stderr, "%s: out of memory\n", program_name);
+          exit(EXIT_FAILURE);
+        }
+        const unsigned int a = (i * 7919U) % 1000U, b = i % 13U;
+
+        if (s == 0) snprintf(names[i], 256, "%s/IMG_%04u.JPG", prefixes[p], a);
+        else if (s == 1) snprintf(names[i], 256, "%s/track %u - part %u.flac", prefixes[p], a, b);
+        else snprintf(names[i], 256, "%s/%u/%u/file.txt", prefixes[p], a, b);
+        len += strlen(names[i]);
+      }
+      MEASURE(iters, elapsed, {
+        const unsigned int n = (unsigned int)(i_ % SORT_NAMES);
+        sink += (uint64_t)numeric_sort(names[n], names[(n + 1) % SORT_NAMES], 1);
+      });
+      snprintf(param, sizeof(param), "shape=%d len=%zu", s, len / SORT_NAMES);
+      report("numeric_sort", param, elapsed, iters, 0);
+
+      /* The same comparisons with keys made up front, as jdupes sorts */
+      MEASURE(iters, elapsed, {
+        const unsigned int n = (unsigned int)(i_ % SORT_NAMES);
+        key_len[n] = numeric_sort_key(names[n], keys[n]);
+      });
+      report("numeric_sort_key", param, elapsed, iters, 0);
+      for (unsigned int i = 0; i < SORT_NAMES; i++) key_len[i] = numeric_sort_key(names[i], keys[i]);
+      MEASURE(iters, elapsed, {
+        const unsigned int n = (unsigned int)(i_ % SORT_NAMES);
+        const unsigned int m = (n + 1) % SORT_NAMES;
+        const int cmp = memcmp(keys[n], keys[m], (key_len[n] < key_len[m]) ? key_len[n] : key_len[m]);
+        sink += (uint64_t)((cmp != 0) ? cmp : (key_len[n] > key_len[m]) - (key_len[n] < key_len[m]));
+      });
+      report("sort_key_compare", param, elapsed, iters, 0);
+      for (unsigned int i = 0; i < SORT_NAMES; i++) free(names[i]);
+    }
+  }
+  free(names);
+  return;
+}
+
+
+/* Allocate a batch of blocks and free them in a given order, the way
+ * file records come and go during a scan; each op is one alloc + free */
+static void bench_sma(void)
+{
+  static const size_t sizes[] = { 16, 64, 256, 1024, 0 };
+  static const char * const orders[] = { "lifo", "fifo", "alternate" };
+  void **ptrs;
+  char param[64];
+  uint64_t iters, elapsed;
+
+  ptrs = (void **)malloc(sizeof(void *) * SMA_BATCH);
+  if (ptrs == NULL) {
+    fprintf(stderr, "%s: out of memory\n", program_name);
+    exit(EXIT_FAILURE);
+  }
+  for (int s = 0; sizes[s] != 0; s++) {
+    for (int o = 0; o < 3; o++) {
+      MEASURE(iters, elapsed, {
+        for (unsigned int j = 0; j < SMA_BATCH; j++) ptrs[j] = string_malloc(sizes[s] + (j & 7U));
+        for (unsigned int j = 0; j < SMA_BATCH; j++) {
+          const unsigned int k = (o == 0) ? SMA_BATCH - 1 - j : (o == 1) ? j
+              : ((j & 1U) ? SMA_BATCH - 1 - j / 2 : j / 2);
+          string_free(ptrs[k]);
+        }
+      });
+      string_malloc_destroy();
+      snprintf(param, sizeof(param), "size=%zu order=%s", sizes[s], orders[o]);
+      report("string_malloc", param, elapsed, iters * SMA_BATCH, 0);
+
+      MEASURE(iters, elapsed, {
+        for (unsigned int j = 0; j < SMA_BATCH; j++) ptrs[j] = malloc(sizes[s] + (j & 7U));
+        for (unsigned int j = 0; j < SMA_BATCH; j++) {
+          const unsigned int k = (o == 0) ? SMA_BATCH - 1 - j : (o == 1) ? j
+              : ((j & 1U) ? SMA_BATCH - 1 - j / 2 : j / 2);
+          free(ptrs[k]);
+        }
+      });
+      report("malloc", param, elapsed, iters * SMA_BATCH, 0);
+    }
+  }
+  free(ptrs);
+  return;
+}
+
+
+/* Create a temporary file holding the first size bytes of buf1 */
+static FILE *make_tmpfile(const size_t size)
+{
+  char path[64];
+  FILE *fp;
+  int fd;
+
+  strcpy(path, "/tmp/jdupes-bench.XXXXXX");
+  fd = mkstemp(path);
+  if (fd == -1 || (fp = fdopen(fd, "w+b")) == NULL) {
+    fprintf(stderr, "%s: cannot create temporary file: %s\n", program_name, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  unlink(path);
+  if (fwrite(buf1, size, 1, fp) != 1 || fflush(fp) != 0) {
+    fprintf(stderr, "%s: cannot write temporary file: %s\n", program_name, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  return fp;
+}
+
+
+/* confirmmatch(): memcmp() of equal data in chunks, from memory and
+ * through stdio from two cached files */
+static void bench_confirm(void)
+{
+  char param[64];
+  char *c1, *c2;
+  uint64_t iters, elapsed;
+
+  c1 = (char *)malloc(MAX_CHUNK);
+  c2 = (char *)malloc(MAX_CHUNK);
+  if (c1 == NULL || c2 == NULL) {
+    fprintf(stderr, "%s: out of memory\n", program_name);
+    exit(EXIT_FAILURE);
+  }
+
+  memcpy(buf2, buf1, MAX_BUFSIZE);
+  for (int d = 0; data_sizes[d] != 0; d++) {
+    const size_t size = data_sizes[d];
+    FILE * const f1 = make_tmpfile(size);
+    FILE * const f2 = make_tmpfile(size);
+
+    for (int c = 0; chunk_sizes[c] != 0; c++) {
+      const size_t chunk = chunk_sizes[c];
+
+      if (c > 0 && chunk_sizes[c - 1] >= size) break;
+      snprintf(param, sizeof(param), "size=%zu chunk=%zu", size, chunk);
+
+      MEASURE(iters, elapsed, {
+        for (size_t off = 0; off < size; off += chunk)
+          sink += (uint64_t)memcmp(buf1 + off, buf2 + off, (size - off < chunk) ? size - off : chunk);
+      });
+      report("memcmp", param, elapsed, iters, size);
+
+      /* Same loop as confirmmatch() itself */
+      MEASURE(iters, elapsed, {
+        size_t r1, r2;
+        fseek(f1, 0, SEEK_SET);
+        fseek(f2, 0, SEEK_SET);
+        do {
+          r1 = fread(c1, sizeof(char), chunk, f1);
+          r2 = fread(c2, sizeof(char), chunk, f2);
+          if (r1 != r2 || memcmp(c1, c2, r1)) break;
+        } while (r2);
+        sink += r1;
+      });
+      report("confirmmatch", param, elapsed, iters, size);
+    }
+    fclose(f1);
+    fclose(f2);
+  }
+  free(c1);
+  free(c2);
+  return;
+}
+
+
+static void usage(void)
+{
+  printf("Usage: %s [-t MILLISECONDS] [KERNEL...]\n\n", program_name);
+  printf("Kernels: hash, sort, sma, confirm (default: all)\n");
+  printf(" -t MS   minimum time per measurement (default 200)\n");
+  printf("Output: kernel, parameters, ns per operation, GB/s where it applies\n");
+  return;
+}
+
+
+int main(int argc, char **argv)
+{
+  int opt;
+
+  program_name = argv[0];
+  while ((opt = getopt(argc, argv, "t:h")) != -1) {
+    switch (opt) {
+      case 't':
+        min_ns = strtoull(optarg, NULL, 10) * 1000000U;
+        if (min_ns == 0) {
+          usage();
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'h':
+        usage();
+        exit(EXIT_SUCCESS);
+      default:
+        usage();
+        exit(EXIT_FAILURE);
+    }
+  }
+
+  buf1 = (char *)malloc(MAX_BUFSIZE);
+  buf2 = (char *)malloc(MAX_BUFSIZE);
+  if (buf1 == NULL || buf2 == NULL) {
+    fprintf(stderr, "%s: out of memory\n", program_name);
+    exit(EXIT_FAILURE);
+  }
+  for (size_t i = 0; i < MAX_BUFSIZE; i++) buf1[i] = (char)(i * 2654435761U >> 13);
+
+  printf("%-16s %-26s %14s %10s\n", "# kernel", "parameters", "ns/op", "GB/s");
+  if (optind == argc) {
+    bench_hash();
+    bench_sort();
+    bench_sma();
+    bench_confirm();
+  }
+  for (int i = optind; i < argc; i++) {
+    if (strcmp(argv[i], "hash") == 0) bench_hash();
+    else if (strcmp(argv[i], "sort") == 0) bench_sort();
+    else if (strcmp(argv[i], "sma") == 0) bench_sma();
+    else if (strcmp(argv[i], "confirm") == 0) bench_confirm();
+    else {
+      fprintf(stderr, "%s: unknown kernel '%s'\n", program_name, argv[i]);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  free(buf1);
+  free(buf2);
+  return EXIT_SUCCESS;
+}
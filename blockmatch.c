@@ -0,0 +1,362 @@
+/* Block-level duplicate detection using content-defined chunking
+ *
+ * File data read by get_filehash() is also fed through a rolling "gear"
+ * hash that cuts it into variable-sized chunks at content-defined points,
+ * so identical data produces identical chunks even when it sits at
+ * different offsets in different files. Each chunk is hashed and indexed;
+ * chunks that occur more than once are coalesced into shared ranges that
+ * are reported and optionally deduplicated with range-based dedupe.
+ *
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "jdupes.h"
+#include "blockmatch.h"
+#include "jody_win_unicode.h"
+#ifdef ENABLE_DEDUPE
+ #include "act_dedupefiles.h"
+#endif
+
+/* Dedupe ranges must be aligned to filesystem blocks at least this big */
+#define BLOCKS_MIN_ALIGN 4096
+
+struct chunk {
+  uint64_t hash;
+  uint64_t offset;
+  uint32_t length;
+  uint32_t file;
+};
+
+/* A range of file dst holding the same data as a range of file src */
+struct shared_range {
+  uint32_t src;
+  uint32_t dst;
+  uint64_t src_offset;
+  uint64_t dst_offset;
+  uint64_t length;
+};
+
+static file_t **bfiles = NULL;
+static uint32_t bfile_cnt = 0, bfile_max = 0;
+static struct chunk *chunks = NULL;
+static size_t chunk_cnt = 0, chunk_max = 0;
+
+/* Chunking parameters */
+static uint64_t gear[256];
+static uint64_t boundary_mask;
+static size_t min_size, max_size;
+
+/* State of the file currently being chunked */
+static XXH64_state_t *xxhstate = NULL;
+static uint64_t roll, cur_offset;
+static size_t cur_len, cur_first;
+
+
+/* Set up chunking for an average chunk size (must be a power of two) */
+extern void blocks_init(const size_t avg_size)
+{
+  uint64_t seed = 0x6a09e667f3bcc908ULL;
+  unsigned int bits = 0;
+
+  /* Fixed pseudo-random gear table (splitmix64) so chunking is repeatable */
+  for (int i = 0; i < 256; i++) {
+    uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    gear[i] = z ^ (z >> 31);
+  }
+
+  while (((size_t)1 << bits) < avg_size) bits++;
+  /* The top bits of a gear hash depend on the most bytes */
+  boundary_mask = ((1ULL << bits) - 1) << (64 - bits);
+  min_size = avg_size / 4;
+  max_size = avg_size * 4;
+
+  xxhstate = XXH64_createState();
+  if (xxhstate == NULL) oom("blocks_init()");
+  LOUD(fprintf(stderr, "blocks_init: avg %" PRIuMAX ", min %" PRIuMAX ", max %" PRIuMAX "\n",
+        (uintmax_t)avg_size, (uintmax_t)min_size, (uintmax_t)max_size);)
+  return;
+}
+
+
+static void add_chunk(void)
+{
+  if (chunk_cnt == chunk_max) {
+    chunk_max = (chunk_max == 0) ? 4096 : chunk_max * 2;
+    chunks = (struct chunk *)realloc(chunks, sizeof(struct chunk) * chunk_max);
+    if (chunks == NULL) oom("add_chunk()");
+  }
+  chunks[chunk_cnt].hash = XXH64_digest(xxhstate);
+  chunks[chunk_cnt].offset = cur_offset;
+  chunks[chunk_cnt].length = (uint32_t)cur_len;
+  chunks[chunk_cnt].file = bfile_cnt - 1;
+  chunk_cnt++;
+
+  cur_offset += cur_len;
+  cur_len = 0;
+  XXH64_reset(xxhstate, 0);
+  return;
+}
+
+
+/* Start chunking a new file; its data must follow in order */
+extern void blocks_file_begin(file_t * const restrict file)
+{
+  if (bfile_cnt == bfile_max) {
+    bfile_max = (bfile_max == 0) ? 1024 : bfile_max * 2;
+    bfiles = (file_t **)realloc(bfiles, sizeof(file_t *) * bfile_max);
+    if (bfiles == NULL) oom("blocks_file_begin()");
+  }
+  bfiles[bfile_cnt++] = file;
+  roll = 0;
+  cur_offset = 0;
+  cur_len = 0;
+  cur_first = chunk_cnt;
+  XXH64_reset(xxhstate, 0);
+  return;
+}
+
+
+/* Cut the next piece of file data into chunks */
+extern void blocks_feed(const void * const restrict data, const size_t len)
+{
+  const unsigned char * const p = (const unsigned char *)data;
+  size_t seg = 0;
+
+  for (size_t i = 0; i < len; i++) {
+    roll = (roll << 1) + gear[p[i]];
+    cur_len++;
+    if ((cur_len >= min_size && (roll & boundary_mask) == 0) || cur_len >= max_size) {
+      XXH64_update(xxhstate, p + seg, i + 1 - seg);
+      seg = i + 1;
+      add_chunk();
+    }
+  }
+  if (seg < len) XXH64_update(xxhstate, p + seg, len - seg);
+  return;
+}
+
+
+/* Finish the current file; if it couldn't be read completely, forget it */
+extern void blocks_file_end(const int ok)
+{
+  if (!ok) {
+    chunk_cnt = cur_first;
+    bfile_cnt--;
+    return;
+  }
+  if (cur_len > 0) add_chunk();
+  return;
+}
+
+
+static int sort_chunks(const void *a, const void *b)
+{
+  const struct chunk * const c1 = (const struct chunk *)a;
+  const struct chunk * const c2 = (const struct chunk *)b;
+
+  if (c1->hash != c2->hash) return (c1->hash < c2->hash) ? -1 : 1;
+  if (c1->length != c2->length) return (c1->length < c2->length) ? -1 : 1;
+  if (c1->file != c2->file) return (c1->file < c2->file) ? -1 : 1;
+  if (c1->offset != c2->offset) return (c1->offset < c2->offset) ? -1 : 1;
+  return 0;
+}
+
+
+static int sort_ranges(const void *a, const void *b)
+{
+  const struct shared_range * const r1 = (const struct shared_range *)a;
+  const struct shared_range * const r2 = (const struct shared_range *)b;
+
+  if (r1->src != r2->src) return (r1->src < r2->src) ? -1 : 1;
+  if (r1->dst != r2->dst) return (r1->dst < r2->dst) ? -1 : 1;
+  if (r1->dst_offset != r2->dst_offset) return (r1->dst_offset < r2->dst_offset) ? -1 : 1;
+  return 0;
+}
+
+
+/* Turn repeated chunks into a sorted list of coalesced shared ranges */
+static struct shared_range *find_shared_ranges(size_t * const restrict count)
+{
+  struct shared_range *ranges, *out;
+  size_t n = 0, i, j;
+
+  qsort(chunks, chunk_cnt, sizeof(struct chunk), sort_chunks);
+
+  /* Every repeat of a chunk refers to its first occurrence */
+  ranges = (struct shared_range *)malloc(sizeof(struct shared_range) * (chunk_cnt + 1));
+  if (ranges == NULL) oom("find_shared_ranges()");
+  for (i = 0; i < chunk_cnt; i = j) {
+    for (j = i + 1; j < chunk_cnt && chunks[j].hash == chunks[i].hash
+        && chunks[j].length == chunks[i].length; j++) {
+      ranges[n].src = chunks[i].file;
+      ranges[n].dst = chunks[j].file;
+      ranges[n].src_offset = chunks[i].offset;
+      ranges[n].dst_offset = chunks[j].offset;
+      ranges[n].length = chunks[j].length;
+      n++;
+    }
+  }
+  free(chunks);
+  chunks = NULL;
+  chunk_cnt = 0;
+  chunk_max = 0;
+
+  /* Merge ranges that continue each other in both files */
+  qsort(ranges, n, sizeof(struct shared_range), sort_ranges);
+  out = ranges;
+  for (i = 0; i < n; i++) {
+    if (out != ranges) {
+      struct shared_range * const prev = out - 1;
+      if (prev->src == ranges[i].src && prev->dst == ranges[i].dst
+          && prev->src_offset + prev->length == ranges[i].src_offset
+          && prev->dst_offset + prev->length == ranges[i].dst_offset) {
+        prev->length += ranges[i].length;
+        continue;
+      }
+    }
+    *out++ = ranges[i];
+  }
+  n = (size_t)(out - ranges);
+
+  /* Tiny ranges are noise unless they are the whole of both files */
+  out = ranges;
+  for (i = 0; i < n; i++) {
+    if (ranges[i].length < min_size && !(ranges[i].length == (uint64_t)bfiles[ranges[i].src]->size
+          && ranges[i].length == (uint64_t)bfiles[ranges[i].dst]->size)) continue;
+    *out++ = ranges[i];
+  }
+  *count = (size_t)(out - ranges);
+  return ranges;
+}
+
+
+#ifdef ENABLE_DEDUPE
+/* Dedupe every range shared by one pair of files; returns bytes shared */
+static uintmax_t dedupe_pair(const struct shared_range * const restrict r, const size_t n)
+{
+  const file_t * const src = bfiles[r->src];
+  const file_t * const dst = bfiles[r->dst];
+  struct stat st;
+  uintmax_t total = 0;
+  uint64_t align, adj, so, doff, len;
+  int64_t ret;
+  int src_fd, dst_fd;
+
+  /* Overlapping ranges within one file can't be deduplicated */
+  if (r->src == r->dst || src->device != dst->device) return 0;
+
+  src_fd = open(src->d_name, O_RDONLY);
+  if (src_fd == -1) {
+    fprintf(stderr, "unable to open(\"%s\", O_RDONLY): %s\n", src->d_name, strerror(errno));
+    return 0;
+  }
+  dst_fd = open(dst->d_name, O_RDWR);
+  if (dst_fd == -1) dst_fd = open(dst->d_name, O_RDONLY);
+  if (dst_fd == -1) {
+    fprintf(stderr, "Unable to open '%s': %s\n", dst->d_name, strerror(errno));
+    close(src_fd);
+    return 0;
+  }
+  align = BLOCKS_MIN_ALIGN;
+  if (fstat(dst_fd, &st) == 0 && (uint64_t)st.st_blksize > align) align = (uint64_t)st.st_blksize;
+
+  for (size_t i = 0; i < n; i++) {
+    /* Both offsets must land on block boundaries at the same time */
+    if (r[i].src_offset % align != r[i].dst_offset % align) continue;
+    adj = (align - r[i].src_offset % align) % align;
+    if (r[i].length <= adj) continue;
+    so = r[i].src_offset + adj;
+    doff = r[i].dst_offset + adj;
+    len = r[i].length - adj;
+    /* Only a range that ends both files may have a partial last block */
+    if (!(so + len == (uint64_t)src->size && doff + len == (uint64_t)dst->size)) len -= len % align;
+    if (len == 0) continue;
+
+    ret = dedupe_range(src_fd, so, dst_fd, doff, len);
+    if (ret < 0) {
+      fprintf(stderr, "warning: block dedupe failed: %s => %s: %s\n", src->d_name, dst->d_name, strerror(errno));
+      /* No point in trying the rest of this pair */
+      if (errno == EOPNOTSUPP || errno == ENOTTY || errno == EXDEV) break;
+      continue;
+    }
+    total += (uintmax_t)ret;
+  }
+
+  close(dst_fd);
+  close(src_fd);
+  return total;
+}
+#endif /* ENABLE_DEDUPE */
+
+
+/* Report all shared ranges and dedupe them if requested */
+extern void blockmatch(void)
+{
+  struct shared_range *ranges;
+  size_t n, i, j;
+  uintmax_t pairs = 0, bytes = 0;
+#ifdef ENABLE_DEDUPE
+  uintmax_t deduped = 0;
+#endif
+
+  ranges = find_shared_ranges(&n);
+  if (n == 0) {
+    fwprint(stderr, "No duplicate blocks found.", 1);
+    free(ranges);
+    return;
+  }
+
+  for (i = 0; i < n; i = j) {
+    for (j = i; j < n && ranges[j].src == ranges[i].src && ranges[j].dst == ranges[i].dst; j++)
+      bytes += ranges[j].length;
+    pairs++;
+
+    /* Each file pair is printed as source, destination, then one line per
+     * range giving the source offset, destination offset and length */
+    if (!ISFLAG(flags, F_SUMMARIZEMATCHES)) {
+      fwprint(stdout, bfiles[ranges[i].src]->d_name, 1);
+      fwprint(stdout, bfiles[ranges[i].dst]->d_name, 1);
+      for (size_t k = i; k < j; k++)
+        printf("  %" PRIu64 " %" PRIu64 " %" PRIu64 "\n", ranges[k].src_offset,
+            ranges[k].dst_offset, ranges[k].length);
+      printf("\n");
+    }
+#ifdef ENABLE_DEDUPE
+    if (ISFLAG(flags, F_DEDUPEFILES)) deduped += dedupe_pair(&ranges[i], j - i);
+#endif
+  }
+
+  if (ISFLAG(flags, F_SUMMARIZEMATCHES)) {
+    printf("%" PRIuMAX " shared block ranges in %" PRIuMAX " file pairs occupying %" PRIuMAX " bytes\n",
+        (uintmax_t)n, pairs, bytes);
+  }
+#ifdef ENABLE_DEDUPE
+  if (ISFLAG(flags, F_DEDUPEFILES) && !ISFLAG(flags, F_HIDEPROGRESS))
+    fprintf(stderr, "Block deduplication done (%" PRIuMAX " bytes deduplicated)\n", deduped);
+#endif
+  free(ranges);
+  return;
+}
+
+
+extern void blocks_cleanup(void)
+{
+  free(chunks);
+  free(bfiles);
+  if (xxhstate != NULL) XXH64_freeState(xxhstate);
+  chunks = NULL;
+  bfiles = NULL;
+  xxhstate = NULL;
+  chunk_cnt = chunk_max = 0;
+  bfile_cnt = bfile_max = 0;
+  return;
+}
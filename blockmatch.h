@@ -0,0 +1,29 @@
+/* jdupes block-level duplicate detection with content-defined chunking
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#ifndef BLOCKMATCH_H
+#define BLOCKMATCH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "jdupes.h"
+
+/* Allowed range for the --blocks average chunk size */
+#define BLOCKS_MIN_AVG 1024
+#define BLOCKS_MAX_AVG 16777216
+#define BLOCKS_DEFAULT_AVG 65536
+
+extern void blocks_init(const size_t avg_size);
+extern void blocks_file_begin(file_t * const restrict file);
+extern void blocks_feed(const void * const restrict data, const size_t len);
+extern void blocks_file_end(const int ok);
+extern void blockmatch(void);
+extern void blocks_cleanup(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BLOCKMATCH_H */
@@ -0,0 +1,169 @@
+/* Per-device I/O chunk size tuning
+ *
+ * The best read size depends on the storage, not the CPU cache: a few
+ * KiB per read is fine for files in the page cache, but NVMe drives and
+ * network filesystems need reads of hundreds of KiB or more before they
+ * get anywhere near full speed. Every device starts out at the default
+ * chunk size and the time spent in full-size reads is added up. After
+ * each sample the chunk size is doubled for as long as throughput keeps
+ * improving by a useful margin; if the first step up doesn't help at all,
+ * smaller sizes are tried instead. A device that has settled costs
+ * nothing more than a table lookup per read. The I/O queue workers read
+ * at the same time as the main thread, so the table is kept under a lock.
+ *
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#ifndef ON_WINDOWS
+ #include <pthread.h>
+#endif
+#include "jdupes.h"
+#include "chunksize.h"
+
+/* Devices tuned separately; reads from any others use the initial size */
+#define CHUNK_MAX_DEVS 16
+/* A sample needs at least this many bytes and reads before it counts */
+#define CHUNK_SAMPLE_BYTES 16777216
+#define CHUNK_SAMPLE_READS 8
+/* Percentage a size must beat the best one by to be worth using */
+#define CHUNK_GAIN 5.0
+
+struct chunk_dev {
+  dev_t dev;
+  size_t size;        /* Chunk size currently in use */
+  size_t best;        /* Fastest size measured so far */
+  double best_rate;   /* Bytes per second at the fastest size */
+  uint64_t ns;        /* Sample in progress */
+  uintmax_t bytes;
+  unsigned int reads;
+  int dir;            /* 1 = growing, -1 = shrinking, 0 = settled */
+};
+
+int chunk_tuning = 0;
+
+static size_t initial_size = 65536;
+static struct chunk_dev devs[CHUNK_MAX_DEVS];
+static unsigned int dev_cnt = 0;
+#ifndef ON_WINDOWS
+static pthread_mutex_t chunk_lock = PTHREAD_MUTEX_INITIALIZER;
+ #define CHUNK_LOCK() pthread_mutex_lock(&chunk_lock)
+ #define CHUNK_UNLOCK() pthread_mutex_unlock(&chunk_lock)
+#else
+ #define CHUNK_LOCK()
+ #define CHUNK_UNLOCK()
+#endif
+
+
+/* Start tuning from the given size unless it was set by hand */
+extern void chunk_tune_init(const size_t initial, const int enabled)
+{
+  initial_size = initial;
+  chunk_tuning = enabled;
+  dev_cnt = 0;
+  return;
+}
+
+
+static struct chunk_dev *find_dev(const dev_t dev)
+{
+  struct chunk_dev *d;
+
+  for (unsigned int i = 0; i < dev_cnt; i++)
+    if (devs[i].dev == dev) return &devs[i];
+  if (dev_cnt == CHUNK_MAX_DEVS) return NULL;
+
+  d = &devs[dev_cnt++];
+  d->dev = dev;
+  d->size = d->best = initial_size;
+  d->best_rate = 0.0;
+  d->ns = 0;
+  d->bytes = 0;
+  d->reads = 0;
+  d->dir = 1;
+  return d;
+}
+
+
+/* Chunk size to use for the next read from a device */
+extern size_t chunk_size(const dev_t dev)
+{
+  const struct chunk_dev *d;
+  size_t size;
+
+  if (!chunk_tuning) return initial_size;
+  CHUNK_LOCK();
+  d = find_dev(dev);
+  size = (d == NULL) ? initial_size : d->size;
+  CHUNK_UNLOCK();
+  return size;
+}
+
+
+/* Move on to the next size to try once a sample is complete */
+static void chunk_step(struct chunk_dev * const restrict d, const double rate)
+{
+  size_t next;
+
+  if (rate * 100.0 >= d->best_rate * (100.0 + CHUNK_GAIN)) {
+    d->best = d->size;
+    d->best_rate = rate;
+  } else if (d->dir > 0 && d->best == initial_size) {
+    /* Bigger reads didn't help; see if smaller ones do */
+    d->dir = -1;
+    d->size = initial_size;
+  } else d->dir = 0;
+
+  next = (d->dir > 0) ? d->size * 2 : d->size / 2;
+  if (d->dir == 0 || next < CHUNK_TUNE_MIN || next > CHUNK_TUNE_MAX) {
+    d->size = d->best;
+    d->dir = 0;
+  } else d->size = next;
+  return;
+}
+
+
+/* Account for one read from a device. Only reads of the full chunk size
+ * count; short reads at the ends of files say little about the device. */
+extern void chunk_sample(const dev_t dev, const size_t len, const uint64_t ns)
+{
+  struct chunk_dev *d;
+
+  if (!chunk_tuning) return;
+  CHUNK_LOCK();
+  d = find_dev(dev);
+  if (d == NULL || d->dir == 0 || len != d->size) goto done;
+
+  d->ns += ns;
+  d->bytes += len;
+  d->reads++;
+  if (d->bytes < CHUNK_SAMPLE_BYTES || d->reads < CHUNK_SAMPLE_READS) goto done;
+
+  chunk_step(d, (double)d->bytes * 1000000000.0 / (double)(d->ns + 1));
+  d->ns = 0;
+  d->bytes = 0;
+  d->reads = 0;
+done:
+  CHUNK_UNLOCK();
+  return;
+}
+
+
+/* Write the chosen chunk sizes as a JSON object member for --stats */
+extern void chunk_report(FILE * const restrict fp)
+{
+  fprintf(fp, "  \"chunk_size\": {\n    \"initial\": %" PRIuMAX ", \"tuned\": %s, \"devices\": [",
+      (uintmax_t)initial_size, chunk_tuning ? "true" : "false");
+  for (unsigned int i = 0; i < dev_cnt; i++) {
+    const struct chunk_dev * const d = &devs[i];
+
+    fprintf(fp, "%s\n      { \"device\": %" PRIuMAX ", \"chunk_size\": %" PRIuMAX
+        ", \"settled\": %s, \"read_mib_per_s\": %.1f }",
+        (i == 0) ? "" : ",", (uintmax_t)d->dev, (uintmax_t)d->size,
+        (d->dir == 0) ? "true" : "false", d->best_rate / 1048576.0);
+  }
+  fprintf(fp, "%s]\n  },\n", (dev_cnt == 0) ? "" : "\n    ");
+  return;
+}
@@ -0,0 +1,34 @@
+/* jdupes per-device I/O chunk size tuning
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#ifndef CHUNKSIZE_H
+#define CHUNKSIZE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Chunk sizes the tuner will try, in powers of two */
+#ifndef CHUNK_TUNE_MIN
+ #define CHUNK_TUNE_MIN 4096
+#endif
+#ifndef CHUNK_TUNE_MAX
+ #define CHUNK_TUNE_MAX 4194304
+#endif
+
+extern int chunk_tuning;
+
+extern void chunk_tune_init(const size_t initial, const int enabled);
+extern size_t chunk_size(const dev_t dev);
+extern void chunk_sample(const dev_t dev, const size_t len, const uint64_t ns);
+extern void chunk_report(FILE * const restrict fp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CHUNKSIZE_H */
@@ -0,0 +1,594 @@
+/* Whole-directory duplicate detection
+ *
+ * After normal file matching, every scanned directory gets a Merkle-style
+ * digest built from the sorted names of its entries plus the duplicate
+ * set of each file and the digest of each subdirectory. Directories with
+ * equal digests hold identically named files with identical contents all
+ * the way down, so each copied tree is reported (and optionally deleted
+ * or replaced by a symlink) as a single result instead of one set per file.
+ *
+ * Only scanned files count: a directory holding a file that has no
+ * duplicate anywhere can never match, but files that were never scanned
+ * (excluded, hidden, empty without -z, not recursed into) are invisible.
+ *
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include "jdupes.h"
+#include "dirmatch.h"
+#include "jody_paths.h"
+#include "jody_win_unicode.h"
+
+/* For interactive deletion input */
+#define INPUT_SIZE 512
+
+struct dirnode {
+  char *path;
+  struct dirnode *parent;
+  uint64_t digest;
+  uintmax_t size;         /* Bytes in all files below this directory */
+  unsigned int files;     /* Number of files below this directory */
+  int depth;
+  unsigned int order;     /* Position when sorted deepest first */
+  unsigned int group;     /* Duplicate directory set number, 0 = none */
+  size_t first, count;    /* This directory's entries in the entry list */
+  int poisoned;           /* Can't be a duplicate of anything */
+  int removed;            /* Deleted (or replaced) by an earlier set */
+};
+
+struct direntry {
+  struct dirnode *dir;
+  const char *name;
+  file_t *file;           /* NULL for a subdirectory */
+  struct dirnode *sub;
+  uint64_t dupe_set;      /* Duplicate set of a file, 0 if unique */
+};
+
+struct dirgroup {
+  size_t first, count;    /* Members in the group member list */
+  int covered;            /* Already reported as part of the parent set */
+};
+
+/* Open-addressed table of directory nodes keyed by path */
+static struct dirnode **nodes = NULL;
+static size_t node_slots = 0, node_cnt = 0;
+static struct direntry *entries = NULL;
+static size_t entry_cnt = 0, entry_max = 0;
+
+static char **roots;
+static int root_cnt;
+
+
+static inline uint64_t path_hash(const char * const restrict path, const size_t len)
+{
+  return XXH64(path, len, 0);
+}
+
+
+static struct dirnode **node_slot(const char * const restrict path, const size_t len)
+{
+  size_t i = (size_t)path_hash(path, len) & (node_slots - 1);
+
+  while (nodes[i] != NULL && (strncmp(nodes[i]->path, path, len) != 0 || nodes[i]->path[len] != '\0'))
+    i = (i + 1) & (node_slots - 1);
+  return &nodes[i];
+}
+
+
+static void add_entry(struct dirnode * const restrict dir, const char * const restrict name,
+                file_t * const restrict file, struct dirnode * const restrict sub)
+{
+  if (entry_cnt == entry_max) {
+    entry_max = (entry_max == 0) ? 4096 : entry_max * 2;
+    entries = (struct direntry *)realloc(entries, sizeof(struct direntry) * entry_max);
+    if (entries == NULL) oom("dirmatch entries");
+  }
+  entries[entry_cnt].dir = dir;
+  entries[entry_cnt].name = name;
+  entries[entry_cnt].file = file;
+  entries[entry_cnt].sub = sub;
+  entries[entry_cnt].dupe_set = 0;
+  entry_cnt++;
+  return;
+}
+
+
+static int is_root(const char * const restrict path, const size_t len)
+{
+  for (int i = 0; i < root_cnt; i++)
+    if (strncmp(roots[i], path, len) == 0 && roots[i][len] == '\0') return 1;
+  return 0;
+}
+
+
+/* Find or create a directory node and its parents up to a scanned root */
+static struct dirnode *add_dir(const char * const restrict path, const size_t len)
+{
+  struct dirnode **slot, *node;
+  const char *p;
+  size_t plen;
+
+  /* Keep the table at most half full */
+  if (node_cnt >= node_slots / 2) {
+    struct dirnode ** const old = nodes;
+    const size_t old_slots = node_slots;
+
+    node_slots = (old_slots == 0) ? 1024 : old_slots * 2;
+    nodes = (struct dirnode **)calloc(node_slots, sizeof(struct dirnode *));
+    if (nodes == NULL) oom("dirmatch nodes");
+    for (size_t i = 0; i < old_slots; i++)
+      if (old[i] != NULL) *node_slot(old[i]->path, strlen(old[i]->path)) = old[i];
+    free(old);
+  }
+
+  slot = node_slot(path, len);
+  if (*slot != NULL) return *slot;
+
+  node = (struct dirnode *)calloc(1, sizeof(struct dirnode));
+  if (node == NULL) oom("dirmatch node");
+  node->path = (char *)malloc(len + 1);
+  if (node->path == NULL) oom("dirmatch node path");
+  memcpy(node->path, path, len);
+  node->path[len] = '\0';
+  node->depth = -1;
+  *slot = node;
+  node_cnt++;
+
+  if (is_root(path, len)) return node;
+
+  /* A directory above the scanned ones has unknown contents */
+  for (p = path + len; p > path && *(p - 1) != dir_sep; p--);
+  if (p == path || len == 1) {
+    node->poisoned = 1;
+    return node;
+  }
+  plen = (p - 1 == path) ? 1 : (size_t)(p - 1 - path);
+  node->parent = add_dir(path, plen);
+  add_entry(node->parent, node->path + (p - path), NULL, node);
+  return node;
+}
+
+
+static int node_depth(struct dirnode * const restrict node)
+{
+  if (node->depth < 0) node->depth = (node->parent == NULL) ? 0 : node_depth(node->parent) + 1;
+  return node->depth;
+}
+
+
+static int sort_nodes_by_depth(const void *a, const void *b)
+{
+  const struct dirnode * const n1 = *(struct dirnode * const *)a;
+  const struct dirnode * const n2 = *(struct dirnode * const *)b;
+
+  if (n1->depth != n2->depth) return (n1->depth > n2->depth) ? -1 : 1;
+  return strcmp(n1->path, n2->path);
+}
+
+
+static int sort_entries(const void *a, const void *b)
+{
+  const struct direntry * const e1 = (const struct direntry *)a;
+  const struct direntry * const e2 = (const struct direntry *)b;
+
+  if (e1->dir->order != e2->dir->order) return (e1->dir->order < e2->dir->order) ? -1 : 1;
+  return strcmp(e1->name, e2->name);
+}
+
+
+static int sort_nodes_by_digest(const void *a, const void *b)
+{
+  const struct dirnode * const n1 = *(struct dirnode * const *)a;
+  const struct dirnode * const n2 = *(struct dirnode * const *)b;
+
+  if (n1->digest != n2->digest) return (n1->digest < n2->digest) ? -1 : 1;
+  return strcmp(n1->path, n2->path);
+}
+
+
+static int sort_file_ptrs(const void *a, const void *b)
+{
+  const uintptr_t p1 = (uintptr_t)((const struct direntry *)a)->file;
+  const uintptr_t p2 = (uintptr_t)((const struct direntry *)b)->file;
+
+  return (p1 < p2) ? -1 : (p1 > p2);
+}
+
+
+/* Number every duplicate file set and label each file entry with it */
+static void label_dupe_sets(file_t *files)
+{
+  struct direntry *sets, key, *found;
+  size_t n = 0, max = 1024;
+  uint64_t set = 0;
+
+  sets = (struct direntry *)malloc(sizeof(struct direntry) * max);
+  if (sets == NULL) oom("dirmatch sets");
+  for (; files != NULL; files = files->next) {
+    if (!ISFLAG(files->flags, F_HAS_DUPES)) continue;
+    set++;
+    for (file_t *f = files; f != NULL; f = f->duplicates) {
+      if (n == max) {
+        max *= 2;
+        sets = (struct direntry *)realloc(sets, sizeof(struct direntry) * max);
+        if (sets == NULL) oom("dirmatch sets");
+      }
+      sets[n].file = f;
+      sets[n].dupe_set = set;
+      n++;
+    }
+  }
+  qsort(sets, n, sizeof(struct direntry), sort_file_ptrs);
+
+  for (size_t i = 0; i < entry_cnt; i++) {
+    if (entries[i].file == NULL) continue;
+    key.file = entries[i].file;
+    found = (struct direntry *)bsearch(&key, sets, n, sizeof(struct direntry), sort_file_ptrs);
+    if (found != NULL) entries[i].dupe_set = found->dupe_set;
+  }
+  free(sets);
+  return;
+}
+
+
+/* Compute the digest of every directory, deepest first */
+static void digest_dirs(struct dirnode ** const restrict list)
+{
+  XXH64_state_t *state;
+  size_t i, e;
+
+  state = XXH64_createState();
+  if (state == NULL) oom("dirmatch digest");
+
+  e = 0;
+  for (i = 0; i < node_cnt; i++) {
+    struct dirnode * const node = list[i];
+
+    XXH64_reset(state, 0);
+    node->first = e;
+    for (; e < entry_cnt && entries[e].dir == node; e++) {
+      const struct direntry * const ent = &entries[e];
+      uint64_t value;
+      unsigned char type;
+
+      if (ent->file != NULL) {
+        if (ent->dupe_set == 0) node->poisoned = 1;
+        value = ent->dupe_set;
+        type = 'f';
+        node->size += (uintmax_t)ent->file->size;
+        node->files++;
+      } else {
+        if (ent->sub->poisoned) node->poisoned = 1;
+        value = ent->sub->digest;
+        type = 'd';
+        node->size += ent->sub->size;
+        node->files += ent->sub->files;
+      }
+      XXH64_update(state, ent->name, strlen(ent->name) + 1);
+      XXH64_update(state, &type, 1);
+      XXH64_update(state, &value, sizeof(value));
+    }
+    node->count = e - node->first;
+    node->digest = XXH64_digest(state);
+  }
+  XXH64_freeState(state);
+  return;
+}
+
+
+/* Guard against digest collisions by comparing the entries directly */
+static int same_entries(const struct dirnode * const restrict n1, const struct dirnode * const restrict n2)
+{
+  if (n1->count != n2->count) return 0;
+  for (size_t i = 0; i < n1->count; i++) {
+    const struct direntry * const e1 = &entries[n1->first + i];
+    const struct direntry * const e2 = &entries[n2->first + i];
+
+    if (strcmp(e1->name, e2->name) != 0) return 0;
+    if ((e1->file == NULL) != (e2->file == NULL)) return 0;
+    if (e1->file != NULL && e1->dupe_set != e2->dupe_set) return 0;
+    if (e1->file == NULL && e1->sub->digest != e2->sub->digest) return 0;
+  }
+  return 1;
+}
+
+
+/* Returns 1 if a directory tree holds nothing but the scanned entries,
+ * so that deleting those entries really removes the whole tree */
+static int tree_is_complete(const struct dirnode * const restrict node)
+{
+  DIR *dir;
+  struct dirent *dirinfo;
+  size_t count = 0;
+
+  dir = opendir(node->path);
+  if (dir == NULL) return 0;
+  while ((dirinfo = readdir(dir)) != NULL) {
+    if (strcmp(dirinfo->d_name, ".") == 0 || strcmp(dirinfo->d_name, "..") == 0) continue;
+    count++;
+  }
+  closedir(dir);
+  if (count != node->count) return 0;
+
+  for (size_t i = node->first; i < node->first + node->count; i++)
+    if (entries[i].file == NULL && !tree_is_complete(entries[i].sub)) return 0;
+  return 1;
+}
+
+
+/* Remove a duplicate directory tree that passed tree_is_complete().
+ * Returns 0 if the directory itself was removed. */
+static int delete_tree(struct dirnode * const restrict node)
+{
+  int failed = 0;
+
+  for (size_t i = node->first; i < node->first + node->count; i++) {
+    const struct direntry * const ent = &entries[i];
+
+    if (ent->file == NULL) {
+      if (delete_tree(ent->sub) != 0) failed = 1;
+      continue;
+    }
+    if (file_has_changed(ent->file)) {
+      printf("   [!] "); fwprint(stdout, ent->file->d_name, 0);
+      printf("-- file changed since being scanned\n");
+      failed = 1;
+    } else if (remove(ent->file->d_name) != 0) {
+      printf("   [!] "); fwprint(stdout, ent->file->d_name, 0);
+      printf("-- unable to delete file\n");
+      failed = 1;
+    }
+  }
+  if (failed) return -1;
+  node->removed = 1;
+  if (rmdir(node->path) != 0) {
+    printf("   [!] "); fwprint(stdout, node->path, 0);
+    printf("-- directory not empty after removing duplicates: %s\n", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+
+/* Ask which directories of a set to keep; at least one is always kept */
+static void prompt_keep(int * const restrict keep, const unsigned int count,
+                const unsigned int set, const unsigned int sets)
+{
+  char input[INPUT_SIZE];
+  char *token;
+  unsigned int number, sum;
+
+  do {
+    printf("Set %u of %u: keep which directories? (1 - %u, [a]ll): ", set, sets, count);
+    fflush(stdout);
+    if (!fgets(input, INPUT_SIZE, stdin)) input[0] = '\0';
+    for (unsigned int x = 0; x < count; x++) keep[x] = 0;
+    for (token = strtok(input, " ,\n"); token != NULL; token = strtok(NULL, " ,\n")) {
+      if (*token == 'a' || *token == 'A')
+        for (unsigned int x = 0; x < count; x++) keep[x] = 1;
+      number = 0;
+      sscanf(token, "%u", &number);
+      if (number > 0 && number <= count) keep[number - 1] = 1;
+    }
+    for (sum = 0, number = 0; number < count; number++) sum += (unsigned int)keep[number];
+    /* Don't loop forever if the input is gone */
+    if (sum == 0 && feof(stdin)) {
+      keep[0] = 1;
+      sum = 1;
+    }
+  } while (sum < 1);
+  return;
+}
+
+
+/* Whether a directory went away with an earlier set */
+static int dir_removed(const struct dirnode *node)
+{
+  for (; node != NULL; node = node->parent) if (node->removed) return 1;
+  return 0;
+}
+
+
+/* Delete or symlink the duplicates in one set of directories */
+static void act_on_set(struct dirnode ** const restrict members, const unsigned int count,
+                const unsigned int set, const unsigned int sets)
+{
+  int *keep;
+  struct dirnode *keeper = NULL;
+#ifndef NO_SYMLINKS
+  char rel_path[PATHBUF_SIZE];
+  int i;
+#endif
+
+  keep = (int *)calloc(count, sizeof(int));
+  if (keep == NULL) oom("dirmatch keep");
+  if (ISFLAG(flags, F_DELETEFILES) && !ISFLAG(flags, F_NOPROMPT)) {
+    for (unsigned int x = 0; x < count; x++) {
+      printf("[%u] ", x + 1); fwprint(stdout, members[x]->path, 1);
+    }
+    printf("\n");
+    prompt_keep(keep, count, set, sets);
+    printf("\n");
+  } else keep[0] = 1;
+
+  /* A nested set can have members inside directories that an earlier
+   * set deleted; the copy kept must be one that is still there */
+  for (unsigned int x = 0; x < count && keeper == NULL; x++)
+    if (keep[x] && !dir_removed(members[x])) keeper = members[x];
+  for (unsigned int x = 0; x < count && keeper == NULL; x++) {
+    if (dir_removed(members[x])) continue;
+    keep[x] = 1;
+    keeper = members[x];
+  }
+  if (keeper == NULL) {
+    free(keep);
+    return;
+  }
+
+  for (unsigned int x = 0; x < count; x++) {
+    if (dir_removed(members[x])) continue;
+    if (keep[x]) {
+      printf("   [+] "); fwprint(stdout, members[x]->path, 1);
+      continue;
+    }
+    /* Whole directories only: never leave a partially deleted tree */
+    if (!tree_is_complete(members[x])) {
+      printf("   [!] "); fwprint(stdout, members[x]->path, 0);
+      printf("-- contains files that were not scanned or matched\n");
+      continue;
+    }
+    if (delete_tree(members[x]) != 0) continue;
+#ifndef NO_SYMLINKS
+    if (ISFLAG(flags, F_MAKESYMLINKS)) {
+      i = make_relative_link_name(keeper->path, members[x]->path, rel_path);
+      if (i != 0 || symlink(rel_path, members[x]->path) != 0) {
+        printf("   [!] "); fwprint(stdout, members[x]->path, 0);
+        printf("-- deleted but unable to create symlink\n");
+      } else {
+        printf("   -@@-> "); fwprint(stdout, members[x]->path, 1);
+      }
+      continue;
+    }
+#endif
+    printf("   [-] "); fwprint(stdout, members[x]->path, 1);
+  }
+  printf("\n");
+  free(keep);
+  return;
+}
+
+
+extern void dirmatch(file_t *files, char ** const restrict root_list, const int root_count)
+{
+  struct dirnode **list, **members;
+  struct dirgroup *groups;
+  size_t n_members = 0, n_groups = 0, i, j, k;
+  unsigned int shown = 0, set = 0, dirs = 0;
+  uintmax_t bytes = 0;
+  int cr = ISFLAG(flags, F_PRINTNULL) ? 2 : 1;
+
+  LOUD(fprintf(stderr, "dirmatch(%p, %d roots)\n", (void *)files, root_count);)
+
+  /* Roots are compared without trailing separators */
+  roots = root_list;
+  root_cnt = root_count;
+  for (int r = 0; r < root_cnt; r++) {
+    size_t len = strlen(roots[r]);
+    while (len > 1 && roots[r][len - 1] == dir_sep) roots[r][--len] = '\0';
+  }
+
+  /* Build the directory tree from the paths of all scanned files */
+  for (file_t *f = files; f != NULL; f = f->next) {
+    const char *p = strrchr(f->d_name, dir_sep);
+    if (p == NULL) continue;
+    add_entry(add_dir(f->d_name, (p == f->d_name) ? 1 : (size_t)(p - f->d_name)), p + 1, f, NULL);
+  }
+  if (node_cnt == 0) {
+    fwprint(stderr, "No duplicate directories found.", 1);
+    return;
+  }
+
+  list = (struct dirnode **)malloc(sizeof(struct dirnode *) * node_cnt);
+  if (list == NULL) oom("dirmatch list");
+  for (i = 0, j = 0; i < node_slots; i++) {
+    if (nodes[i] == NULL) continue;
+    node_depth(nodes[i]);
+    list[j++] = nodes[i];
+  }
+  qsort(list, node_cnt, sizeof(struct dirnode *), sort_nodes_by_depth);
+  for (i = 0; i < node_cnt; i++) list[i]->order = (unsigned int)i;
+
+  label_dupe_sets(files);
+  qsort(entries, entry_cnt, sizeof(struct direntry), sort_entries);
+  digest_dirs(list);
+
+  /* Group matching directories; list gets reused for the group members */
+  qsort(list, node_cnt, sizeof(struct dirnode *), sort_nodes_by_digest);
+  members = list;
+  groups = (struct dirgroup *)malloc(sizeof(struct dirgroup) * (node_cnt / 2 + 1));
+  if (groups == NULL) oom("dirmatch groups");
+  for (i = 0; i < node_cnt; i = j) {
+    struct dirnode * const first = list[i];
+
+    for (j = i + 1; j < node_cnt && list[j]->digest == first->digest; j++);
+    if (first->poisoned || first->files == 0) continue;
+    groups[n_groups].first = n_members;
+    members[n_members++] = first;
+    for (k = i + 1; k < j; k++)
+      if (same_entries(first, list[k])) members[n_members++] = list[k];
+    groups[n_groups].count = n_members - groups[n_groups].first;
+    if (groups[n_groups].count < 2) {
+      n_members--;
+      continue;
+    }
+    for (k = groups[n_groups].first; k < n_members; k++) members[k]->group = (unsigned int)n_groups + 1;
+    n_groups++;
+  }
+
+  /* Sets whose members all sit in distinct members of one parent set
+   * are already covered by that parent set */
+  for (i = 0; i < n_groups; i++) {
+    struct dirnode ** const m = &members[groups[i].first];
+    const size_t cnt = groups[i].count;
+
+    groups[i].covered = (m[0]->parent != NULL && m[0]->parent->group != 0);
+    for (j = 1; j < cnt && groups[i].covered; j++) {
+      if (m[j]->parent == NULL || m[j]->parent->group != m[0]->parent->group) groups[i].covered = 0;
+      for (k = 0; k < j && groups[i].covered; k++)
+        if (m[j]->parent == m[k]->parent) groups[i].covered = 0;
+    }
+    if (!groups[i].covered) shown++;
+  }
+
+  for (i = 0; i < n_groups; i++) {
+    struct dirnode ** const m = &members[groups[i].first];
+    unsigned int extra = 0;
+    int nested = 0;
+
+    if (groups[i].covered) continue;
+    set++;
+    /* Members inside a directory of another set were counted with that
+     * set, and one copy of them survives with its kept directory */
+    for (j = 0; j < groups[i].count; j++) {
+      if (m[j]->parent == NULL || m[j]->parent->group == 0) extra++;
+      else nested = 1;
+    }
+    if (!nested && extra > 0) extra--;
+    dirs += extra;
+    bytes += m[0]->size * extra;
+    if (ISFLAG(flags, F_DELETEFILES) || ISFLAG(flags, F_MAKESYMLINKS)) {
+      act_on_set(m, (unsigned int)groups[i].count, set, shown);
+      continue;
+    }
+    if (!ISFLAG(flags, F_PRINTMATCHES)) continue;
+    if (ISFLAG(flags, F_SHOWSIZE)) printf("%" PRIuMAX " byte%c in %u file%c each:\n", m[0]->size,
+        (m[0]->size != 1) ? 's' : ' ', m[0]->files, (m[0]->files != 1) ? 's' : ' ');
+    for (j = ISFLAG(flags, F_OMITFIRST) ? 1 : 0; j < groups[i].count; j++) fwprint(stdout, m[j]->path, cr);
+    fwprint(stdout, "", cr);
+  }
+
+  if (shown == 0) fwprint(stderr, "No duplicate directories found.", 1);
+  else if (ISFLAG(flags, F_SUMMARIZEMATCHES))
+    printf("%u duplicate directories (in %u sets), occupying %" PRIuMAX " bytes\n", dirs, shown, bytes);
+
+  for (i = 0; i < node_slots; i++) {
+    if (nodes[i] == NULL) continue;
+    free(nodes[i]->path);
+    free(nodes[i]);
+  }
+  free(nodes);
+  free(entries);
+  free(list);
+  free(groups);
+  nodes = NULL;
+  entries = NULL;
+  node_slots = node_cnt = entry_cnt = entry_max = 0;
+  return;
+}
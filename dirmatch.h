@@ -0,0 +1,19 @@
+/* jdupes whole-directory duplicate detection
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#ifndef DIRMATCH_H
+#define DIRMATCH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "jdupes.h"
+
+extern void dirmatch(file_t *files, char ** const restrict root_list, const int root_count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DIRMATCH_H */
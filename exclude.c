@@ -0,0 +1,305 @@
+/* Compiled -X/-A exclusion rules
+ *
+ * The -X options are collected into the exclude_head stack while the
+ * command line is parsed. Before scanning starts, exclude_compile() turns
+ * that stack into a form that is cheap to test for every directory entry:
+ * all size rules fold into one range of sizes to keep, names and paths
+ * without wildcards go into sorted arrays for a binary search, and only
+ * real globs and regular expressions are tried one by one.
+ *
+ * Names are tested before a file is stat()ed. dir: rules prune whole
+ * directories so they are never read at all; name:, path:, ext: and regex:
+ * rules only apply to files. Globs support *, ? and [...] classes; a *
+ * also matches across directory separators, as with 'find -path'.
+ *
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <strings.h>
+#ifndef ON_WINDOWS
+ #include <regex.h>
+#endif
+#include "jdupes.h"
+#include "exclude.h"
+
+struct pattern_list {
+  const char **literal;	/* Sorted; matched with bsearch() */
+  size_t literal_cnt;
+  const char **glob;
+  size_t glob_cnt;
+};
+
+static struct pattern_list dir_names, file_names, file_paths;
+static const char **extensions = NULL;
+static size_t extension_cnt = 0;
+#ifndef ON_WINDOWS
+static regex_t *regexes = NULL;
+static size_t regex_cnt = 0;
+#endif
+static int exclude_hidden = 0;
+static int have_name_rules = 0, have_file_rules = 0;
+
+/* Sizes outside this range are excluded */
+static int64_t size_lo = 0, size_hi = INT64_MAX;
+
+
+/* Match one [...] class at *pat; returns 1 on a match, 0 on no match, -1
+ * if the class is not closed (then the '[' is an ordinary character) */
+static int class_match(const char ** const restrict patp, const char c)
+{
+  const char *p = *patp + 1;
+  int negate = 0, found = 0;
+
+  if (*p == '!' || *p == '^') {
+    negate = 1;
+    p++;
+  }
+  /* A ']' right at the start is part of the class */
+  do {
+    if (*p == '\0') return -1;
+    if (p[1] == '-' && p[2] != ']' && p[2] != '\0') {
+      if ((unsigned char)c >= (unsigned char)*p && (unsigned char)c <= (unsigned char)p[2]) found = 1;
+      p += 3;
+    } else {
+      if (c == *p) found = 1;
+      p++;
+    }
+  } while (*p != ']');
+  *patp = p + 1;
+  return found ^ negate;
+}
+
+
+/* Shell-style wildcard match without recursion */
+static int glob_match(const char *pat, const char *str)
+{
+  const char *star_pat = NULL, *star_str = NULL;
+
+  while (*str != '\0') {
+    if (*pat == '*') {
+      while (*pat == '*') pat++;
+      if (*pat == '\0') return 1;
+      star_pat = pat;
+      star_str = str;
+      continue;
+    }
+    if (*pat == '?') {
+      pat++;
+      str++;
+      continue;
+    }
+    if (*pat == '[') {
+      const char *p = pat;
+      const int i = class_match(&p, *str);
+
+      if (i == 1) {
+        pat = p;
+        str++;
+        continue;
+      }
+      if (i == 0) goto mismatch;
+    }
+    if (*pat == '\\' && pat[1] != '\0') pat++;
+    if (*pat == *str) {
+      pat++;
+      str++;
+      continue;
+    }
+mismatch:
+    /* Let the last * take one more character and try again */
+    if (star_pat == NULL) return 0;
+    pat = star_pat;
+    str = ++star_str;
+  }
+  while (*pat == '*') pat++;
+  return (*pat == '\0') ? 1 : 0;
+}
+
+
+static int has_wildcards(const char *pat)
+{
+  return (strpbrk(pat, "*?[\\") != NULL) ? 1 : 0;
+}
+
+
+static int compare_strings(const void *s1, const void *s2)
+{
+  return strcmp(*(const char * const *)s1, *(const char * const *)s2);
+}
+
+
+static int compare_strings_nocase(const void *s1, const void *s2)
+{
+  return strcasecmp(*(const char * const *)s1, *(const char * const *)s2);
+}
+
+
+static void list_add(const char ***list, size_t * const restrict count, const char * const restrict str)
+{
+  *list = (const char **)realloc((void *)*list, sizeof(char *) * (*count + 1));
+  if (*list == NULL) oom("exclude list_add()");
+  (*list)[(*count)++] = str;
+  return;
+}
+
+
+static void pattern_add(struct pattern_list * const restrict list, const char * const restrict pat)
+{
+  if (has_wildcards(pat)) list_add(&list->glob, &list->glob_cnt, pat);
+  else list_add(&list->literal, &list->literal_cnt, pat);
+  return;
+}
+
+
+static int pattern_match(const struct pattern_list * const restrict list, const char *str)
+{
+  if (list->literal_cnt != 0 &&
+      bsearch(&str, list->literal, list->literal_cnt, sizeof(char *), compare_strings) != NULL) return 1;
+  for (size_t i = 0; i < list->glob_cnt; i++) if (glob_match(list->glob[i], str)) return 1;
+  return 0;
+}
+
+
+/* Turn the -X stack (and -A if hidden is set) into lookup structures */
+extern void exclude_compile(const int hidden)
+{
+  exclude_hidden = hidden;
+
+  for (struct exclude *excl = exclude_head; excl != NULL; excl = excl->next) {
+    switch (excl->flags) {
+      /* Fold all size rules into the range of sizes to keep */
+      case X_SIZE_EQ:
+        if (size_lo < excl->size) size_lo = excl->size;
+        if (size_hi > excl->size) size_hi = excl->size;
+        break;
+      case X_SIZE_GT:
+        if (size_hi > excl->size) size_hi = excl->size;
+        break;
+      case X_SIZE_GTEQ:
+        if (size_hi >= excl->size) size_hi = excl->size - 1;
+        break;
+      case X_SIZE_LT:
+        if (size_lo < excl->size) size_lo = excl->size;
+        break;
+      case X_SIZE_LTEQ:
+        if (excl->size == INT64_MAX) size_hi = -1;
+        else if (size_lo <= excl->size) size_lo = excl->size + 1;
+        break;
+      case X_DIR:
+        pattern_add(&dir_names, excl->param);
+        break;
+      case X_NAME:
+        pattern_add(&file_names, excl->param);
+        break;
+      case X_PATH:
+        pattern_add(&file_paths, excl->param);
+        break;
+      case X_EXT:
+        {
+          /* The value is a comma-separated list; split it in place */
+          char *p = excl->param;
+
+          while (*p != '\0') {
+            char * const start = (*p == '.') ? p + 1 : p;
+            char * const end = start + strcspn(start, ",");
+            const int last = (*end == '\0');
+
+            *end = '\0';
+            if (*start != '\0') list_add(&extensions, &extension_cnt, start);
+            p = last ? end : end + 1;
+          }
+        }
+        break;
+#ifndef ON_WINDOWS
+      case X_REGEX:
+        {
+          int i;
+
+          regexes = (regex_t *)realloc(regexes, sizeof(regex_t) * (regex_cnt + 1));
+          if (regexes == NULL) oom("exclude_compile() regex");
+          i = regcomp(&regexes[regex_cnt], excl->param, REG_EXTENDED | REG_NOSUB);
+          if (i != 0) {
+            char msg[256];
+
+            regerror(i, &regexes[regex_cnt], msg, sizeof(msg));
+            fprintf(stderr, "invalid -X regex '%s': %s\n", excl->param, msg);
+            exit(EXIT_FAILURE);
+          }
+          regex_cnt++;
+        }
+        break;
+#endif
+      default:
+        break;
+    }
+  }
+
+  qsort((void *)dir_names.literal, dir_names.literal_cnt, sizeof(char *), compare_strings);
+  qsort((void *)file_names.literal, file_names.literal_cnt, sizeof(char *), compare_strings);
+  qsort((void *)file_paths.literal, file_paths.literal_cnt, sizeof(char *), compare_strings);
+  qsort((void *)extensions, extension_cnt, sizeof(char *), compare_strings_nocase);
+
+  have_file_rules = (file_names.literal_cnt + file_names.glob_cnt
+      + file_paths.literal_cnt + file_paths.glob_cnt + extension_cnt) != 0;
+#ifndef ON_WINDOWS
+  if (regex_cnt != 0) have_file_rules = 1;
+#endif
+  have_name_rules = exclude_hidden || have_file_rules
+      || (dir_names.literal_cnt + dir_names.glob_cnt) != 0;
+  LOUD(fprintf(stderr, "exclude_compile: sizes %" PRId64 " to %" PRId64 ", name rules %d, file rules %d\n",
+      size_lo, size_hi, have_name_rules, have_file_rules));
+  return;
+}
+
+
+/* Check a path against the name rules; returns EXCL_FILE if it must be
+ * skipped if it is a file and EXCL_DIR if it must be skipped (and not
+ * descended into) if it is a directory */
+extern unsigned int exclude_match(const char * const restrict path)
+{
+  const char *name, *ext;
+  unsigned int result = 0;
+
+  if (!have_name_rules) return 0;
+
+  name = strrchr(path, '/');
+#ifdef ON_WINDOWS
+  {
+    const char * const bs = strrchr(path, '\\');
+    if (bs != NULL && (name == NULL || bs > name)) name = bs;
+  }
+#endif
+  name = (name == NULL) ? path : name + 1;
+
+  if (exclude_hidden && name[0] == '.' && strcmp(name, ".") != 0 && strcmp(name, "..") != 0)
+    return EXCL_FILE | EXCL_DIR;
+
+  if (pattern_match(&dir_names, name)) result |= EXCL_DIR;
+
+  if (!have_file_rules) return result;
+  if (pattern_match(&file_names, name) || pattern_match(&file_paths, path)) return result | EXCL_FILE;
+  if (extension_cnt != 0) {
+    ext = strrchr(name, '.');
+    if (ext != NULL && ext != name) {
+      ext++;
+      if (bsearch(&ext, extensions, extension_cnt, sizeof(char *), compare_strings_nocase) != NULL)
+        return result | EXCL_FILE;
+    }
+  }
+#ifndef ON_WINDOWS
+  for (size_t i = 0; i < regex_cnt; i++)
+    if (regexec(&regexes[i], path, 0, NULL, 0) == 0) return result | EXCL_FILE;
+#endif
+  return result;
+}
+
+
+/* Returns 1 if a file of this size is excluded */
+extern int exclude_size(const int64_t size)
+{
+  return (size < size_lo || size > size_hi) ? 1 : 0;
+}
@@ -0,0 +1,25 @@
+/* jdupes compiled -X/-A exclusion rules
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#ifndef EXCLUDE_H
+#define EXCLUDE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/* exclude_match() result bits: what the name is excluded as */
+#define EXCL_FILE	0x1U
+#define EXCL_DIR	0x2U
+
+extern void exclude_compile(const int hidden);
+extern unsigned int exclude_match(const char * const restrict path);
+extern int exclude_size(const int64_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* EXCLUDE_H */
@@ -0,0 +1,340 @@
+/* External sort of file records for bounded memory use
+ *
+ * When a --max-memory limit would be exceeded while scanning, the files
+ * scanned so far are sorted by size and written out to a temporary "run"
+ * file. After scanning is finished, all runs are merged to produce groups
+ * of same-sized files without ever holding every file record in memory.
+ *
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include "jdupes.h"
+#include "extsort.h"
+
+/* Number of same-level runs that are merged into one larger run. This
+ * also limits how many temporary files are open at once. */
+#define EXTSORT_FANIN 32
+/* stdio buffer size for each run file; keeps temp file I/O sequential */
+#define EXTSORT_BUFSIZE 65536
+
+/* On-disk record: the raw file_t followed by name_len bytes of d_name.
+ * Pointer members of the stored file_t are meaningless once reloaded. */
+struct spillrec {
+  size_t name_len;
+  file_t file;
+};
+
+struct run {
+  FILE *fp;
+  file_t *head;        /* Next unconsumed record, NULL at end of run */
+  unsigned int level;  /* Number of merges that went into this run */
+};
+
+static struct run *runs = NULL;
+static unsigned int run_cnt = 0, run_max = 0;
+
+/* Merge heap of run indices (smallest head size on top) */
+static unsigned int *heap = NULL;
+static unsigned int heap_cnt = 0;
+
+
+static void extsort_ioerror(const char * const restrict msg)
+{
+  fprintf(stderr, "\nerror: --max-memory temporary file %s failed: %s\n", msg, strerror(errno));
+  string_malloc_destroy();
+  exit(EXIT_FAILURE);
+}
+
+
+/* Create an anonymous temporary file for a run */
+static FILE *extsort_tmpfile(void)
+{
+  FILE *fp;
+#ifdef ON_WINDOWS
+  fp = tmpfile();
+#else
+  char path[PATHBUF_SIZE];
+  const char *tmpdir = getenv("TMPDIR");
+  int fd;
+
+  if (tmpdir == NULL || *tmpdir == '\0') tmpdir = "/tmp";
+  if (snprintf(path, PATHBUF_SIZE, "%s/jdupes-run.XXXXXX", tmpdir) >= PATHBUF_SIZE) {
+    errno = ENAMETOOLONG;
+    extsort_ioerror("creation");
+  }
+  fd = mkstemp(path);
+  if (fd == -1) extsort_ioerror("creation");
+  /* The file only has to live as long as it stays open */
+  unlink(path);
+  fp = fdopen(fd, "w+b");
+  if (fp == NULL) close(fd);
+#endif
+  if (fp == NULL) extsort_ioerror("creation");
+  setvbuf(fp, NULL, _IOFBF, EXTSORT_BUFSIZE);
+  LOUD(fprintf(stderr, "extsort_tmpfile: new run file %p\n", (void *)fp));
+  return fp;
+}
+
+
+static void write_record(FILE * const restrict fp, const file_t * const restrict file)
+{
+  struct spillrec rec;
+
+  memset(&rec, 0, sizeof(struct spillrec));
+  rec.name_len = strlen(file->d_name) + 1;
+  rec.file = *file;
+  if (fwrite(&rec, sizeof(struct spillrec), 1, fp) != 1
+      || fwrite(file->d_name, rec.name_len, 1, fp) != 1)
+    extsort_ioerror("write");
+  return;
+}
+
+
+/* Load the next record from a run; returns NULL at the end of the run */
+static file_t *read_record(FILE * const restrict fp)
+{
+  struct spillrec rec;
+  file_t *file;
+
+  if (fread(&rec, sizeof(struct spillrec), 1, fp) != 1) {
+    if (ferror(fp)) extsort_ioerror("read");
+    return NULL;
+  }
+
+  file = (file_t *)string_malloc(sizeof(file_t));
+  if (file == NULL) oom("read_record() file");
+  *file = rec.file;
+  file->d_name = (char *)string_malloc(rec.name_len);
+  if (file->d_name == NULL) oom("read_record() d_name");
+  if (fread(file->d_name, rec.name_len, 1, fp) != 1) extsort_ioerror("read");
+  file->next = NULL;
+  file->duplicates = NULL;
+  return file;
+}
+
+
+static inline void free_record(file_t * const restrict file)
+{
+  string_free(file->d_name);
+  string_free(file);
+  return;
+}
+
+
+/* Stable in-place merge sort of a file list by size */
+static file_t *sort_list_by_size(file_t *list, const size_t count)
+{
+  file_t *left, *right, *tail, head;
+  size_t half, i;
+
+  if (count < 2) return list;
+
+  half = count / 2;
+  left = list;
+  for (i = 1; i < half; i++) list = list->next;
+  right = list->next;
+  list->next = NULL;
+
+  left = sort_list_by_size(left, half);
+  right = sort_list_by_size(right, count - half);
+
+  tail = &head;
+  while (left != NULL && right != NULL) {
+    /* Ties take from the left so list order is preserved */
+    if (right->size < left->size) {
+      tail->next = right;
+      right = right->next;
+    } else {
+      tail->next = left;
+      left = left->next;
+    }
+    tail = tail->next;
+  }
+  tail->next = (left != NULL) ? left : right;
+  return head.next;
+}
+
+
+/* Runs are ordered by head size; equal sizes take the newest run first
+ * to match the newest-first order of the in-memory file list */
+static inline int run_before(const unsigned int r1, const unsigned int r2)
+{
+  if (runs[r1].head->size != runs[r2].head->size)
+    return runs[r1].head->size < runs[r2].head->size;
+  return r1 > r2;
+}
+
+
+static void heap_sift_down(unsigned int i)
+{
+  unsigned int child, tmp;
+
+  while ((child = i * 2 + 1) < heap_cnt) {
+    if (child + 1 < heap_cnt && run_before(heap[child + 1], heap[child])) child++;
+    if (!run_before(heap[child], heap[i])) break;
+    tmp = heap[i];
+    heap[i] = heap[child];
+    heap[child] = tmp;
+    i = child;
+  }
+  return;
+}
+
+
+/* Rewind runs [first, last) and build a merge heap from them */
+static void heap_build(const unsigned int first, const unsigned int last)
+{
+  unsigned int i;
+
+  heap_cnt = 0;
+  for (i = first; i < last; i++) {
+    if (fflush(runs[i].fp) != 0) extsort_ioerror("write");
+    rewind(runs[i].fp);
+    runs[i].head = read_record(runs[i].fp);
+    if (runs[i].head != NULL) heap[heap_cnt++] = i;
+  }
+  for (i = heap_cnt / 2; i > 0; i--) heap_sift_down(i - 1);
+  return;
+}
+
+
+/* Take the smallest record off the heap and refill from its run */
+static file_t *heap_pop(void)
+{
+  file_t *file;
+  unsigned int top;
+
+  if (heap_cnt == 0) return NULL;
+  top = heap[0];
+  file = runs[top].head;
+  runs[top].head = read_record(runs[top].fp);
+  if (runs[top].head == NULL) heap[0] = heap[--heap_cnt];
+  heap_sift_down(0);
+  return file;
+}
+
+
+/* Merge the adjacent runs [first, run_cnt) into a single run */
+static void merge_tail_runs(const unsigned int first)
+{
+  FILE *out;
+  file_t *file;
+  unsigned int i;
+
+  LOUD(fprintf(stderr, "extsort: merging runs %u-%u\n", first, run_cnt - 1));
+  out = extsort_tmpfile();
+  heap_build(first, run_cnt);
+  while ((file = heap_pop()) != NULL) {
+    write_record(out, file);
+    free_record(file);
+  }
+  for (i = first; i < run_cnt; i++) fclose(runs[i].fp);
+
+  runs[first].level++;
+  runs[first].fp = out;
+  runs[first].head = NULL;
+  run_cnt = first + 1;
+  return;
+}
+
+
+/* Sort a file list by size, write it to a new run, and free it */
+extern void extsort_spill(file_t * restrict list)
+{
+  FILE *fp;
+  file_t *next;
+  size_t count = 0;
+
+  if (list == NULL) return;
+
+  for (next = list; next != NULL; next = next->next) count++;
+  LOUD(fprintf(stderr, "extsort_spill: writing %" PRIuMAX " files to run %u\n", (uintmax_t)count, run_cnt));
+  list = sort_list_by_size(list, count);
+
+  fp = extsort_tmpfile();
+  while (list != NULL) {
+    next = list->next;
+    write_record(fp, list);
+    free_record(list);
+    list = next;
+  }
+
+  if (run_cnt == run_max) {
+    run_max += EXTSORT_FANIN;
+    runs = (struct run *)realloc(runs, sizeof(struct run) * run_max);
+    heap = (unsigned int *)realloc(heap, sizeof(unsigned int) * run_max);
+    if (runs == NULL || heap == NULL) oom("extsort_spill() runs");
+  }
+  runs[run_cnt].fp = fp;
+  runs[run_cnt].head = NULL;
+  runs[run_cnt].level = 0;
+  run_cnt++;
+
+  /* Cascade merges when enough runs of one level pile up. Only adjacent
+   * runs are merged, so the relative order of equal-sized files holds. */
+  while (run_cnt >= EXTSORT_FANIN
+      && runs[run_cnt - EXTSORT_FANIN].level == runs[run_cnt - 1].level)
+    merge_tail_runs(run_cnt - EXTSORT_FANIN);
+
+  return;
+}
+
+
+extern unsigned int extsort_run_count(void)
+{
+  return run_cnt;
+}
+
+
+/* Prepare to return size groups from all runs */
+extern void extsort_merge_init(void)
+{
+  LOUD(fprintf(stderr, "extsort_merge_init: %u runs\n", run_cnt));
+  heap_build(0, run_cnt);
+  return;
+}
+
+
+/* Return the next group of same-sized files as a list linked through
+ * file->next in ascending size order, or NULL when all runs are empty */
+extern file_t *extsort_next_group(size_t * const restrict count)
+{
+  file_t *group, *tail;
+
+  if (count == NULL) nullptr("extsort_next_group()");
+
+  group = heap_pop();
+  if (group == NULL) return NULL;
+  tail = group;
+  *count = 1;
+  while (heap_cnt > 0 && runs[heap[0]].head->size == group->size) {
+    tail->next = heap_pop();
+    tail = tail->next;
+    (*count)++;
+  }
+  tail->next = NULL;
+  return group;
+}
+
+
+extern void extsort_cleanup(void)
+{
+  for (unsigned int i = 0; i < run_cnt; i++) {
+    if (runs[i].head != NULL) free_record(runs[i].head);
+    fclose(runs[i].fp);
+  }
+  free(runs);
+  free(heap);
+  runs = NULL;
+  heap = NULL;
+  run_cnt = 0;
+  run_max = 0;
+  heap_cnt = 0;
+  return;
+}
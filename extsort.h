@@ -0,0 +1,23 @@
+/* jdupes external sort of file records for bounded memory use
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#ifndef EXTSORT_H
+#define EXTSORT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "jdupes.h"
+
+extern void extsort_spill(file_t * restrict list);
+extern unsigned int extsort_run_count(void);
+extern void extsort_merge_init(void);
+extern file_t *extsort_next_group(size_t * const restrict count);
+extern void extsort_cleanup(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* EXTSORT_H */
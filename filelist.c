@@ -0,0 +1,220 @@
+/* Read the files to check from a list instead of walking directories
+ *
+ * The list is a file (or standard input) with one path per record, as
+ * written by 'find -print0', 'locate -0' or a plain 'find'. Records end
+ * with a NUL byte if there is one anywhere in the first buffer full of
+ * the list, otherwise with a newline.
+ *
+ * A list can also carry the size, inode, device and mtime of each file
+ * so that they don't have to be looked up again. The columns named with
+ * --files-from-columns come first in every record, in the order given,
+ * as decimal numbers each followed by one tab or space; the path is the
+ * rest of the record. An mtime can have a fractional part, which is
+ * dropped, so 'find -printf "%s\t%i\t%D\t%T@\t%p\0"' output works as-is.
+ *
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#ifdef ON_WINDOWS
+ #include <io.h>
+ #include <fcntl.h>
+#endif
+#include "jdupes.h"
+#include "filelist.h"
+
+#define FILELIST_BUFSIZE 65536
+
+unsigned int filelist_columns = 0;
+
+static unsigned int column_order[4];
+static unsigned int column_count = 0;
+
+static FILE *list_fp = NULL;
+static const char *list_name;
+static char *buf = NULL;
+static size_t buf_size = 0, buf_start = 0, buf_end = 0;
+static int separator = -1;
+static int at_eof = 0;
+static uintmax_t record_num = 0;
+
+
+/* Parse a comma-separated list of column names; -1 if it isn't valid */
+extern int filelist_set_columns(const char * const restrict list)
+{
+  static const char * const names[] = { "size", "inode", "device", "mtime" };
+  const char *p = list;
+
+  filelist_columns = 0;
+  column_count = 0;
+  while (*p != '\0') {
+    const size_t len = strcspn(p, ",");
+    unsigned int i;
+
+    for (i = 0; i < 4; i++) if (strlen(names[i]) == len && strncmp(p, names[i], len) == 0) break;
+    if (i == 4 || (filelist_columns & (1U << i))) return -1;
+    filelist_columns |= 1U << i;
+    column_order[column_count++] = 1U << i;
+    p += len;
+    if (*p == ',') p++;
+  }
+  return (column_count == 0) ? -1 : 0;
+}
+
+
+/* Open a list; "-" is standard input. Returns -1 with errno set on error */
+extern int filelist_open(const char * const restrict name)
+{
+  if (strcmp(name, "-") == 0) {
+    list_fp = stdin;
+#ifdef ON_WINDOWS
+    _setmode(_fileno(stdin), _O_BINARY);
+#endif
+  } else {
+    list_fp = fopen(name, "rb");
+    if (list_fp == NULL) return -1;
+  }
+  if (buf == NULL) {
+    buf_size = FILELIST_BUFSIZE;
+    buf = (char *)malloc(buf_size);
+    if (buf == NULL) oom("filelist_open()");
+  }
+  list_name = name;
+  buf_start = 0;
+  buf_end = 0;
+  separator = -1;
+  at_eof = 0;
+  record_num = 0;
+  return 0;
+}
+
+
+/* Read more of the list in behind what is still unused */
+static void fill_buffer(void)
+{
+  size_t n;
+
+  if (buf_start != 0) {
+    memmove(buf, buf + buf_start, buf_end - buf_start);
+    buf_end -= buf_start;
+    buf_start = 0;
+  }
+  /* A record bigger than the buffer needs a bigger buffer */
+  if (buf_end + 1 >= buf_size) {
+    buf_size <<= 1;
+    buf = (char *)realloc(buf, buf_size);
+    if (buf == NULL) oom("filelist fill_buffer()");
+  }
+  /* One byte is always left over to end the last record with */
+  n = fread(buf + buf_end, 1, buf_size - buf_end - 1, list_fp);
+  if (n == 0) {
+    if (ferror(list_fp)) {
+      fprintf(stderr, "\nerror reading file list '%s': %s\n", list_name, strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    at_eof = 1;
+  }
+  buf_end += n;
+  return;
+}
+
+
+/* Parse a decimal number and the tab or space after it */
+static char *parse_column(char *p, const unsigned int column, struct filelist_entry * const restrict entry)
+{
+  uint64_t value = 0;
+  int negative = 0, fraction = 0;
+
+  if (column == FILELIST_MTIME && *p == '-') {
+    negative = 1;
+    p++;
+  }
+  if (*p < '0' || *p > '9') return NULL;
+  for (; *p >= '0' && *p <= '9'; p++) {
+    if (value > (UINT64_MAX - 9) / 10) return NULL;
+    value = value * 10 + (uint64_t)(*p - '0');
+  }
+  if (column == FILELIST_MTIME && *p == '.') {
+    for (p++; *p >= '0' && *p <= '9'; p++) if (*p != '0') fraction = 1;
+  }
+  if (*p != '\t' && *p != ' ') return NULL;
+
+  switch (column) {
+    case FILELIST_SIZE:
+      if (value > INT64_MAX) return NULL;
+      entry->size = (int64_t)value;
+      break;
+    case FILELIST_INODE:
+      entry->inode = value;
+      break;
+    case FILELIST_DEVICE:
+      entry->device = value;
+      break;
+    case FILELIST_MTIME:
+      if (value > INT64_MAX) return NULL;
+      /* Round times before the epoch down like the whole seconds of a stat() */
+      entry->mtime = negative ? -(int64_t)value - fraction : (int64_t)value;
+      break;
+    default:
+      return NULL;
+  }
+  return p + 1;
+}
+
+
+/* Get the next record; returns 0 at the end of the list */
+extern int filelist_next(struct filelist_entry * const restrict entry)
+{
+  char *record, *end;
+
+  if (list_fp == NULL || entry == NULL) nullptr("filelist_next()");
+
+  while (1) {
+    if (separator == -1) {
+      fill_buffer();
+      separator = (memchr(buf, '\0', buf_end) != NULL) ? '\0' : '\n';
+      LOUD(fprintf(stderr, "filelist_next: records end with %s\n", separator ? "newlines" : "NULs"));
+    }
+    end = (char *)memchr(buf + buf_start, separator, buf_end - buf_start);
+    if (end == NULL) {
+      if (!at_eof) {
+        fill_buffer();
+        continue;
+      }
+      if (buf_start == buf_end) return 0;
+      /* The last record doesn't have to be terminated */
+      end = buf + buf_end;
+    }
+    record = buf + buf_start;
+    *end = '\0';
+    buf_start = (end == buf + buf_end) ? buf_end : (size_t)(end - buf) + 1;
+    record_num++;
+
+    if (separator == '\n' && end > record && *(end - 1) == '\r') *(end - 1) = '\0';
+    if (*record == '\0') continue;
+
+    for (unsigned int i = 0; i < column_count && record != NULL; i++)
+      record = parse_column(record, column_order[i], entry);
+    if (record == NULL || *record == '\0') {
+      fprintf(stderr, "\nwarning: skipping malformed record %" PRIuMAX " in file list '%s'\n",
+          record_num, list_name);
+      continue;
+    }
+    entry->path = record;
+    return 1;
+  }
+}
+
+
+extern void filelist_close(void)
+{
+  if (list_fp != NULL && list_fp != stdin) fclose(list_fp);
+  list_fp = NULL;
+  free(buf);
+  buf = NULL;
+  return;
+}
@@ -0,0 +1,40 @@
+/* jdupes reader for --files-from lists of file names
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#ifndef FILELIST_H
+#define FILELIST_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/* Columns that can come before the path in each record */
+#define FILELIST_SIZE	0x1U
+#define FILELIST_INODE	0x2U
+#define FILELIST_DEVICE	0x4U
+#define FILELIST_MTIME	0x8U
+
+/* One record; path points into the reader's buffer and is only valid
+ * until the next call to filelist_next() */
+struct filelist_entry {
+  char *path;
+  int64_t size;
+  uint64_t inode;
+  uint64_t device;
+  int64_t mtime;
+};
+
+extern unsigned int filelist_columns;
+
+extern int filelist_set_columns(const char * const restrict list);
+extern int filelist_open(const char * const restrict name);
+extern int filelist_next(struct filelist_entry * const restrict entry);
+extern void filelist_close(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FILELIST_H */
@@ -0,0 +1,309 @@
+/* File hashes kept in extended attributes
+ *
+ * With --hash-xattr, the partial and full hashes of each file are saved
+ * in a "user.jdupes.hash" extended attribute on the file itself, along
+ * with the size, inode and mtime (to the nanosecond) the file had when
+ * they were taken. Later runs, on this host or any other that sees the
+ * same volume, use the saved hashes instead of reading the file as long
+ * as all of these still match, so unchanged files with no duplicates are
+ * never read again. The ctime would catch more, but setting the
+ * attribute changes it, so it can't be part of the record.
+ *
+ * An attribute can be wrong without any of these giving it away:
+ * a tool that restores an old mtime after writing, a copy that carried
+ * the attribute along to different data, or someone writing attributes
+ * on purpose. --hash-xattr-verify=PCT ignores the saved hashes of that
+ * share of files, hashes them again and reports each one that disagrees.
+ * Matches are still confirmed byte for byte unless -Q or -T is used, so
+ * a bad attribute can hide a duplicate but not make one up.
+ *
+ * The attribute is a fixed little-endian record:
+ *   0  4  magic "jdh" and format version
+ *   4  4  which hashes are present (XR_PARTIAL, XR_FULL)
+ *   8  4  PARTIAL_HASH_SIZE the partial hash was taken with
+ *  12  4  hash algorithm (XR_XXHASH64)
+ *  16  8  file size
+ *  24  8  file mtime in seconds
+ *  32  4  nanoseconds part of the mtime
+ *  36  4  unused, zero
+ *  40  8  file inode
+ *  48  8  partial hash
+ *  56  8  full hash
+ *
+ * hashcache_load() may run on I/O queue threads; everything else runs
+ * on the main thread.
+ *
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#if defined __linux__ || defined __APPLE__
+ #include <sys/stat.h>
+ #include <sys/xattr.h>
+ #define HASHCACHE_SUPPORTED
+ #ifdef __APPLE__
+  #define ST_MTIME_NSEC(st) ((st).st_mtimespec.tv_nsec)
+ #else
+  #define ST_MTIME_NSEC(st) ((st).st_mtim.tv_nsec)
+ #endif
+#endif
+#include "jdupes.h"
+#include "filelist.h"
+#include "hashcache.h"
+
+#define XATTR_NAME "user.jdupes.hash"
+#define XR_SIZE 64
+#define XR_VERSION 2
+#define XR_PARTIAL 0x1U
+#define XR_FULL 0x2U
+#define XR_XXHASH64 1
+
+unsigned int hashcache_mode = 0;
+
+/* Files are sampled for verification if their mixed inode/device falls
+ * under this threshold out of 2^32 */
+static uint64_t verify_threshold = 0;
+static uint64_t verify_seed = 0;
+static uintmax_t verify_checked = 0, verify_bad = 0;
+
+struct xattr_record {
+  uint32_t present;
+  int64_t size;
+  int64_t mtime;
+  uint32_t mtime_nsec;
+  uint64_t inode;
+  jdupes_hash_t partial;
+  jdupes_hash_t full;
+};
+
+
+/* Pick "rw" (read and write, the default) or "ro" (read only) */
+extern int hashcache_set_mode(const char * const restrict mode)
+{
+#ifdef HASHCACHE_SUPPORTED
+  if (mode == NULL || strcmp(mode, "rw") == 0) hashcache_mode = HASHCACHE_READ | HASHCACHE_WRITE;
+  else if (strcmp(mode, "ro") == 0) hashcache_mode = HASHCACHE_READ;
+  else {
+    errno = EINVAL;
+    return -1;
+  }
+  return 0;
+#else
+  (void)mode;
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+
+/* Set the percentage of files to hash again despite a valid attribute */
+extern int hashcache_set_verify(const char * const restrict percent)
+{
+  char *end;
+  const double pct = strtod(percent, &end);
+
+  if (*percent == '\0' || *end != '\0' || !(pct > 0.0) || pct > 100.0) {
+    errno = EINVAL;
+    return -1;
+  }
+  verify_threshold = (uint64_t)(pct * 42949672.96);
+  if (pct >= 100.0) verify_threshold = (uint64_t)1 << 32;
+  /* Check different files on every run */
+  verify_seed = ((uint64_t)time(NULL) << 20) ^ (uint64_t)getpid();
+  return 0;
+}
+
+
+static int sampled(const file_t * const restrict file)
+{
+  uint64_t x = (uint64_t)file->inode ^ ((uint64_t)file->device * 0x9e3779b97f4a7c15ULL) ^ verify_seed;
+
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  return ((x & 0xffffffffU) < verify_threshold) ? 1 : 0;
+}
+
+
+static void put_le(unsigned char * const restrict p, uint64_t v, const int bytes)
+{
+  for (int i = 0; i < bytes; i++, v >>= 8) p[i] = (unsigned char)(v & 0xff);
+  return;
+}
+
+
+static uint64_t get_le(const unsigned char * const restrict p, size_t bytes)
+{
+  uint64_t v = 0;
+
+  while (bytes > 0) v = (v << 8) | p[--bytes];
+  return v;
+}
+
+
+#ifdef HASHCACHE_SUPPORTED
+/* Read and check a file's attribute; returns 0 if it belongs to the
+ * file as it is now, -1 if it is missing, damaged or out of date */
+static int read_record(const file_t * const restrict file, struct xattr_record * const restrict rec)
+{
+  unsigned char buf[XR_SIZE];
+  ssize_t len;
+
+ #ifdef __APPLE__
+  len = getxattr(file->d_name, XATTR_NAME, buf, sizeof(buf), 0, 0);
+ #else
+  len = getxattr(file->d_name, XATTR_NAME, buf, sizeof(buf));
+ #endif
+  if (len != XR_SIZE) return -1;
+  if (memcmp(buf, "jdh", 3) != 0 || buf[3] != XR_VERSION) return -1;
+  if (get_le(buf + 8, 4) != PARTIAL_HASH_SIZE || get_le(buf + 12, 4) != XR_XXHASH64) return -1;
+  rec->present = (uint32_t)get_le(buf + 4, 4);
+  rec->size = (int64_t)get_le(buf + 16, 8);
+  rec->mtime = (int64_t)get_le(buf + 24, 8);
+  rec->mtime_nsec = (uint32_t)get_le(buf + 32, 4);
+  rec->inode = get_le(buf + 40, 8);
+  rec->partial = (jdupes_hash_t)get_le(buf + 48, 8);
+  rec->full = (jdupes_hash_t)get_le(buf + 56, 8);
+  if (rec->size != (int64_t)file->size || rec->mtime != (int64_t)file->mtime
+      || rec->mtime_nsec != file->mtime_nsec || rec->inode != (uint64_t)file->inode) return -1;
+  return 0;
+}
+
+
+/* Get the nanoseconds of the mtime, which the scan doesn't keep. A file
+ * that no longer looks like it did when it was scanned gets no record. */
+static int stat_nsec(file_t * const restrict file)
+{
+  struct stat st;
+
+  if (stat(file->d_name, &st) != 0) return -1;
+  if (st.st_size != file->size || st.st_mtime != file->mtime
+      || (jdupes_ino_t)st.st_ino != file->inode) return -1;
+  file->mtime_nsec = (uint32_t)ST_MTIME_NSEC(st);
+  return 0;
+}
+#endif
+
+
+/* A listed file without an mtime can't be told apart from an older
+ * version of itself with the same size */
+static int usable(const file_t * const restrict file)
+{
+  if (ISFLAG(file->flags, F_LISTED_STAT) && !(filelist_columns & FILELIST_MTIME)) return 0;
+  return 1;
+}
+
+
+/* Take a file's hashes from its attribute if they are still valid. Only
+ * the first call for each file does anything. */
+extern void hashcache_load(file_t * const restrict file)
+{
+#ifdef HASHCACHE_SUPPORTED
+  struct xattr_record rec;
+
+  if (!(hashcache_mode & HASHCACHE_READ) || ISFLAG(file->flags, F_XATTR_SEEN)) return;
+  if (!usable(file) || stat_nsec(file) != 0) return;
+  SETFLAG(file->flags, F_XATTR_SEEN);
+  if (read_record(file, &rec) != 0) return;
+
+  if (verify_threshold != 0 && sampled(file)) {
+    SETFLAG(file->flags, F_XATTR_VERIFY);
+    return;
+  }
+  if ((rec.present & XR_PARTIAL) && !ISFLAG(file->flags, F_HASH_PARTIAL)) {
+    file->filehash_partial = rec.partial;
+    SETFLAG(file->flags, F_HASH_PARTIAL | F_XATTR_PARTIAL);
+  }
+  /* -T passes partial hashes off as full hashes; keep the two apart */
+  if ((rec.present & XR_FULL) && !ISFLAG(file->flags, F_HASH_FULL) && !ISFLAG(flags, F_PARTIALONLY)) {
+    file->filehash = rec.full;
+    SETFLAG(file->flags, F_HASH_FULL | F_XATTR_FULL);
+  }
+#else
+  (void)file;
+#endif
+  return;
+}
+
+
+/* Save hashes that the attribute doesn't have yet, and compare the ones
+ * taken for verification with what the attribute says */
+extern void hashcache_store(file_t * const restrict file)
+{
+#ifdef HASHCACHE_SUPPORTED
+  struct xattr_record rec;
+  unsigned char buf[XR_SIZE];
+  uint32_t present = 0;
+  int changed = 0;
+
+  if (!ISFLAG(file->flags, F_XATTR_SEEN)) return;
+  if (ISFLAG(file->flags, F_HASH_PARTIAL)) {
+    present |= XR_PARTIAL;
+    if (!ISFLAG(file->flags, F_XATTR_PARTIAL)) changed = 1;
+  }
+  if (ISFLAG(file->flags, F_HASH_FULL) && !ISFLAG(flags, F_PARTIALONLY)) {
+    present |= XR_FULL;
+    if (!ISFLAG(file->flags, F_XATTR_FULL)) changed = 1;
+  }
+  if (!changed) return;
+
+  if (ISFLAG(file->flags, F_XATTR_VERIFY) && read_record(file, &rec) == 0) {
+    int bad = 0;
+
+    if ((present & rec.present & XR_PARTIAL) && rec.partial != file->filehash_partial) bad = 1;
+    if ((present & rec.present & XR_FULL) && rec.full != file->filehash) bad = 1;
+    verify_checked++;
+    if (bad) {
+      verify_bad++;
+      fprintf(stderr, "\nwarning: stale or forged hash attribute on '%s'\n", file->d_name);
+    } else if ((present & ~rec.present) == 0) {
+      /* Nothing new to save */
+      CLEARFLAG(file->flags, F_XATTR_VERIFY);
+      return;
+    }
+  }
+  CLEARFLAG(file->flags, F_XATTR_VERIFY);
+  if (!(hashcache_mode & HASHCACHE_WRITE) || !usable(file)) return;
+
+  memcpy(buf, "jdh", 3);
+  buf[3] = XR_VERSION;
+  put_le(buf + 4, present, 4);
+  put_le(buf + 8, PARTIAL_HASH_SIZE, 4);
+  put_le(buf + 12, XR_XXHASH64, 4);
+  put_le(buf + 16, (uint64_t)(int64_t)file->size, 8);
+  put_le(buf + 24, (uint64_t)(int64_t)file->mtime, 8);
+  put_le(buf + 32, file->mtime_nsec, 4);
+  put_le(buf + 36, 0, 4);
+  put_le(buf + 40, (uint64_t)file->inode, 8);
+  put_le(buf + 48, (present & XR_PARTIAL) ? file->filehash_partial : 0, 8);
+  put_le(buf + 56, (present & XR_FULL) ? file->filehash : 0, 8);
+ #ifdef __APPLE__
+  if (setxattr(file->d_name, XATTR_NAME, buf, sizeof(buf), 0, 0) != 0) {
+ #else
+  if (setxattr(file->d_name, XATTR_NAME, buf, sizeof(buf), 0) != 0) {
+ #endif
+    LOUD(fprintf(stderr, "hashcache_store: can't set attribute on '%s': %s\n", file->d_name, strerror(errno)));
+    return;
+  }
+  if (present & XR_PARTIAL) SETFLAG(file->flags, F_XATTR_PARTIAL);
+  if (present & XR_FULL) SETFLAG(file->flags, F_XATTR_FULL);
+#else
+  (void)file;
+#endif
+  return;
+}
+
+
+/* Sum up verification results */
+extern void hashcache_report(void)
+{
+  if (verify_threshold == 0 || !(hashcache_mode & HASHCACHE_READ)) return;
+  fprintf(stderr, "Hash attributes verified: %" PRIuMAX ", stale or forged: %" PRIuMAX "\n",
+      verify_checked, verify_bad);
+  return;
+}
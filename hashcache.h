@@ -0,0 +1,29 @@
+/* jdupes file hashes kept in extended attributes
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#ifndef HASHCACHE_H
+#define HASHCACHE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "jdupes.h"
+
+/* hashcache_mode bits */
+#define HASHCACHE_READ	0x1U
+#define HASHCACHE_WRITE	0x2U
+
+extern unsigned int hashcache_mode;
+
+extern int hashcache_set_mode(const char * const restrict mode);
+extern int hashcache_set_verify(const char * const restrict percent);
+extern void hashcache_load(file_t * const restrict file);
+extern void hashcache_store(file_t * const restrict file);
+extern void hashcache_report(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HASHCACHE_H */
@@ -0,0 +1,305 @@
+/* Per-device I/O queues
+ *
+ * Files on different devices are read at the same time by separate sets
+ * of worker threads, so a slow USB disk or network mount never holds up
+ * hashing on a fast local drive. Every device gets its own queue and its
+ * own number of readers: one for rotating disks, where parallel reads
+ * only add seeks, and several for solid state and network storage, which
+ * need a few requests in flight to reach full speed. --io-threads changes
+ * the number for all devices or for the device holding a given path.
+ *
+ * Only work that can safely be done out of order (reading hashes ahead
+ * of the matching pass, confirming whole duplicate sets) goes through the
+ * queues; everything that depends on the order of the file list stays on
+ * the main thread. Jobs that need a lot of memory each can cap the total
+ * number of workers with ioq_run_limited().
+ *
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#ifndef ON_WINDOWS
+ #include <pthread.h>
+ #ifdef __linux__
+  #include <sys/sysmacros.h>
+ #endif
+#endif
+#include "jdupes.h"
+#include "ioqueue.h"
+
+/* Devices with their own queue; files on any others share the last one */
+#define IOQ_MAX_DEVS 64
+/* Devices that can be given their own reader count */
+#define IOQ_MAX_SETTINGS 32
+/* Nanoseconds between progress updates while waiting for the workers */
+#define IOQ_PROGRESS_INTERVAL 250000000L
+
+struct ioq_setting {
+  dev_t dev;
+  unsigned int threads;
+};
+
+static unsigned int default_threads = IOQ_DEFAULT_THREADS;
+static int default_given = 0;
+static struct ioq_setting settings[IOQ_MAX_SETTINGS];
+static unsigned int setting_cnt = 0;
+
+
+/* Reader count for every device without its own setting; 0 turns the
+ * queues off and leaves all reading to the main thread */
+extern void ioq_set_threads(const unsigned int threads)
+{
+  default_threads = (threads > IOQ_MAX_THREADS) ? IOQ_MAX_THREADS : threads;
+  default_given = 1;
+  return;
+}
+
+
+/* Reader count for the device holding a path; returns -1 on failure */
+extern int ioq_set_device_threads(const char * const restrict path, const unsigned int threads)
+{
+  struct stat st;
+  unsigned int i;
+
+  if (stat(path, &st) != 0) return -1;
+  for (i = 0; i < setting_cnt; i++) if (settings[i].dev == st.st_dev) break;
+  if (i == IOQ_MAX_SETTINGS) return -1;
+  if (i == setting_cnt) setting_cnt++;
+  settings[i].dev = st.st_dev;
+  settings[i].threads = (threads > IOQ_MAX_THREADS) ? IOQ_MAX_THREADS : threads;
+  if (settings[i].threads == 0) settings[i].threads = 1;
+  return 0;
+}
+
+
+#ifdef ON_WINDOWS
+
+/* No worker threads on Windows; the main thread does all reading */
+extern int ioq_enabled(void)
+{
+  return 0;
+}
+
+
+extern int ioq_run_limited(file_t ** const restrict files, const size_t count,
+                ioq_func_t func, ioq_progress_t progress, const unsigned int max_threads)
+{
+  (void)files; (void)count; (void)func; (void)progress; (void)max_threads;
+  return 0;
+}
+
+#else
+
+struct ioq_dev {
+  dev_t dev;
+  unsigned int threads;
+  size_t start, next, end;  /* This device's part of the job array */
+};
+
+struct ioq_thread {
+  pthread_t thread;
+  struct ioq_dev *dev;
+  int started;
+  struct ioq_worker w;
+};
+
+static file_t **jobs;
+static ioq_func_t job_func;
+static size_t jobs_done, jobs_total;
+static pthread_mutex_t ioq_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ioq_cond = PTHREAD_COND_INITIALIZER;
+
+
+extern int ioq_enabled(void)
+{
+  return default_threads != 0;
+}
+
+
+#ifdef __linux__
+/* Ask sysfs whether a block device spins; partitions keep their queue
+ * settings in the parent disk's directory */
+static int device_rotational(const dev_t dev)
+{
+  char path[64];
+  FILE *fp;
+  int c;
+
+  snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/queue/rotational", major(dev), minor(dev));
+  fp = fopen(path, "r");
+  if (fp == NULL) {
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../queue/rotational", major(dev), minor(dev));
+    fp = fopen(path, "r");
+  }
+  if (fp == NULL) return 0;
+  c = fgetc(fp);
+  fclose(fp);
+  return c == '1';
+}
+#endif
+
+
+static unsigned int device_threads(const dev_t dev)
+{
+  for (unsigned int i = 0; i < setting_cnt; i++)
+    if (settings[i].dev == dev) return settings[i].threads;
+#ifdef __linux__
+  if (!default_given && device_rotational(dev)) return 1;
+#endif
+  return default_threads;
+}
+
+
+static unsigned int find_dev(struct ioq_dev * const restrict devs,
+                unsigned int * const restrict dev_cnt, const dev_t dev, const unsigned int max_devs)
+{
+  unsigned int i;
+
+  for (i = 0; i < *dev_cnt; i++) if (devs[i].dev == dev) return i;
+  if (*dev_cnt == max_devs) return max_devs - 1;
+  devs[i].dev = dev;
+  devs[i].end = 0;
+  (*dev_cnt)++;
+  return i;
+}
+
+
+/* Take files off one device's queue until it is empty */
+static void *ioq_worker(void *arg)
+{
+  struct ioq_thread * const t = (struct ioq_thread *)arg;
+  struct ioq_dev * const d = t->dev;
+  file_t *file;
+
+  while (1) {
+    pthread_mutex_lock(&ioq_lock);
+    if (d->next == d->end) {
+      pthread_mutex_unlock(&ioq_lock);
+      break;
+    }
+    file = jobs[d->next++];
+    pthread_mutex_unlock(&ioq_lock);
+
+    job_func(file, &t->w);
+
+    /* Only the last job wakes the main thread; it polls for progress */
+    pthread_mutex_lock(&ioq_lock);
+    if (++jobs_done == jobs_total) pthread_cond_signal(&ioq_cond);
+    pthread_mutex_unlock(&ioq_lock);
+  }
+  return NULL;
+}
+
+
+/* Run func on every file, with the files split into per-device queues
+ * that are worked on at the same time. No more than max_threads workers
+ * run at once unless it is 0; devices beyond that many share the last
+ * queue. Returns 0 without doing anything if a single reader would end
+ * up doing all the work anyway, since the caller can do that just as
+ * well without the extra pass. */
+extern int ioq_run_limited(file_t ** const restrict files, const size_t count,
+                ioq_func_t func, ioq_progress_t progress, const unsigned int max_threads)
+{
+  struct ioq_dev devs[IOQ_MAX_DEVS];
+  struct ioq_thread *threads;
+  const unsigned int max_devs = (max_threads != 0 && max_threads < IOQ_MAX_DEVS) ? max_threads : IOQ_MAX_DEVS;
+  unsigned int dev_cnt = 0, n_threads = 0, i, j;
+  size_t pos = 0, done;
+
+  if (files == NULL || func == NULL) nullptr("ioq_run()");
+  if (!ioq_enabled() || count < 2) return 0;
+
+  /* Count the files on each device and lay the queues out in a row */
+  for (size_t k = 0; k < count; k++) devs[find_dev(devs, &dev_cnt, files[k]->device, max_devs)].end++;
+  for (i = 0; i < dev_cnt; i++) {
+    const size_t n = devs[i].end;
+
+    devs[i].start = devs[i].next = pos;
+    devs[i].end = pos;
+    pos += n;
+    devs[i].threads = device_threads(devs[i].dev);
+    if (devs[i].threads > n) devs[i].threads = (unsigned int)n;
+    n_threads += devs[i].threads;
+  }
+  /* Take readers away from the devices with the most until under the cap */
+  while (max_threads != 0 && n_threads > max_threads) {
+    unsigned int most = 0;
+
+    for (i = 1; i < dev_cnt; i++) if (devs[i].threads > devs[most].threads) most = i;
+    devs[most].threads--;
+    n_threads--;
+  }
+  if (n_threads < 2) return 0;
+
+  jobs = (file_t **)malloc(sizeof(file_t *) * count);
+  threads = (struct ioq_thread *)calloc(n_threads, sizeof(struct ioq_thread));
+  if (jobs == NULL || threads == NULL) oom("ioq_run()");
+  for (size_t k = 0; k < count; k++) {
+    struct ioq_dev * const d = &devs[find_dev(devs, &dev_cnt, files[k]->device, max_devs)];
+    jobs[d->end++] = files[k];
+  }
+  job_func = func;
+  jobs_done = 0;
+  jobs_total = count;
+
+  n_threads = 0;
+  for (i = 0; i < dev_cnt; i++) {
+    for (j = 0; j < devs[i].threads; j++) {
+      struct ioq_thread * const t = &threads[n_threads++];
+
+      t->dev = &devs[i];
+      t->started = (pthread_create(&t->thread, NULL, ioq_worker, t) == 0);
+    }
+  }
+  /* If no thread could be started for a device, work its queue here */
+  for (i = 0, j = 0; i < dev_cnt; i++) {
+    unsigned int running = 0, first = j;
+
+    for (; j < n_threads && threads[j].dev == &devs[i]; j++) running += (unsigned int)threads[j].started;
+    if (running == 0) ioq_worker(&threads[first]);
+  }
+
+  pthread_mutex_lock(&ioq_lock);
+  while (jobs_done < count) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    if (ts.tv_nsec >= 1000000000L - IOQ_PROGRESS_INTERVAL) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000L - IOQ_PROGRESS_INTERVAL;
+    } else ts.tv_nsec += IOQ_PROGRESS_INTERVAL;
+    pthread_cond_timedwait(&ioq_cond, &ioq_lock, &ts);
+    done = jobs_done;
+    pthread_mutex_unlock(&ioq_lock);
+    if (progress != NULL) progress(done, count);
+    pthread_mutex_lock(&ioq_lock);
+  }
+  pthread_mutex_unlock(&ioq_lock);
+
+  for (i = 0; i < n_threads; i++) {
+    struct ioq_thread * const t = &threads[i];
+
+    if (t->started) pthread_join(t->thread, NULL);
+    STATS_BYTES(t->w.bytes);
+    STATS_SYSCALL(t->w.syscalls);
+    phase_stats[stats_phase].files_opened += t->w.opened;
+    free(t->w.buf);
+  }
+  free(threads);
+  free(jobs);
+  jobs = NULL;
+  return 1;
+}
+
+#endif /* ON_WINDOWS */
+
+
+extern int ioq_run(file_t ** const restrict files, const size_t count,
+                ioq_func_t func, ioq_progress_t progress)
+{
+  return ioq_run_limited(files, count, func, progress, 0);
+}
@@ -0,0 +1,53 @@
+/* jdupes per-device I/O queues
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#ifndef IOQUEUE_H
+#define IOQUEUE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "jdupes.h"
+#include "runstats.h"
+
+/* Default number of readers per device; rotating disks only get one */
+#ifndef IOQ_DEFAULT_THREADS
+ #define IOQ_DEFAULT_THREADS 4
+#endif
+#define IOQ_MAX_THREADS 64
+
+/* Scratch space and counters owned by one worker thread. Workers can't
+ * touch the shared --stats counters, so they count here and the totals
+ * are added to the current phase when the queues have drained. */
+struct ioq_worker {
+  void *buf;
+  size_t buf_size;
+  uintmax_t bytes;
+  uintmax_t opened;
+  uintmax_t syscalls;
+};
+
+/* Count I/O for the --stats report from either a worker or the main thread */
+#define IOQ_BYTES(w, n) do { if (w) (w)->bytes += (uintmax_t)(n); else STATS_BYTES(n); } while (0)
+#define IOQ_OPEN(w) do { if (w) (w)->opened++; else STATS_OPEN(); } while (0)
+#define IOQ_SYSCALL(w, n) do { if (w) (w)->syscalls += (n); else STATS_SYSCALL(n); } while (0)
+
+typedef void (*ioq_func_t)(file_t * const restrict file, struct ioq_worker * const restrict w);
+typedef void (*ioq_progress_t)(const size_t done, const size_t total);
+
+extern void ioq_set_threads(const unsigned int threads);
+extern int ioq_set_device_threads(const char * const restrict path, const unsigned int threads);
+extern int ioq_enabled(void);
+extern int ioq_run(file_t ** const restrict files, const size_t count,
+                ioq_func_t func, ioq_progress_t progress);
+extern int ioq_run_limited(file_t ** const restrict files, const size_t count,
+                ioq_func_t func, ioq_progress_t progress, const unsigned int max_threads);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* IOQUEUE_H */
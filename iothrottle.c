@@ -0,0 +1,169 @@
+/* Read rate limits and I/O priority
+ *
+ * For runs on busy production storage, --max-read-rate and --max-iops
+ * cap how fast jdupes reads file data. Each limit is a token bucket that
+ * fills at the given rate and holds up to a quarter second's worth of
+ * tokens, so short bursts are smoothed out without letting an idle spell
+ * turn into a long burst later. A reader takes the tokens it needs before
+ * each read, going into debt if there aren't enough, and then sleeps off
+ * the debt outside the lock; readers on the I/O queue threads share the
+ * same buckets, so the limits apply to the whole process.
+ *
+ * --io-priority lowers the I/O scheduling class of the process on Linux
+ * so that other programs' I/O always goes first.
+ *
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#ifndef ON_WINDOWS
+ #include <pthread.h>
+#endif
+#ifdef __linux__
+ #include <sys/syscall.h>
+ #include <unistd.h>
+#endif
+#include "jdupes.h"
+#include "runstats.h"
+#include "iothrottle.h"
+
+/* Seconds of tokens a bucket can save up */
+#define BUCKET_SECONDS 0.25
+
+/* Linux I/O priority interface; glibc has no wrapper for it */
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+
+struct bucket {
+  double rate;     /* Tokens per second; 0 = no limit */
+  double tokens;   /* Can go below zero while readers wait */
+  uint64_t last;   /* When tokens were last added */
+};
+
+int throttle_enabled = 0;
+
+static struct bucket bytes_bucket, ops_bucket;
+#ifndef ON_WINDOWS
+static pthread_mutex_t throttle_lock = PTHREAD_MUTEX_INITIALIZER;
+ #define THROTTLE_LOCK() pthread_mutex_lock(&throttle_lock)
+ #define THROTTLE_UNLOCK() pthread_mutex_unlock(&throttle_lock)
+#else
+ #define THROTTLE_LOCK()
+ #define THROTTLE_UNLOCK()
+#endif
+
+
+static void bucket_init(struct bucket * const restrict b, const double rate)
+{
+  b->rate = rate;
+  b->tokens = 0.0;
+  b->last = 0;
+  throttle_enabled = (bytes_bucket.rate > 0.0 || ops_bucket.rate > 0.0);
+  return;
+}
+
+
+extern void throttle_set_rate(const double bytes_per_sec)
+{
+  bucket_init(&bytes_bucket, bytes_per_sec);
+  return;
+}
+
+
+extern void throttle_set_iops(const double iops)
+{
+  bucket_init(&ops_bucket, iops);
+  return;
+}
+
+
+/* Take tokens from a bucket; returns nanoseconds to wait for them */
+static uint64_t bucket_take(struct bucket * const restrict b, const double count, const uint64_t now)
+{
+  const double cap = b->rate * BUCKET_SECONDS;
+
+  if (b->rate <= 0.0) return 0;
+  if (b->last != 0) {
+    b->tokens += b->rate * (double)(now - b->last) / 1000000000.0;
+    if (b->tokens > cap) b->tokens = cap;
+  }
+  b->last = now;
+  b->tokens -= count;
+  if (b->tokens >= 0.0) return 0;
+  return (uint64_t)(-b->tokens / b->rate * 1000000000.0);
+}
+
+
+/* Wait until a read of len bytes is allowed */
+extern void throttle_wait(const size_t len)
+{
+  uint64_t now, wait, wait_ops;
+
+  if (!throttle_enabled) return;
+  THROTTLE_LOCK();
+  now = stats_clock();
+  wait = bucket_take(&bytes_bucket, (double)len, now);
+  wait_ops = bucket_take(&ops_bucket, 1.0, now);
+  THROTTLE_UNLOCK();
+  if (wait_ops > wait) wait = wait_ops;
+  if (wait == 0) return;
+
+#ifdef ON_WINDOWS
+  Sleep((DWORD)(wait / 1000000));
+#else
+  {
+    struct timespec ts;
+
+    ts.tv_sec = (time_t)(wait / 1000000000U);
+    ts.tv_nsec = (long)(wait % 1000000000U);
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR);
+  }
+#endif
+  return;
+}
+
+
+/* Set the I/O scheduling class from "idle" or "best-effort[:LEVEL]"
+ * (LEVEL 0 is the highest, 7 the lowest and the default here). Returns
+ * 0 on success or -1 with errno set. */
+extern int throttle_set_priority(const char * const restrict spec)
+{
+#ifdef __linux__
+  const char *level = strchr(spec, ':');
+  const size_t len = (level == NULL) ? strlen(spec) : (size_t)(level - spec);
+  long data = 7;
+  int class;
+
+  if (len == 4 && strncmp(spec, "idle", 4) == 0 && level == NULL) {
+    class = IOPRIO_CLASS_IDLE;
+    data = 0;
+  } else if ((len == 11 && strncmp(spec, "best-effort", 11) == 0) || (len == 2 && strncmp(spec, "be", 2) == 0)) {
+    class = IOPRIO_CLASS_BE;
+    if (level != NULL) {
+      char *end;
+
+      data = strtol(level + 1, &end, 10);
+      if (level[1] == '\0' || *end != '\0' || data < 0 || data > 7) {
+        errno = EINVAL;
+        return -1;
+      }
+    }
+  } else {
+    errno = EINVAL;
+    return -1;
+  }
+  /* Threads started later inherit the priority */
+  if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, (class << IOPRIO_CLASS_SHIFT) | (int)data) != 0) return -1;
+  return 0;
+#else
+  (void)spec;
+  errno = ENOSYS;
+  return -1;
+#endif
+}
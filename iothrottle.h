@@ -0,0 +1,24 @@
+/* jdupes read rate limits and I/O priority for background runs
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#ifndef IOTHROTTLE_H
+#define IOTHROTTLE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+extern int throttle_enabled;
+
+extern void throttle_set_rate(const double bytes_per_sec);
+extern void throttle_set_iops(const double iops);
+extern void throttle_wait(const size_t len);
+extern int throttle_set_priority(const char * const restrict spec);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* IOTHROTTLE_H */
@@ -37,7 +37,6 @@
 #endif
 #include <string.h>
 #include <errno.h>
-#include <libgen.h>
 #include <sys/time.h>
 #include "jdupes.h"
 #include "string_malloc.h"
@@ -45,14 +44,27 @@
 #include "jody_sort.h"
 #include "jody_win_unicode.h"
 #include "jody_cacheinfo.h"
+#include "extsort.h"
+#include "blockmatch.h"
+#include "dirmatch.h"
+#include "runstats.h"
+#include "chunksize.h"
+#include "ioqueue.h"
+#include "iothrottle.h"
+#include "filelist.h"
+#include "exclude.h"
+#include "hashcache.h"
 #include "version.h"
 
 /* Headers for post-scanning actions */
 #include "act_deletefiles.h"
 #include "act_dedupefiles.h"
+#include "act_clonefiles.h"
 #include "act_linkfiles.h"
 #include "act_printmatches.h"
 #include "act_summarize.h"
+#include "act_output.h"
+#include "outbuf.h"
 
 /* Detect Windows and modify as needed */
 #if defined _WIN32 || defined __CYGWIN__
@@ -107,6 +119,10 @@ struct stat s;
 
 static size_t auto_chunk_size = CHUNK_SIZE;
 
+/* Memory limit for scanned file records (--max-memory) */
+static uintmax_t max_memory = 0;
+static uintmax_t scan_memory = 0;
+
 /* Maximum path buffer size to use; must be large enough for a path plus
  * any work that might be done to the array it's stored in. PATH_MAX is
  * not always true. Read this article on the false promises of PATH_MAX:
@@ -167,8 +183,8 @@ static const char *extensions[] = {
     #ifdef LOUD_DEBUG
     "loud",
     #endif
-    #ifdef ENABLE_BTRFS
-    "btrfs",
+    #ifdef ENABLE_DEDUPE
+    "dedupe",
     #endif
     #ifdef LOW_MEMORY
     "lowmem",
@@ -191,19 +207,65 @@ static const char *extensions[] = {
     NULL
 };
 
-/* Tree to track each directory traversed */
+/* Hash set of (device, inode) for each item traversed (open addressing)
+ * A slot is in use only if it has the current generation, so the whole
+ * set is emptied by moving on to the next generation */
 struct travdone {
-  struct travdone *left;
-  struct travdone *right;
   jdupes_ino_t inode;
   dev_t device;
+  uint32_t generation;
 };
-static struct travdone *travdone_head = NULL;
+#define TRAVDONE_MIN_SLOTS 1024
+static struct travdone *travdone = NULL;
+static size_t travdone_slots = 0, travdone_used = 0;
+static uint32_t travdone_generation = 1;
+
+/* Compact file size histogram; it only needs to know if a size is unique
+ * Slots hold (size + 1) with SIZEHIST_MULTI set for repeated sizes */
+#define SIZEHIST_MULTI 0x8000000000000000ULL
+#define SIZEHIST_MIN_SLOTS 4096
+static uint64_t *sizehist = NULL;
+static size_t sizehist_slots = 0, sizehist_used = 0;
+
+/* Scanning passes: --size-prepass only records sizes on the first pass */
+enum scan_pass { SCAN_SIZES, SCAN_FILES };
+static enum scan_pass scan_pass = SCAN_FILES;
+static int size_prepass = 0;
+
+/* Average chunk size for --blocks; 0 = normal whole-file matching */
+static size_t blocks_avg = 0;
+
+/* --dirs reports whole duplicate directory trees */
+static int dirs_mode = 0;
+
+/* --stream: duplicate sets acted on so far; files prehashed per batch */
+static uintmax_t streamed_sets = 0;
+#define STREAM_BATCH 4096
+
+/* --confirm-memory: all byte-for-byte confirmation buffers together */
+#ifndef CONFIRM_MEMORY_DEFAULT
+ #define CONFIRM_MEMORY_DEFAULT 67108864
+#endif
+static size_t confirm_memory = CONFIRM_MEMORY_DEFAULT;
+/* Size of each buffer of a pair in the current confirm_sets() run */
+static size_t confirm_chunk = 0;
+
+/* --files-from: list of files to check, "-" for stdin */
+static const char *files_from = NULL;
+
+/* --hash-xattr-verify was given */
+static int hashcache_verify = 0;
 
 /* Exclusion tree head and static tag list */
 struct exclude *exclude_head = NULL;
 const struct exclude_tags exclude_tags[] = {
   { "dir",	X_DIR },
+  { "name",	X_NAME },
+  { "path",	X_PATH },
+  { "ext",	X_EXT },
+#ifndef ON_WINDOWS
+  { "regex",	X_REGEX },
+#endif
   { "size+",	X_SIZE_GT },
   { "size+=",	X_SIZE_GTEQ },
   { "size-=",	X_SIZE_LTEQ },
@@ -236,18 +298,40 @@ static unsigned int tree_depth = 0;
 static unsigned int max_depth = 0;
 #endif
 
-/* File tree head */
-static filetree_t *checktree = NULL;
-
 /* Directory/file parameter position counter */
 static unsigned int user_item_count = 1;
 
 /* registerfile() direction options */
 enum tree_direction { NONE, LEFT, RIGHT };
 
+/* Long options without a short option equivalent */
+enum {
+  OPT_MAXMEMORY = 256,
+  OPT_SIZEPREPASS,
+  OPT_BLOCKS,
+  OPT_DIRS,
+  OPT_STATS,
+  OPT_STATUSFD,
+  OPT_STATUSSOCKET,
+  OPT_IOTHREADS,
+  OPT_MAXREADRATE,
+  OPT_MAXIOPS,
+  OPT_IOPRIORITY,
+  OPT_STREAM,
+  OPT_OUTPUT,
+  OPT_FILESFROM,
+  OPT_FILESFROMCOLUMNS,
+  OPT_HASHXATTR,
+  OPT_HASHXATTRVERIFY,
+  OPT_CONFIRMMEMORY
+};
+
 /* Sort order reversal */
 static int sort_direction = 1;
 
+/* Order of files within a duplicate set (-o) */
+static ordertype_t ordertype = ORDER_NAME;
+
 /* Signal handler */
 static int interrupt = 0;
 
@@ -384,6 +468,14 @@ static void update_progress(const char * const restrict msg, const int file_perc
   return;
 }
 
+/* Pass current progress on to --status-fd/--status-socket readers
+ * The total is only known after scanning; pass 0 while scanning */
+static inline void update_status(const uintmax_t total)
+{
+  if (status_enabled) status_update(progress, total, dupecount);
+  return;
+}
+
 /* Check file's stat() info to make sure nothing has changed
  * Returns 1 if changed, 0 if not changed, negative if error */
 extern int file_has_changed(file_t * const restrict file)
@@ -393,26 +485,33 @@ extern int file_has_changed(file_t * const restrict file)
 
   if (!ISFLAG(file->flags, F_VALID_STAT)) return -66;
 
+  /* Only what a --files-from list gave can be compared for its files */
+  const int listed = ISFLAG(file->flags, F_LISTED_STAT) ? 1 : 0;
+  const int check_mtime = !listed || (filelist_columns & FILELIST_MTIME);
+
 #ifdef ON_WINDOWS
   int i;
+  STATS_SYSCALL(1);
   if ((i = win_stat(file->d_name, &ws)) != 0) return i;
   if (file->inode != ws.inode) return 1;
   if (file->size != ws.size) return 1;
   if (file->device != ws.device) return 1;
-  if (file->mtime != ws.mtime) return 1;
-  if (file->mode != ws.mode) return 1;
+  if (check_mtime && file->mtime != ws.mtime) return 1;
+  if (listed ? !S_ISREG(ws.mode) : file->mode != ws.mode) return 1;
 #else
+  STATS_SYSCALL(1);
   if (stat(file->d_name, &s) != 0) return -2;
   if (file->inode != s.st_ino) return 1;
   if (file->size != s.st_size) return 1;
   if (file->device != s.st_dev) return 1;
-  if (file->mtime != s.st_mtime) return 1;
-  if (file->mode != s.st_mode) return 1;
+  if (check_mtime && file->mtime != s.st_mtime) return 1;
+  if (listed ? !S_ISREG(s.st_mode) : file->mode != s.st_mode) return 1;
  #ifndef NO_PERMS
-  if (file->uid != s.st_uid) return 1;
-  if (file->gid != s.st_gid) return 1;
+  if (!listed && file->uid != s.st_uid) return 1;
+  if (!listed && file->gid != s.st_gid) return 1;
  #endif
  #ifndef NO_SYMLINKS
+  STATS_SYSCALL(1);
   if (lstat(file->d_name, &s) != 0) return -3;
   if ((S_ISLNK(s.st_mode) > 0) ^ ISFLAG(file->flags, F_IS_SYMLINK)) return 1;
  #endif
@@ -432,6 +531,7 @@ extern inline int getfilestats(file_t * const restrict file)
   SETFLAG(file->flags, F_VALID_STAT);
 
 #ifdef ON_WINDOWS
+  STATS_SYSCALL(1);
   if (win_stat(file->d_name, &ws) != 0) return -1;
   file->inode = ws.inode;
   file->size = ws.size;
@@ -442,6 +542,7 @@ extern inline int getfilestats(file_t * const restrict file)
   file->nlink = ws.nlink;
  #endif
 #else
+  STATS_SYSCALL(1);
   if (stat(file->d_name, &s) != 0) return -1;
   file->inode = s.st_ino;
   file->size = s.st_size;
@@ -459,6 +560,7 @@ extern inline int getfilestats(file_t * const restrict file)
   file->birthtime = s.st_birthtime;
  #endif
  #ifndef NO_SYMLINKS
+  STATS_SYSCALL(1);
   if (lstat(file->d_name, &s) != 0) return -1;
   if (S_ISLNK(s.st_mode) > 0) SETFLAG(file->flags, F_IS_SYMLINK);
  #endif
@@ -467,12 +569,33 @@ extern inline int getfilestats(file_t * const restrict file)
 }
 
 
+/* Convert a number with an optional size suffix to a byte count
+ * Returns -1 if the number or the suffix is invalid */
+static int64_t strtosize(const char *p)
+{
+  const struct size_suffix *ss = size_suffix;
+  char *end;
+  int64_t size;
+
+  if (p == NULL) nullptr("strtosize()");
+  if (*p < '0' || *p > '9') return -1;
+  size = strtoll(p, &end, 10);
+  p = end;
+  /* Handle suffix, if any */
+  if (*p != '\0') {
+    while (ss->suffix != NULL && strcasecmp(ss->suffix, p) != 0) ss++;
+    if (ss->suffix == NULL) return -1;
+    size *= ss->multiplier;
+  }
+  return size;
+}
+
+
 static void add_exclude(const char *option)
 {
   char *opt, *p;
   struct exclude *excl = exclude_head;
   const struct exclude_tags *tags = exclude_tags;
-  const struct size_suffix *ss = size_suffix;
 
   if (option == NULL) nullptr("add_exclude()");
 
@@ -502,12 +625,12 @@ static void add_exclude(const char *option)
   if (exclude_head != NULL) {
     /* Add to end of exclusion stack if head is present */
     while (excl->next != NULL) excl = excl->next;
-    excl->next = string_malloc(sizeof(struct exclude) + strlen(p));
+    excl->next = string_malloc(sizeof(struct exclude) + strlen(p) + 1);
     if (excl->next == NULL) oom("add_exclude alloc");
     excl = excl->next;
   } else {
     /* Allocate exclude_head if no exclusions exist yet */
-    exclude_head = string_malloc(sizeof(struct exclude) + strlen(p));
+    exclude_head = string_malloc(sizeof(struct exclude) + strlen(p) + 1);
     if (exclude_head == NULL) oom("add_exclude alloc");
     excl = exclude_head;
   }
@@ -520,15 +643,8 @@ static void add_exclude(const char *option)
   if (excl->flags & XX_EXCL_OFFSET) {
     /* Exclude uses a number; handle it with possible suffixes */
     *(excl->param) = '\0';
-    /* Get base size */
-    if (*p < '0' || *p > '9') goto bad_size_suffix;
-    excl->size = strtoll(p, &p, 10);
-    /* Handle suffix, if any */
-    if (*p != '\0') {
-      while (ss->suffix != NULL && strcasecmp(ss->suffix, p) != 0) ss++;
-      if (ss->suffix == NULL) goto bad_size_suffix;
-      excl->size *= ss->multiplier;
-    }
+    excl->size = strtosize(p);
+    if (excl->size < 0) goto bad_size_suffix;
   } else {
     /* Exclude uses string data; just copy it */
     excl->size = 0;
@@ -559,12 +675,14 @@ extern int getdirstats(const char * const restrict name,
   LOUD(fprintf(stderr, "getdirstats('%s', %p, %p)\n", name, (void *)inode, (void *)dev);)
 
 #ifdef ON_WINDOWS
+  STATS_SYSCALL(1);
   if (win_stat(name, &ws) != 0) return -1;
   *inode = ws.inode;
   *dev = ws.device;
   *mode = ws.mode;
   if (!S_ISDIR(ws.mode)) return 1;
 #else
+  STATS_SYSCALL(1);
   if (stat(name, &s) != 0) return -1;
   *inode = s.st_ino;
   *dev = s.st_dev;
@@ -647,26 +765,14 @@ extern int check_conditions(const file_t * const restrict file1, const file_t *
 /* Check for exclusion conditions for a single file (1 = fail) */
 static int check_singlefile(file_t * const restrict newfile)
 {
-  char * restrict tp = tempname;
-  int excluded;
-
   if (newfile == NULL) nullptr("check_singlefile()");
 
   LOUD(fprintf(stderr, "check_singlefile: checking '%s'\n", newfile->d_name));
 
-  /* Exclude hidden files if requested */
-  if (ISFLAG(flags, F_EXCLUDEHIDDEN)) {
-    if (newfile->d_name == NULL) nullptr("check_singlefile newfile->d_name");
-    strcpy(tp, newfile->d_name);
-    tp = basename(tp);
-    if (tp[0] == '.' && strcmp(tp, ".") && strcmp(tp, "..")) {
-      LOUD(fprintf(stderr, "check_singlefile: excluding hidden file (-A on)\n"));
-      return 1;
-    }
-  }
-
   /* Get file information and check for validity */
+  stats_enter(PHASE_STAT);
   const int i = getfilestats(newfile);
+  stats_leave();
   if (i || newfile->size == -1) {
     LOUD(fprintf(stderr, "check_singlefile: excluding due to bad stat()\n"));
     return 1;
@@ -680,18 +786,7 @@ static int check_singlefile(file_t * const restrict newfile)
   }
 
     /* Exclude files based on exclusion stack size specs */
-    excluded = 0;
-    for (struct exclude *excl = exclude_head; excl != NULL; excl = excl->next) {
-      uint32_t sflag = excl->flags & XX_EXCL_SIZE;
-      if (
-           ((sflag == X_SIZE_EQ) && (newfile->size != excl->size)) ||
-           ((sflag == X_SIZE_LTEQ) && (newfile->size <= excl->size)) ||
-           ((sflag == X_SIZE_GTEQ) && (newfile->size >= excl->size)) ||
-           ((sflag == X_SIZE_GT) && (newfile->size > excl->size)) ||
-           ((sflag == X_SIZE_LT) && (newfile->size < excl->size))
-      ) excluded = 1;
-    }
-    if (excluded) {
+    if (exclude_size(newfile->size)) {
       LOUD(fprintf(stderr, "check_singlefile: excluding based on xsize limit (-x set)\n"));
       return 1;
     }
@@ -737,24 +832,196 @@ static file_t *init_newfile(const size_t len, file_t * restrict * const restrict
 }
 
 
-/* Create a new traversal check object and initialize its values */
-static struct travdone *travdone_alloc(const jdupes_ino_t inode, const dev_t device)
+/* Find the traversal set slot for an item (empty slot if not present)
+ * Inodes are often handed out in sequence, so the key is mixed well */
+static inline struct travdone *travdone_slot(const jdupes_ino_t inode, const dev_t device)
 {
-  struct travdone *trav;
+  uint64_t key = ((uint64_t)inode ^ ((uint64_t)device * 0x9e3779b97f4a7c15ULL)) * 0xbf58476d1ce4e5b9ULL;
+  size_t i = (size_t)(key ^ (key >> 31)) & (travdone_slots - 1);
 
-  LOUD(fprintf(stderr, "travdone_alloc(%" PRIdMAX ", %" PRIdMAX ")\n", (intmax_t)inode, (intmax_t)device);)
+  while (travdone[i].generation == travdone_generation
+      && (travdone[i].inode != inode || travdone[i].device != device))
+    i = (i + 1) & (travdone_slots - 1);
+  return &travdone[i];
+}
 
-  trav = (struct travdone *)string_malloc(sizeof(struct travdone));
-  if (trav == NULL) {
-    LOUD(fprintf(stderr, "travdone_alloc: malloc failed\n");)
-    return NULL;
+
+/* Record a traversed item; returns 1 if it was seen before */
+static int travdone_add(const jdupes_ino_t inode, const dev_t device)
+{
+  struct travdone *slot;
+
+  LOUD(fprintf(stderr, "travdone_add(%" PRIdMAX ", %" PRIdMAX ")\n", (intmax_t)inode, (intmax_t)device);)
+
+  /* Grow the table at 3/4 full */
+  if (travdone_used >= travdone_slots - (travdone_slots >> 2)) {
+    struct travdone * const old = travdone;
+    const size_t old_slots = travdone_slots;
+
+    travdone_slots = (old_slots == 0) ? TRAVDONE_MIN_SLOTS : old_slots << 1;
+    travdone = (struct travdone *)calloc(travdone_slots, sizeof(struct travdone));
+    if (travdone == NULL) oom("travdone_add()");
+    for (size_t i = 0; i < old_slots; i++) {
+      if (old[i].generation != travdone_generation) continue;
+      *travdone_slot(old[i].inode, old[i].device) = old[i];
+    }
+    free(old);
+  }
+
+  slot = travdone_slot(inode, device);
+  if (slot->generation == travdone_generation) return 1;
+  slot->inode = inode;
+  slot->device = device;
+  slot->generation = travdone_generation;
+  travdone_used++;
+  return 0;
+}
+
+
+/* Forget every traversed item without touching the table */
+static void travdone_clear(void)
+{
+  travdone_used = 0;
+  /* Slots left over from old generations only look empty until the
+   * counter wraps around; then they really have to be cleared */
+  if (++travdone_generation == 0) {
+    if (travdone != NULL) memset(travdone, 0, sizeof(struct travdone) * travdone_slots);
+    travdone_generation = 1;
+  }
+  return;
+}
+
+
+/* Find the histogram slot for a file size (empty slot if not present) */
+static inline uint64_t *sizehist_slot(const off_t size)
+{
+  const uint64_t key = (uint64_t)size + 1;
+  size_t i = (size_t)((key * 0x9e3779b97f4a7c15ULL) >> 32) & (sizehist_slots - 1);
+
+  while (sizehist[i] != 0 && (sizehist[i] & ~SIZEHIST_MULTI) != key)
+    i = (i + 1) & (sizehist_slots - 1);
+  return &sizehist[i];
+}
+
+
+/* Count a file size in the histogram */
+static void sizehist_add(const off_t size)
+{
+  uint64_t *slot;
+
+  /* Grow the table at 3/4 full */
+  if (sizehist_used >= sizehist_slots - (sizehist_slots >> 2)) {
+    uint64_t * const old = sizehist;
+    const size_t old_slots = sizehist_slots;
+
+    sizehist_slots = (old_slots == 0) ? SIZEHIST_MIN_SLOTS : old_slots << 1;
+    sizehist = (uint64_t *)calloc(sizehist_slots, sizeof(uint64_t));
+    if (sizehist == NULL) oom("sizehist_add()");
+    for (size_t i = 0; i < old_slots; i++) {
+      if (old[i] == 0) continue;
+      *sizehist_slot((off_t)((old[i] & ~SIZEHIST_MULTI) - 1)) = old[i];
+    }
+    free(old);
+  }
+
+  slot = sizehist_slot(size);
+  if (*slot == 0) {
+    *slot = (uint64_t)size + 1;
+    sizehist_used++;
+  } else *slot |= SIZEHIST_MULTI;
+  return;
+}
+
+
+/* Returns 1 if more than one file of this size was counted */
+static inline int sizehist_multiple(const off_t size)
+{
+  if (sizehist == NULL) return 0;
+  return (*sizehist_slot(size) & SIZEHIST_MULTI) ? 1 : 0;
+}
+
+
+/* Drop files with a size that no other file has; they can't match */
+static file_t *prune_unique_sizes(file_t *files)
+{
+  file_t *curfile, *next, *head = NULL, *tail = NULL;
+
+  for (curfile = files; curfile != NULL; curfile = next) {
+    next = curfile->next;
+    if (sizehist_multiple(curfile->size)) {
+      if (tail == NULL) head = curfile;
+      else tail->next = curfile;
+      tail = curfile;
+    } else {
+      string_free(curfile->d_name);
+      string_free(curfile);
+      filecount--;
+    }
+  }
+  if (tail != NULL) tail->next = NULL;
+  return head;
+}
+
+
+/* Add a scanned file to the file list (or only count its size on a size
+ * pre-pass); returns 1 if it isn't a file to check and was thrown away */
+static int add_scanned_file(file_t * const restrict newfile, file_t * restrict * const restrict filelistp)
+{
+  /* Add regular files to list, including symlink targets if requested */
+#ifndef NO_SYMLINKS
+  if (!ISFLAG(newfile->flags, F_IS_SYMLINK) || (ISFLAG(newfile->flags, F_IS_SYMLINK) && ISFLAG(flags, F_FOLLOWLINKS))) {
+#else
+  if (S_ISREG(newfile->mode)) {
+#endif
+    if (scan_pass == SCAN_SIZES) {
+      /* Size pre-pass: the size is the only thing to keep */
+      sizehist_add(newfile->size);
+      string_free(newfile->d_name);
+      string_free(newfile);
+      progress++;
+    } else if (size_prepass && !sizehist_multiple(newfile->size)) {
+      LOUD(fprintf(stderr, "add_scanned_file: unique size per pre-pass: %s\n", newfile->d_name));
+      string_free(newfile->d_name);
+      string_free(newfile);
+    } else {
+      *filelistp = newfile;
+      filecount++;
+      progress++;
+      if (!size_prepass) sizehist_add(newfile->size);
+
+      /* Move the scanned files out to disk if --max-memory is hit */
+      if (max_memory != 0) {
+        scan_memory += sizeof(file_t) + strlen(newfile->d_name) + 1;
+        if (scan_memory > max_memory) {
+          extsort_spill(*filelistp);
+          *filelistp = NULL;
+          scan_memory = 0;
+        }
+      }
+    }
+    return 0;
+  }
+
+  LOUD(fprintf(stderr, "add_scanned_file: not a regular file: %s\n", newfile->d_name);)
+  string_free(newfile->d_name);
+  string_free(newfile);
+  return 1;
+}
+
+
+/* Show how far scanning has got about once a second */
+static void scan_progress(void)
+{
+  if (!ISFLAG(flags, F_HIDEPROGRESS)) {
+    gettimeofday(&time2, NULL);
+    if (progress == 0 || time2.tv_sec > time1.tv_sec) {
+      fprintf(stderr, "\rScanning: %" PRIuMAX " files, %" PRIuMAX " dirs (in %u specified)",
+          progress, item_progress, user_item_count);
+    }
+    time1.tv_sec = time2.tv_sec;
   }
-  trav->left = NULL;
-  trav->right = NULL;
-  trav->inode = inode;
-  trav->device = device;
-  LOUD(fprintf(stderr, "travdone_alloc returned %p\n", (void *)trav);)
-  return trav;
+  update_status(0);
+  return;
 }
 
 
@@ -766,6 +1033,11 @@ static inline file_t *grokfile(const char * const restrict name, file_t * restri
   if (!name || !filelistp) nullptr("grokfile()");
   LOUD(fprintf(stderr, "grokfile: '%s' %p\n", name, filelistp));
 
+  if (exclude_match(name) & EXCL_FILE) {
+    LOUD(fprintf(stderr, "grokfile: excluded by name\n"));
+    return NULL;
+  }
+
   /* Allocate the file_t and the d_name entries */
   newfile = init_newfile(strlen(name) + 2, filelistp);
 
@@ -791,8 +1063,7 @@ static void grokdir(const char * const restrict dir,
   struct dirent *dirinfo;
   static int grokdir_level = 0;
   size_t dirlen;
-  struct travdone *traverse;
-  int i, single = 0;
+  int i;
   jdupes_ino_t inode, n_inode;
   dev_t device, n_device;
   jdupes_mode_t mode;
@@ -807,43 +1078,16 @@ static void grokdir(const char * const restrict dir,
   if (dir == NULL || filelistp == NULL) nullptr("grokdir()");
   LOUD(fprintf(stderr, "grokdir: scanning '%s' (order %d, recurse %d)\n", dir, user_item_count, recurse));
 
-  /* Double traversal prevention tree */
+  /* Double traversal prevention set */
+  stats_enter(PHASE_STAT);
   i = getdirstats(dir, &inode, &device, &mode);
+  stats_leave();
   if (i < 0) goto error_travdone;
 
-  if (travdone_head == NULL) {
-    travdone_head = travdone_alloc(inode, device);
-    if (travdone_head == NULL) goto error_travdone;
-  } else {
-    traverse = travdone_head;
-    while (1) {
-      if (traverse == NULL) nullptr("grokdir() traverse");
-      /* Don't re-traverse directories we've already seen */
-      if (S_ISDIR(mode) && inode == traverse->inode && device == traverse->device) {
-        LOUD(fprintf(stderr, "already seen item '%s', skipping\n", dir);)
-        return;
-      } else if (inode > traverse->inode || (inode == traverse->inode && device > traverse->device)) {
-        /* Traverse right */
-        if (traverse->right == NULL) {
-          LOUD(fprintf(stderr, "traverse item right '%s'\n", dir);)
-          traverse->right = travdone_alloc(inode, device);
-          if (traverse->right == NULL) goto error_travdone;
-          break;
-        }
-        traverse = traverse->right;
-        continue;
-      } else {
-        /* Traverse left */
-        if (traverse->left == NULL) {
-          LOUD(fprintf(stderr, "traverse item left '%s'\n", dir);)
-          traverse->left = travdone_alloc(inode, device);
-          if (traverse->left == NULL) goto error_travdone;
-          break;
-        }
-        traverse = traverse->left;
-        continue;
-      }
-    }
+  /* Don't re-traverse directories we've already seen */
+  if (travdone_add(inode, device) && S_ISDIR(mode)) {
+    LOUD(fprintf(stderr, "already seen item '%s', skipping\n", dir);)
+    return;
   }
 
   item_progress++;
@@ -856,8 +1100,8 @@ static void grokdir(const char * const restrict dir,
       LOUD(fprintf(stderr, "grokfile rejected '%s'\n", dir));
       return;
     }
-    single = 1;
-    goto add_single_file;
+    add_scanned_file(newfile, filelistp);
+    goto skip_single;
   }
 
 #ifdef UNICODE
@@ -882,6 +1126,7 @@ static void grokdir(const char * const restrict dir,
     dirinfo = (struct dirent *)string_malloc(sizeof(struct dirent));
     if (!W2M(ffd.cFileName, dirinfo->d_name)) continue;
 #else
+  STATS_SYSCALL(1);
   cd = opendir(dir);
   if (!cd) goto error_cd;
 
@@ -889,17 +1134,11 @@ static void grokdir(const char * const restrict dir,
     char * restrict tp = tempname;
     size_t d_name_len;
 #endif /* UNICODE */
+    unsigned int excluded, type;
 
     LOUD(fprintf(stderr, "grokdir: readdir: '%s'\n", dirinfo->d_name));
     if (!strcmp(dirinfo->d_name, ".") || !strcmp(dirinfo->d_name, "..")) continue;
-    if (!ISFLAG(flags, F_HIDEPROGRESS)) {
-      gettimeofday(&time2, NULL);
-      if (progress == 0 || time2.tv_sec > time1.tv_sec) {
-        fprintf(stderr, "\rScanning: %" PRIuMAX " files, %" PRIuMAX " dirs (in %u specified)",
-            progress, item_progress, user_item_count);
-      }
-      time1.tv_sec = time2.tv_sec;
-    }
+    scan_progress();
 
     /* Assemble the file's full path name, optimized to avoid strcat() */
     dirlen = strlen(dir);
@@ -916,16 +1155,34 @@ static void grokdir(const char * const restrict dir,
     *tp = '\0';
     d_name_len++;
 
+    /* Name exclusions are checked before the stat(); if the directory
+     * entry says what type it is, that's enough to skip it right away */
+    excluded = exclude_match(tempname);
+    if (excluded != 0) {
+#ifdef UNICODE
+      if (ffd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) type = 0;
+      else type = (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ? EXCL_DIR : EXCL_FILE;
+#elif defined DT_DIR
+      if (dirinfo->d_type == DT_DIR) type = EXCL_DIR;
+      else type = (dirinfo->d_type == DT_REG) ? EXCL_FILE : 0;
+#else
+      type = 0;
+#endif
+      if (excluded == (EXCL_FILE | EXCL_DIR) || (excluded & type)) {
+        LOUD(fprintf(stderr, "grokdir: excluded by name: '%s'\n", tempname));
+        continue;
+      }
+    }
+
     /* Allocate the file_t and the d_name entries */
     newfile = init_newfile(dirlen + d_name_len + 2, filelistp);
 
     tp = tempname;
     memcpy(newfile->d_name, tp, dirlen + d_name_len);
 
-    /*** WARNING: tempname global gets reused by check_singlefile here! ***/
-
     /* Single-file [l]stat() and exclusion condition check */
-    if (check_singlefile(newfile) != 0) {
+    if (check_singlefile(newfile) != 0
+        || (excluded & (S_ISDIR(newfile->mode) ? EXCL_DIR : EXCL_FILE))) {
       LOUD(fprintf(stderr, "grokdir: check_singlefile rejected file\n"));
       string_free(newfile->d_name);
       string_free(newfile);
@@ -936,9 +1193,12 @@ static void grokdir(const char * const restrict dir,
     if (S_ISDIR(newfile->mode)) {
       if (recurse) {
         /* --one-file-system */
-        if (ISFLAG(flags, F_ONEFS)
-            && (getdirstats(newfile->d_name, &n_inode, &n_device, &mode) == 0)
-            && (device != n_device)) {
+        if (ISFLAG(flags, F_ONEFS)) {
+          stats_enter(PHASE_STAT);
+          i = getdirstats(newfile->d_name, &n_inode, &n_device, &mode);
+          stats_leave();
+        }
+        if (ISFLAG(flags, F_ONEFS) && i == 0 && device != n_device) {
           LOUD(fprintf(stderr, "grokdir: directory: not recursing (--one-file-system)\n"));
           string_free(newfile->d_name);
           string_free(newfile);
@@ -959,40 +1219,15 @@ static void grokdir(const char * const restrict dir,
       string_free(newfile->d_name);
       string_free(newfile);
       continue;
-    } else {
-add_single_file:
-      /* Add regular files to list, including symlink targets if requested */
-#ifndef NO_SYMLINKS
-      if (!ISFLAG(newfile->flags, F_IS_SYMLINK) || (ISFLAG(newfile->flags, F_IS_SYMLINK) && ISFLAG(flags, F_FOLLOWLINKS))) {
-#else
-      if (S_ISREG(newfile->mode)) {
-#endif
-        *filelistp = newfile;
-        filecount++;
-        progress++;
-
-      } else {
-        LOUD(fprintf(stderr, "grokdir: not a regular file: %s\n", newfile->d_name);)
-        string_free(newfile->d_name);
-        string_free(newfile);
-        if (single == 1) {
-          single = 0;
-          goto skip_single;
-        }
-        continue;
-      }
-    }
-    /* Skip directory stuff if adding only a single file */
-    if (single == 1) {
-      single = 0;
-      goto skip_single;
     }
+    add_scanned_file(newfile, filelistp);
   }
 
 #ifdef UNICODE
   while (FindNextFileW(hFind, &ffd) != 0);
   FindClose(hFind);
 #else
+  STATS_SYSCALL(1);
   closedir(cd);
 #endif
 
@@ -1016,31 +1251,82 @@ error_overflow:
 }
 
 
-/* Use Jody Bruchon's hash function on part or all of a file */
-static jdupes_hash_t *get_filehash(const file_t * const restrict checkfile,
-                const size_t max_read)
+/* Load the files named in a --files-from list into the file tree */
+static void grokfilelist(const char * const restrict name,
+                file_t * restrict * const restrict filelistp)
+{
+  struct filelist_entry entry;
+  file_t * restrict newfile;
+
+  if (name == NULL || filelistp == NULL) nullptr("grokfilelist()");
+  LOUD(fprintf(stderr, "grokfilelist: reading '%s' (order %d)\n", name, user_item_count));
+
+  if (filelist_open(name) != 0) {
+    fprintf(stderr, "\ncould not open file list '%s': %s\n", name, strerror(errno));
+    string_malloc_destroy();
+    exit(EXIT_FAILURE);
+  }
+  item_progress++;
+
+  while (filelist_next(&entry)) {
+    const size_t len = strlen(entry.path);
+
+    scan_progress();
+    slash_convert(entry.path);
+    /* Directories in the list are skipped anyway */
+    if (exclude_match(entry.path) & EXCL_FILE) {
+      LOUD(fprintf(stderr, "grokfilelist: excluded by name: '%s'\n", entry.path));
+      continue;
+    }
+    newfile = init_newfile(len + 1, filelistp);
+    memcpy(newfile->d_name, entry.path, len + 1);
+
+    /* Take the file info from the list instead of stat()ing the file */
+    if (filelist_columns != 0) {
+      newfile->size = (off_t)entry.size;
+      newfile->inode = (jdupes_ino_t)entry.inode;
+      newfile->device = (dev_t)entry.device;
+      newfile->mtime = (time_t)entry.mtime;
+      newfile->mode = S_IFREG;
+      SETFLAG(newfile->flags, F_VALID_STAT | F_LISTED_STAT);
+    }
+
+    if (check_singlefile(newfile) != 0 || S_ISDIR(newfile->mode)) {
+      LOUD(fprintf(stderr, "grokfilelist: rejected '%s'\n", newfile->d_name));
+      string_free(newfile->d_name);
+      string_free(newfile);
+      continue;
+    }
+    add_scanned_file(newfile, filelistp);
+  }
+  filelist_close();
+
+  if (!ISFLAG(flags, F_HIDEPROGRESS)) {
+    fprintf(stderr, "\rScanning: %" PRIuMAX " files, %" PRIuMAX " items (in %u specified)",
+            progress, item_progress, user_item_count);
+  }
+  return;
+}
+
+
+/* Hash part or all of a file into *hash, growing the caller's read buffer
+ * as needed. With a worker (w != NULL) this runs on an I/O queue thread,
+ * so nothing shared is touched and errors are left for the main thread
+ * to report when it tries the file again. Returns 0 on success. */
+static int hash_file(const file_t * const restrict checkfile, const size_t max_read,
+                jdupes_hash_t * const restrict hash, void ** const restrict bufp,
+                size_t * const restrict buf_size, struct ioq_worker * const restrict w)
 {
   off_t fsize;
-  /* This is an array because we return a pointer to it */
-  static jdupes_hash_t hash[1];
-  static jdupes_hash_t *chunk = NULL;
+  size_t csize;
   FILE *file;
   int check = 0;
   XXH64_state_t *xxhstate;
 
-  if (checkfile == NULL || checkfile->d_name == NULL) nullptr("get_filehash()");
-  LOUD(fprintf(stderr, "get_filehash('%s', %" PRIdMAX ")\n", checkfile->d_name, (intmax_t)max_read);)
-
-  /* Allocate on first use */
-  if (chunk == NULL) {
-    chunk = (jdupes_hash_t *)string_malloc(auto_chunk_size);
-    if (!chunk) oom("get_filehash() chunk");
-  }
-
   /* Get the file size. If we can't read it, bail out early */
   if (checkfile->size == -1) {
     LOUD(fprintf(stderr, "get_filehash: not hashing because stat() info is bad\n"));
-    return NULL;
+    return -1;
   }
   fsize = checkfile->size;
 
@@ -1061,9 +1347,24 @@ static jdupes_hash_t *get_filehash(const file_t * const restrict checkfile,
     /* Don't bother going further if max_read is already fulfilled */
     if (max_read != 0 && max_read <= PARTIAL_HASH_SIZE) {
       LOUD(fprintf(stderr, "Partial hash size (%d) >= max_read (%" PRIuMAX "), not hashing anymore\n", PARTIAL_HASH_SIZE, (uintmax_t)max_read);)
-      return hash;
+      return 0;
+    }
+  }
+
+  /* Grow the buffer when the device wants bigger reads */
+  csize = chunk_size(checkfile->device);
+  if (csize > *buf_size) {
+    if (w != NULL) {
+      free(*bufp);
+      *bufp = malloc(csize);
+    } else {
+      string_free(*bufp);
+      *bufp = string_malloc(csize);
     }
+    if (*bufp == NULL) oom("get_filehash() chunk");
+    *buf_size = csize;
   }
+
   errno = 0;
 #ifdef UNICODE
   if (!M2W(checkfile->d_name, wstr)) file = NULL;
@@ -1071,42 +1372,72 @@ static jdupes_hash_t *get_filehash(const file_t * const restrict checkfile,
 #else
   file = fopen(checkfile->d_name, FILE_MODE_RO);
 #endif
+  IOQ_SYSCALL(w, 1);
   if (file == NULL) {
-    fprintf(stderr, "\n%s error opening file ", strerror(errno)); fwprint(stderr, checkfile->d_name, 1);
-    return NULL;
+    if (w == NULL) {
+      fprintf(stderr, "\n%s error opening file ", strerror(errno)); fwprint(stderr, checkfile->d_name, 1);
+    }
+    return -1;
   }
+  IOQ_OPEN(w);
   /* Actually seek past the first chunk if applicable
    * This is part of the filehash_partial skip optimization */
   if (ISFLAG(checkfile->flags, F_HASH_PARTIAL)) {
+    IOQ_SYSCALL(w, 1);
     if (fseeko(file, PARTIAL_HASH_SIZE, SEEK_SET) == -1) {
       fclose(file);
-      fprintf(stderr, "\nerror seeking in file "); fwprint(stderr, checkfile->d_name, 1);
-      return NULL;
+      if (w == NULL) {
+        fprintf(stderr, "\nerror seeking in file "); fwprint(stderr, checkfile->d_name, 1);
+      }
+      return -1;
     }
     fsize -= PARTIAL_HASH_SIZE;
   }
+#ifdef POSIX_FADV_SEQUENTIAL
+  /* Reading more than one chunk; let the kernel read further ahead */
+  if (fsize > (off_t)csize) {
+    posix_fadvise(fileno(file), 0, 0, POSIX_FADV_SEQUENTIAL);
+    IOQ_SYSCALL(w, 1);
+  }
+#endif
 
   xxhstate = XXH64_createState();
   if (xxhstate == NULL) nullptr("xxhstate");
   XXH64_reset(xxhstate, 0);
 
-  /* Read the file in CHUNK_SIZE chunks until we've read it all. */
+  /* Read the file in csize chunks until we've read it all. */
   while (fsize > 0) {
     size_t bytes_to_read;
+    uint64_t read_start = 0;
 
-    if (interrupt) return 0;
-    bytes_to_read = (fsize >= (off_t)auto_chunk_size) ? auto_chunk_size : (size_t)fsize;
-    if (fread((void *)chunk, bytes_to_read, 1, file) != 1) {
-      fprintf(stderr, "\nerror reading from file "); fwprint(stderr, checkfile->d_name, 1);
+    if (interrupt) {
       fclose(file);
-      return NULL;
+      XXH64_freeState(xxhstate);
+      return -1;
+    }
+    bytes_to_read = (fsize >= (off_t)csize) ? csize : (size_t)fsize;
+    throttle_wait(bytes_to_read);
+    if (chunk_tuning) read_start = stats_clock();
+    IOQ_SYSCALL(w, 1);
+    if (fread(*bufp, bytes_to_read, 1, file) != 1) {
+      if (w == NULL) {
+        fprintf(stderr, "\nerror reading from file "); fwprint(stderr, checkfile->d_name, 1);
+      }
+      fclose(file);
+      XXH64_freeState(xxhstate);
+      return -1;
     }
+    IOQ_BYTES(w, bytes_to_read);
+    if (chunk_tuning) chunk_sample(checkfile->device, bytes_to_read, stats_clock() - read_start);
 
-    XXH64_update(xxhstate, chunk, bytes_to_read);
+    XXH64_update(xxhstate, *bufp, bytes_to_read);
+    /* --blocks chunks the file data as it goes by */
+    if (w == NULL && blocks_avg != 0) blocks_feed(*bufp, bytes_to_read);
 
     if ((off_t)bytes_to_read > fsize) break;
     else fsize -= (off_t)bytes_to_read;
 
+    if (w != NULL) continue;
     if (!ISFLAG(flags, F_HIDEPROGRESS)) {
       check++;
       if (check > CHECK_MINIMUM) {
@@ -1114,12 +1445,31 @@ static jdupes_hash_t *get_filehash(const file_t * const restrict checkfile,
         check = 0;
       }
     }
+    update_status(filecount);
   }
 
+  IOQ_SYSCALL(w, 1);
   fclose(file);
 
   *hash = XXH64_digest(xxhstate);
   XXH64_freeState(xxhstate);
+  return 0;
+}
+
+
+/* Use Jody Bruchon's hash function on part or all of a file */
+static jdupes_hash_t *get_filehash(const file_t * const restrict checkfile,
+                const size_t max_read)
+{
+  /* This is an array because we return a pointer to it */
+  static jdupes_hash_t hash[1];
+  static void *chunk = NULL;
+  static size_t chunk_alloc = 0;
+
+  if (checkfile == NULL || checkfile->d_name == NULL) nullptr("get_filehash()");
+  LOUD(fprintf(stderr, "get_filehash('%s', %" PRIdMAX ")\n", checkfile->d_name, (intmax_t)max_read);)
+
+  if (hash_file(checkfile, max_read, hash, &chunk, &chunk_alloc, NULL) != 0) return NULL;
 
   LOUD(fprintf(stderr, "get_filehash: returning hash: 0x%016jx\n", (uintmax_t)*hash));
   return hash;
@@ -1207,22 +1557,32 @@ static file_t **checkmatch(filetree_t * restrict tree, file_t * const restrict f
   /* If preliminary matching succeeded, do main file data checks */
   if (cmpresult == 0) {
     LOUD(fprintf(stderr, "checkmatch: starting file data comparisons\n"));
+    if (hashcache_mode != 0) {
+      hashcache_load(tree->file);
+      hashcache_load(file);
+    }
     /* Attempt to exclude files quickly with partial file hashing */
     if (!ISFLAG(tree->file->flags, F_HASH_PARTIAL)) {
+      STATS_CACHE(partial_misses);
+      stats_enter(PHASE_PARTIAL);
       filehash = get_filehash(tree->file, PARTIAL_HASH_SIZE);
+      stats_leave();
       if (filehash == NULL) return NULL;
 
       tree->file->filehash_partial = *filehash;
       SETFLAG(tree->file->flags, F_HASH_PARTIAL);
-    }
+    } else STATS_CACHE(partial_hits);
 
     if (!ISFLAG(file->flags, F_HASH_PARTIAL)) {
+      STATS_CACHE(partial_misses);
+      stats_enter(PHASE_PARTIAL);
       filehash = get_filehash(file, PARTIAL_HASH_SIZE);
+      stats_leave();
       if (filehash == NULL) return NULL;
 
       file->filehash_partial = *filehash;
       SETFLAG(file->flags, F_HASH_PARTIAL);
-    }
+    } else STATS_CACHE(partial_hits);
 
     cmpresult = HASH_COMPARE(file->filehash_partial, tree->file->filehash_partial);
     LOUD(if (!cmpresult) fprintf(stderr, "checkmatch: partial hashes match\n"));
@@ -1250,20 +1610,26 @@ static file_t **checkmatch(filetree_t * restrict tree, file_t * const restrict f
     } else if (cmpresult == 0) {
       /* If partial match was correct, perform a full file hash match */
       if (!ISFLAG(tree->file->flags, F_HASH_FULL)) {
+        STATS_CACHE(full_misses);
+        stats_enter(PHASE_FULL);
         filehash = get_filehash(tree->file, 0);
+        stats_leave();
         if (filehash == NULL) return NULL;
 
         tree->file->filehash = *filehash;
         SETFLAG(tree->file->flags, F_HASH_FULL);
-      }
+      } else STATS_CACHE(full_hits);
 
       if (!ISFLAG(file->flags, F_HASH_FULL)) {
+        STATS_CACHE(full_misses);
+        stats_enter(PHASE_FULL);
         filehash = get_filehash(file, 0);
+        stats_leave();
         if (filehash == NULL) return NULL;
 
         file->filehash = *filehash;
         SETFLAG(file->flags, F_HASH_FULL);
-      }
+      } else STATS_CACHE(full_hits);
 
       /* Full file hash comparison */
       cmpresult = HASH_COMPARE(file->filehash, tree->file->filehash);
@@ -1311,43 +1677,67 @@ static file_t **checkmatch(filetree_t * restrict tree, file_t * const restrict f
 
 
 /* Do a byte-by-byte comparison in case two different files produce the
-   same signature. Unlikely, but better safe than sorry. */
-static inline int confirmmatch(FILE * const restrict file1, FILE * const restrict file2, const off_t size)
+   same signature. Unlikely, but better safe than sorry. c1 and c2 hold
+   c_max bytes each and belong to the calling thread; with a worker
+   (w != NULL) this runs on an I/O queue thread and touches nothing shared. */
+static int confirmmatch(FILE * const restrict file1, FILE * const restrict file2,
+                const off_t size, const dev_t dev1, const dev_t dev2,
+                char * const restrict c1, char * const restrict c2, const size_t c_max,
+                struct ioq_worker * const restrict w)
 {
-  static char *c1 = NULL, *c2 = NULL;
-  size_t r1, r2;
+  size_t r1, r2, csize;
   off_t bytes = 0;
   int check = 0;
 
-  if (file1 == NULL || file2 == NULL) nullptr("confirmmatch()");
+  if (file1 == NULL || file2 == NULL || c1 == NULL || c2 == NULL) nullptr("confirmmatch()");
   LOUD(fprintf(stderr, "confirmmatch running\n"));
 
-  /* Allocate on first use; OOM if either is ever NULLed */
-  if (!c1) {
-    c1 = (char *)string_malloc(auto_chunk_size);
-    c2 = (char *)string_malloc(auto_chunk_size);
-  }
-  if (!c1 || !c2) oom("confirmmatch() c1/c2");
+  /* Both files are read in step, so use the larger of the two sizes */
+  csize = chunk_size(dev1);
+  if (chunk_size(dev2) > csize) csize = chunk_size(dev2);
+  if (csize > c_max) csize = c_max;
 
   fseek(file1, 0, SEEK_SET);
   fseek(file2, 0, SEEK_SET);
+  IOQ_SYSCALL(w, 2);
 
   do {
     if (interrupt) return 0;
-    r1 = fread(c1, sizeof(char), auto_chunk_size, file1);
-    r2 = fread(c2, sizeof(char), auto_chunk_size, file2);
+    if (throttle_enabled) {
+      /* Only ask for what is left so small files aren't overcharged */
+      const size_t want = (size - bytes > (off_t)csize) ? csize : (size_t)(size - bytes);
+
+      throttle_wait(want);
+      throttle_wait(want);
+    }
+    if (chunk_tuning) {
+      uint64_t read_start = stats_clock();
+
+      r1 = fread(c1, sizeof(char), csize, file1);
+      chunk_sample(dev1, r1, stats_clock() - read_start);
+      read_start = stats_clock();
+      r2 = fread(c2, sizeof(char), csize, file2);
+      chunk_sample(dev2, r2, stats_clock() - read_start);
+    } else {
+      r1 = fread(c1, sizeof(char), csize, file1);
+      r2 = fread(c2, sizeof(char), csize, file2);
+    }
+    IOQ_SYSCALL(w, 2);
+    IOQ_BYTES(w, r1 + r2);
 
     if (r1 != r2) return 0; /* file lengths are different */
     if (memcmp (c1, c2, r1)) return 0; /* file contents are different */
+    bytes += (off_t)r1;
 
+    if (w != NULL) continue;
     if (!ISFLAG(flags, F_HIDEPROGRESS)) {
       check++;
-      bytes += (off_t)r1;
       if (check > CHECK_MINIMUM) {
         update_progress("confirm", (int)((bytes * 100) / size));
         check = 0;
       }
     }
+    update_status(filecount);
   } while (r2);
 
   return 1;
@@ -1383,111 +1773,812 @@ extern unsigned int get_max_dupes(const file_t *files, unsigned int * const rest
 }
 
 
-#ifndef NO_USER_ORDER
-static int sort_pairs_by_param_order(file_t *f1, file_t *f2)
-{
-  if (!ISFLAG(flags, F_USEPARAMORDER)) return 0;
-  if (f1 == NULL || f2 == NULL) nullptr("sort_pairs_by_param_order()");
-  if (f1->user_order < f2->user_order) return -sort_direction;
-  if (f1->user_order > f2->user_order) return sort_direction;
-  return 0;
-}
-#endif
+/* Duplicate sets are put in order by sort keys: byte strings that sort
+ * with memcmp() in the -o order, so each name is parsed once per sort
+ * instead of once per comparison. -O puts the parameter order first. */
+#define SORT_KEY_MAX(file) (12 + NUMERIC_SORT_KEY_MAX(strlen((file)->d_name)))
+
+struct sort_entry {
+  file_t *file;
+  size_t len;
+  unsigned char key[];
+};
 
 
-static int sort_pairs_by_mtime(file_t *f1, file_t *f2)
+/* Write a file's sort key to key; returns the key length */
+static size_t make_sort_key(const file_t * const restrict file, unsigned char * const restrict key)
 {
-  if (f1 == NULL || f2 == NULL) nullptr("sort_pairs_by_mtime()");
+  size_t len = 0;
 
 #ifndef NO_USER_ORDER
-  int po = sort_pairs_by_param_order(f1, f2);
-  if (po != 0) return po;
+  if (ISFLAG(flags, F_USEPARAMORDER)) {
+    for (int i = 24; i >= 0; i -= 8) key[len++] = (unsigned char)(file->user_order >> i);
+  }
 #endif /* NO_USER_ORDER */
 
-  if (f1->mtime < f2->mtime) return -sort_direction;
-  else if (f1->mtime > f2->mtime) return sort_direction;
+  if (ordertype == ORDER_TIME) {
+    /* Flipping the sign bit makes signed times sort as unsigned bytes */
+    const uint64_t t = (uint64_t)(int64_t)file->mtime ^ ((uint64_t)1 << 63);
 
-  return 0;
+    for (int i = 56; i >= 0; i -= 8) key[len++] = (unsigned char)(t >> i);
+    return len;
+  }
+  return len + numeric_sort_key(file->d_name, key + len);
 }
 
 
-static int sort_pairs_by_filename(file_t *f1, file_t *f2)
+static int compare_sort_keys(const unsigned char * const restrict k1, const size_t len1,
+                const unsigned char * const restrict k2, const size_t len2)
 {
-  if (f1 == NULL || f2 == NULL) nullptr("sort_pairs_by_filename()");
+  int cmp = memcmp(k1, k2, (len1 < len2) ? len1 : len2);
+
+  if (cmp == 0) cmp = (len1 > len2) - (len1 < len2);
+  else cmp = (cmp > 0) ? 1 : -1;
+  return cmp * sort_direction;
+}
 
-#ifndef NO_USER_ORDER
-  int po = sort_pairs_by_param_order(f1, f2);
-  if (po != 0) return po;
-#endif /* NO_USER_ORDER */
 
-  return numeric_sort(f1->d_name, f2->d_name, sort_direction);
+/* Compare two files in sort order without keeping their keys */
+static int compare_files(const file_t * const restrict f1, const file_t * const restrict f2)
+{
+  static unsigned char *k1 = NULL, *k2 = NULL;
+  static size_t k1_alloc = 0, k2_alloc = 0;
+  size_t len1, len2;
+
+  if (f1 == NULL || f2 == NULL) nullptr("compare_files()");
+  if (SORT_KEY_MAX(f1) > k1_alloc) {
+    k1_alloc = SORT_KEY_MAX(f1);
+    free(k1);
+    k1 = (unsigned char *)malloc(k1_alloc);
+  }
+  if (SORT_KEY_MAX(f2) > k2_alloc) {
+    k2_alloc = SORT_KEY_MAX(f2);
+    free(k2);
+    k2 = (unsigned char *)malloc(k2_alloc);
+  }
+  if (k1 == NULL || k2 == NULL) oom("compare_files()");
+
+  len1 = make_sort_key(f1, k1);
+  len2 = make_sort_key(f2, k2);
+  return compare_sort_keys(k1, len1, k2, len2);
 }
 
 
-static void registerpair(file_t **matchlist, file_t *newmatch,
-                int (*comparef)(file_t *f1, file_t *f2))
+/* Add a confirmed match to a duplicate set. The first file of a set
+ * stands in for the whole set while matching, so it has to be the one
+ * that sorts first; the rest are put in order by sort_dupe_chains()
+ * once the whole size group has been matched. */
+static void registerpair(file_t **matchlist, file_t *newmatch)
 {
-  file_t *traverse;
-  file_t *back;
+  file_t *head;
 
   /* NULL pointer sanity checks */
-  if (matchlist == NULL || newmatch == NULL || comparef == NULL) nullptr("registerpair()");
+  if (matchlist == NULL || newmatch == NULL) nullptr("registerpair()");
   LOUD(fprintf(stderr, "registerpair: '%s', '%s'\n", (*matchlist)->d_name, newmatch->d_name);)
 
-  SETFLAG((*matchlist)->flags, F_HAS_DUPES);
-  back = NULL;
-  traverse = *matchlist;
+  head = *matchlist;
+  if (compare_files(newmatch, head) <= 0) {
+    newmatch->duplicates = head;
+    *matchlist = newmatch; /* update pointer to head of list */
+    SETFLAG(newmatch->flags, F_HAS_DUPES);
+    CLEARFLAG(head->flags, F_HAS_DUPES); /* flag is only for first file in dupe chain */
+  } else {
+    newmatch->duplicates = head->duplicates;
+    head->duplicates = newmatch;
+    SETFLAG(head->flags, F_HAS_DUPES);
+  }
+  return;
+}
+
 
-  /* FIXME: This needs to be changed! As it currently stands, the compare
-   * function only runs on a pair as it is registered and future pairs can
-   * mess up the sort order. A separate sorting function should happen before
-   * the dupe chain is acted upon rather than while pairs are registered. */
-  while (traverse) {
-    if (comparef(newmatch, traverse) <= 0) {
-      newmatch->duplicates = traverse;
+/* pointer_mergesort() helper for sort_dupe_chains() */
+static int sort_entries_by_key(const void *e1, const void *e2)
+{
+  const struct sort_entry * const s1 = (const struct sort_entry *)e1;
+  const struct sort_entry * const s2 = (const struct sort_entry *)e2;
 
-      if (!back) {
-        *matchlist = newmatch; /* update pointer to head of list */
-        SETFLAG(newmatch->flags, F_HAS_DUPES);
-        CLEARFLAG(traverse->flags, F_HAS_DUPES); /* flag is only for first file in dupe chain */
-      } else back->duplicates = newmatch;
+  return compare_sort_keys(s1->key, s1->len, s2->key, s2->len);
+}
 
-      break;
-    } else {
-      if (traverse->duplicates == 0) {
-        traverse->duplicates = newmatch;
-        if (!back) SETFLAG(traverse->flags, F_HAS_DUPES);
 
-        break;
-      }
+/* Put every duplicate set in a matched size group in order. The first
+ * file of each set is already where it belongs, so only the rest move. */
+static void sort_dupe_chains(file_t ** const restrict group, const size_t count)
+{
+  struct sort_entry **chain = NULL;
+  char *keys = NULL;
+  size_t keys_alloc = 0, keys_size, n, i;
+  file_t *curfile;
+
+  for (size_t g = 0; g < count; g++) {
+    if (!ISFLAG(group[g]->flags, F_HAS_DUPES)) continue;
+    if (group[g]->duplicates->duplicates == NULL) continue;
+    if (chain == NULL) {
+      chain = (struct sort_entry **)malloc(sizeof(struct sort_entry *) * count);
+      if (chain == NULL) oom("sort_dupe_chains()");
+    }
+
+    /* All of a set's keys go in one block, each entry kept aligned */
+    keys_size = 0;
+    for (curfile = group[g]->duplicates; curfile != NULL; curfile = curfile->duplicates)
+      keys_size += (sizeof(struct sort_entry) + SORT_KEY_MAX(curfile) + 7) & ~(size_t)7;
+    if (keys_size > keys_alloc) {
+      free(keys);
+      keys_alloc = keys_size;
+      keys = (char *)malloc(keys_alloc);
+      if (keys == NULL) oom("sort_dupe_chains() keys");
+    }
+
+    n = 0;
+    keys_size = 0;
+    for (curfile = group[g]->duplicates; curfile != NULL; curfile = curfile->duplicates) {
+      struct sort_entry * const e = (struct sort_entry *)(void *)(keys + keys_size);
+
+      keys_size += (sizeof(struct sort_entry) + SORT_KEY_MAX(curfile) + 7) & ~(size_t)7;
+      e->file = curfile;
+      e->len = make_sort_key(curfile, e->key);
+      chain[n++] = e;
     }
+    if (pointer_mergesort((void **)chain, n, sort_entries_by_key) != 0) oom("sort_dupe_chains() sort");
 
-    back = traverse;
-    traverse = traverse->duplicates;
+    group[g]->duplicates = chain[0]->file;
+    for (i = 0; i + 1 < n; i++) chain[i]->file->duplicates = chain[i + 1]->file;
+    chain[n - 1]->file->duplicates = NULL;
   }
+  free(keys);
+  free(chain);
   return;
 }
 
 
-static inline void help_text(void)
+/* Free a match tree without recursion by rotating left branches up */
+static void free_filetree(filetree_t *tree)
 {
-  printf("Usage: jdupes [options] FILES and/or DIRECTORIES...\n\n");
+  filetree_t *next;
 
-  printf("Duplicate file sets will be printed by default unless a different action\n");
-  printf("option is specified (delete, summarize, link, dedupe, etc.)\n");
-#ifdef LOUD
-  printf(" -@ --loud        \toutput annoying low-level debug info while running\n");
-#endif
-  printf(" -0 --printnull   \toutput nulls instead of CR/LF (like 'find -print0')\n");
-  printf(" -1 --one-file-system \tdo not match files on different filesystems/devices\n");
-  printf(" -A --nohidden    \texclude hidden files from consideration\n");
-#ifdef ENABLE_BTRFS
-  printf(" -B --dedupe      \tsend matches to btrfs for block-level deduplication\n");
-#endif
-#ifdef ENABLE_APFS
+  while (tree != NULL) {
+    if (tree->left != NULL) {
+      next = tree->left;
+      tree->left = next->right;
+      next->right = tree;
+    } else {
+      next = tree->right;
+      string_free(tree);
+    }
+    tree = next;
+  }
+  return;
+}
+
+
+/* Match files within one set of files that all have the same size
+ * Matches that still need a byte-for-byte check are flagged F_CONFIRM;
+ * confirm_sets() and then finish_sizegroup() must run before the sets
+ * can be used. Returns 1 if the user aborted matching, 0 otherwise */
+static int match_sizegroup(file_t ** const restrict group, const size_t count)
+{
+  filetree_t *checktree = NULL;
+  file_t **match;
+  file_t *curfile;
+  int aborted = 0;
+
+  if (group == NULL) nullptr("match_sizegroup()");
+  LOUD(fprintf(stderr, "match_sizegroup: %" PRIuMAX " files of size %" PRIdMAX "\n",
+        (uintmax_t)count, (intmax_t)group[0]->size));
+
+  for (size_t i = 0; i < count; i++) {
+    if (interrupt) {
+      aborted = 1;
+      break;
+    }
+
+    curfile = group[i];
+    match = NULL;
+    LOUD(fprintf(stderr, "\nMAIN: current file: %s\n", curfile->d_name));
+
+    if (!checktree) registerfile(&checktree, NONE, curfile);
+    else match = checkmatch(checktree, curfile);
+
+    /* The pair is registered now and confirmed byte for byte later by
+     * confirm_sets(), which drops it again if the data differs */
+    if (match != NULL) {
+      /* Quick or partial-only compare will never run confirmmatch()
+       * Also skip match confirmation for hard-linked files
+       * (This set of comparisons is ugly, but quite efficient) */
+      if (ISFLAG(flags, F_QUICKCOMPARE) || ISFLAG(flags, F_PARTIALONLY) ||
+           (ISFLAG(flags, F_CONSIDERHARDLINKS) &&
+           (curfile->inode == (*match)->inode) &&
+           (curfile->device == (*match)->device))
+         ) {
+        LOUD(fprintf(stderr, "MAIN: notice: quick or partial-only match (-Q/-T)\n"));
+      } else SETFLAG(curfile->flags, F_CONFIRM);
+      LOUD(fprintf(stderr, "MAIN: registering matched file pair\n"));
+      registerpair(match, curfile);
+      dupecount++;
+    }
+
+    if (!ISFLAG(flags, F_HIDEPROGRESS)) update_progress(NULL, -1);
+    progress++;
+    update_status(filecount);
+  }
+
+  free_filetree(checktree);
+  return aborted;
+}
+
+
+/* Wrap up a size group once its sets have been confirmed */
+static void finish_sizegroup(file_t ** const restrict group, const size_t count)
+{
+  if (hashcache_mode != 0) for (size_t i = 0; i < count; i++) hashcache_store(group[i]);
+  sort_dupe_chains(group, count);
+  return;
+}
+
+
+static FILE *fopen_ro(const char * const restrict path)
+{
+#ifdef UNICODE
+  /* Only the main thread reads on Windows, so wstr can be shared */
+  if (!M2W(path, wstr)) return NULL;
+  return _wfopen(wstr, FILE_MODE_RO);
+#else
+  return fopen(path, FILE_MODE_RO);
+#endif
+}
+
+
+/* Check every file of a set that is still flagged F_CONFIRM against the
+ * first one that isn't, and clear the flag on those that really match.
+ * That file is opened once and read again for each of the others. */
+static void confirm_set(file_t * const restrict head, char * const restrict c1,
+                char * const restrict c2, struct ioq_worker * const restrict w)
+{
+  file_t *anchor;
+  FILE *file1, *file2;
+
+  for (anchor = head; anchor != NULL && ISFLAG(anchor->flags, F_CONFIRM); anchor = anchor->duplicates);
+  if (anchor == NULL) return;
+  file1 = fopen_ro(anchor->d_name);
+  IOQ_SYSCALL(w, 1);
+  if (file1 == NULL) return;
+  IOQ_OPEN(w);
+
+  for (file_t *curfile = head; curfile != NULL && !interrupt; curfile = curfile->duplicates) {
+    if (!ISFLAG(curfile->flags, F_CONFIRM)) continue;
+    file2 = fopen_ro(curfile->d_name);
+    IOQ_SYSCALL(w, 1);
+    if (file2 == NULL) continue;
+    IOQ_OPEN(w);
+    if (confirmmatch(file1, file2, curfile->size, anchor->device, curfile->device, c1, c2, confirm_chunk, w))
+      CLEARFLAG(curfile->flags, F_CONFIRM);
+    fclose(file2);
+    IOQ_SYSCALL(w, 1);
+  }
+
+  fclose(file1);
+  IOQ_SYSCALL(w, 1);
+  return;
+}
+
+
+/* I/O queue job for confirm_sets(); each worker keeps one buffer pair */
+static void confirm_job(file_t * const restrict head, struct ioq_worker * const restrict w)
+{
+  if (w->buf == NULL) {
+    w->buf = malloc(confirm_chunk * 2);
+    if (w->buf == NULL) oom("confirm_job()");
+    w->buf_size = confirm_chunk * 2;
+  }
+  confirm_set(head, (char *)w->buf, (char *)w->buf + confirm_chunk, w);
+  return;
+}
+
+
+static void confirm_progress(const size_t done, const size_t total)
+{
+  if (!ISFLAG(flags, F_HIDEPROGRESS)) update_progress("confirm", (int)((done * 100) / total));
+  update_status(filecount);
+  return;
+}
+
+
+/* Drop the files that failed confirmation from a set. If the first file
+ * goes, whichever of the rest sorts first takes its place. */
+static void confirm_prune(file_t * const restrict head)
+{
+  file_t *keep = NULL, **tail = &keep, *curfile, *next, *first;
+  size_t kept = 0;
+
+  for (curfile = head; curfile != NULL; curfile = next) {
+    next = curfile->duplicates;
+    curfile->duplicates = NULL;
+    if (ISFLAG(curfile->flags, F_CONFIRM)) {
+      LOUD(fprintf(stderr, "confirm_prune: '%s' is not a duplicate\n", curfile->d_name));
+      CLEARFLAG(curfile->flags, (F_CONFIRM | F_HAS_DUPES));
+      dupecount--;
+      DBG(hash_fail++;)
+      continue;
+    }
+    *tail = curfile;
+    tail = &curfile->duplicates;
+    kept++;
+  }
+  if (kept < 2) {
+    if (keep != NULL) CLEARFLAG(keep->flags, F_HAS_DUPES);
+    return;
+  }
+  if (keep == head) return;
+
+  first = keep;
+  for (curfile = keep->duplicates; curfile != NULL; curfile = curfile->duplicates)
+    if (compare_files(curfile, first) < 0) first = curfile;
+  if (first != keep) {
+    for (curfile = keep; curfile->duplicates != first; curfile = curfile->duplicates);
+    curfile->duplicates = first->duplicates;
+    first->duplicates = keep;
+  }
+  SETFLAG(first->flags, F_HAS_DUPES);
+  return;
+}
+
+
+/* Whether a file heads a duplicate set that still needs confirmation */
+static int set_pending(const file_t * const restrict head)
+{
+  if (!ISFLAG(head->flags, F_HAS_DUPES)) return 0;
+  for (const file_t *curfile = head; curfile != NULL; curfile = curfile->duplicates)
+    if (ISFLAG(curfile->flags, F_CONFIRM)) return 1;
+  return 0;
+}
+
+
+/* Confirm the duplicate sets in a run of matched files byte for byte.
+ * Sets don't depend on each other, so whole sets are handed out to the
+ * I/O queue workers and no file is ever open twice at once. Every worker
+ * owns one pair of buffers, and all of the pairs together stay within
+ * --confirm-memory; the buffers are made smaller if even one pair of the
+ * chunk size wanted would not fit. Returns 1 if the user aborted. */
+static int confirm_sets(file_t ** const restrict files, const size_t count)
+{
+  static char *c1 = NULL, *c2 = NULL;
+  static size_t c_alloc = 0;
+  file_t **jobs;
+  size_t n = 0, pairs;
+  int ran = 0;
+
+  for (size_t i = 0; i < count; i++) if (set_pending(files[i])) n++;
+  if (n == 0) return 0;
+  jobs = (file_t **)malloc(sizeof(file_t *) * n);
+  if (jobs == NULL) oom("confirm_sets()");
+
+  /* The buffers must hold the largest chunk of any device involved */
+  n = 0;
+  confirm_chunk = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (!set_pending(files[i])) continue;
+    jobs[n++] = files[i];
+    for (file_t *curfile = files[i]; curfile != NULL; curfile = curfile->duplicates)
+      if (chunk_size(curfile->device) > confirm_chunk) confirm_chunk = chunk_size(curfile->device);
+  }
+  if (confirm_chunk * 2 > confirm_memory) confirm_chunk = confirm_memory / 2;
+  pairs = confirm_memory / (confirm_chunk * 2);
+  LOUD(fprintf(stderr, "confirm_sets: %" PRIuMAX " sets, %" PRIuMAX " buffer pairs of %" PRIuMAX " bytes\n",
+        (uintmax_t)n, (uintmax_t)pairs, (uintmax_t)confirm_chunk));
+
+  stats_enter(PHASE_CONFIRM);
+  if (pairs > 1) ran = ioq_run_limited(jobs, n, confirm_job, confirm_progress,
+      (pairs > UINT_MAX) ? UINT_MAX : (unsigned int)pairs);
+  if (ran == 0) {
+    if (confirm_chunk > c_alloc) {
+      string_free(c1);
+      string_free(c2);
+      c1 = (char *)string_malloc(confirm_chunk);
+      c2 = (char *)string_malloc(confirm_chunk);
+      c_alloc = confirm_chunk;
+    }
+    if (!c1 || !c2) oom("confirm_sets() c1/c2");
+    for (size_t i = 0; i < n && !interrupt; i++) confirm_set(jobs[i], c1, c2, NULL);
+  }
+  stats_leave();
+
+  for (size_t i = 0; i < n; i++) confirm_prune(jobs[i]);
+  free(jobs);
+  return interrupt ? 1 : 0;
+}
+
+
+/* Sort helper for grouping files by size */
+static int sort_files_by_size(const void *f1, const void *f2)
+{
+  const off_t s1 = ((const file_t *)f1)->size;
+  const off_t s2 = ((const file_t *)f2)->size;
+
+  return (s1 > s2) - (s1 < s2);
+}
+
+
+/* I/O queue jobs for prehash_files() */
+static void prehash_partial(file_t * const restrict file, struct ioq_worker * const restrict w)
+{
+  jdupes_hash_t hash;
+
+  if (hashcache_mode != 0) {
+    hashcache_load(file);
+    if (ISFLAG(file->flags, F_HASH_PARTIAL)) return;
+  }
+  if (hash_file(file, PARTIAL_HASH_SIZE, &hash, &w->buf, &w->buf_size, w) != 0) return;
+  file->filehash_partial = hash;
+  SETFLAG(file->flags, F_HASH_PARTIAL);
+  return;
+}
+
+
+static void prehash_full(file_t * const restrict file, struct ioq_worker * const restrict w)
+{
+  jdupes_hash_t hash;
+
+  if (hashcache_mode != 0) {
+    hashcache_load(file);
+    if (ISFLAG(file->flags, F_HASH_FULL)) return;
+  }
+  if (hash_file(file, 0, &hash, &w->buf, &w->buf_size, w) != 0) return;
+  file->filehash = hash;
+  SETFLAG(file->flags, F_HASH_FULL);
+  return;
+}
+
+
+static void prehash_progress(const size_t done, const size_t total)
+{
+  if (!ISFLAG(flags, F_HIDEPROGRESS)) update_progress("hashing", (int)((done * 100) / total));
+  update_status(filecount);
+  return;
+}
+
+
+/* Sort helper for grouping files by partial hash */
+static int sort_files_by_partial(const void *f1, const void *f2)
+{
+  return HASH_COMPARE(((const file_t *)f1)->filehash_partial, ((const file_t *)f2)->filehash_partial);
+}
+
+
+/* Sort helper for grouping hard links together */
+static int sort_files_by_inode(const void *f1, const void *f2)
+{
+  const file_t * const a = (const file_t *)f1;
+  const file_t * const b = (const file_t *)f2;
+
+  if (a->device != b->device) return (a->device > b->device) ? 1 : -1;
+  return (a->inode > b->inode) - (a->inode < b->inode);
+}
+
+
+/* Hash each inode once, then copy the result to its other hard links */
+static int prehash_run(file_t ** const restrict jobs, const size_t count, ioq_func_t func,
+                const uint32_t hashflag)
+{
+  file_t **unique;
+  size_t n = 0, i, j;
+  int ran;
+
+  if (count < 2) return 0;
+  unique = (file_t **)malloc(sizeof(file_t *) * count);
+  if (unique == NULL) oom("prehash_run()");
+  if (pointer_mergesort((void **)jobs, count, sort_files_by_inode) != 0) oom("prehash_run() sort");
+  for (i = 0; i < count; i++)
+    if (i == 0 || sort_files_by_inode(jobs[i], jobs[i - 1]) != 0) unique[n++] = jobs[i];
+
+  ran = ioq_run(unique, n, func, prehash_progress);
+  if (ran != 0) {
+    /* Hashes taken from --hash-xattr attributes needed no file reads */
+    const uint32_t xattrflag = (hashflag == F_HASH_PARTIAL) ? F_XATTR_PARTIAL : F_XATTR_FULL;
+
+    for (i = 0; i < n; i++) {
+      if (ISFLAG(unique[i]->flags, xattrflag)) {
+        if (hashflag == F_HASH_PARTIAL) cache_stats.partial_hits++;
+        else cache_stats.full_hits++;
+      } else if (hashflag == F_HASH_PARTIAL) cache_stats.partial_misses++;
+      else cache_stats.full_misses++;
+    }
+    for (i = 0; i < count; i = j) {
+      for (j = i + 1; j < count && sort_files_by_inode(jobs[j], jobs[i]) == 0; j++) {
+        if (!ISFLAG(jobs[i]->flags, hashflag)) continue;
+        jobs[j]->filehash_partial = jobs[i]->filehash_partial;
+        if (hashflag == F_HASH_FULL) jobs[j]->filehash = jobs[i]->filehash;
+        SETFLAG(jobs[j]->flags, hashflag);
+      }
+    }
+  }
+  free(unique);
+  return ran;
+}
+
+
+/* Whether a run of files holds more than one inode; hard links to the
+ * same inode are never hashed against each other */
+static int has_partner(file_t ** const restrict files, const size_t count)
+{
+  for (size_t i = 1; i < count; i++)
+    if (files[i]->inode != files[0]->inode || files[i]->device != files[0]->device) return 1;
+  return 0;
+}
+
+
+/* Read hashes ahead of the matching pass through the per-device I/O
+ * queues, so that files on different devices are read at the same time.
+ * Only hashes that checkmatch() is certain to ask for are read: partial
+ * hashes of files that have a same-size partner, then full hashes of
+ * files that also share their partial hash with a partner. checkmatch()
+ * later finds them already done. The files must be sorted by size. */
+static void prehash_files(file_t ** const restrict files, const size_t count)
+{
+  file_t **jobs, **run;
+  size_t n = 0, first, last;
+  int ran;
+
+  if (!ioq_enabled() || count < 2) return;
+  jobs = (file_t **)malloc(sizeof(file_t *) * count);
+  run = (file_t **)malloc(sizeof(file_t *) * count);
+  if (jobs == NULL || run == NULL) oom("prehash_files()");
+
+  for (first = 0; first < count; first = last) {
+    for (last = first + 1; last < count && files[last]->size == files[first]->size; last++);
+    if (!has_partner(files + first, last - first)) continue;
+    for (size_t i = first; i < last; i++)
+      if (!ISFLAG(files[i]->flags, F_HASH_PARTIAL)) jobs[n++] = files[i];
+  }
+  stats_enter(PHASE_PARTIAL);
+  ran = prehash_run(jobs, n, prehash_partial, F_HASH_PARTIAL);
+  stats_leave();
+  if (ran == 0 || interrupt || ISFLAG(flags, F_PARTIALONLY)) goto done;
+
+  n = 0;
+  for (first = 0; first < count; first = last) {
+    size_t run_cnt = 0, a, b;
+
+    for (last = first + 1; last < count && files[last]->size == files[first]->size; last++);
+    /* Small files are fully hashed by the partial hash */
+    if (files[first]->size <= PARTIAL_HASH_SIZE) continue;
+    for (size_t i = first; i < last; i++)
+      if (ISFLAG(files[i]->flags, F_HASH_PARTIAL)) run[run_cnt++] = files[i];
+    if (run_cnt < 2) continue;
+    if (pointer_mergesort((void **)run, run_cnt, sort_files_by_partial) != 0) oom("prehash_files() sort");
+    for (a = 0; a < run_cnt; a = b) {
+      for (b = a + 1; b < run_cnt && run[b]->filehash_partial == run[a]->filehash_partial; b++);
+      if (!has_partner(run + a, b - a)) continue;
+      for (size_t i = a; i < b; i++)
+        if (!ISFLAG(run[i]->flags, F_HASH_FULL)) jobs[n++] = run[i];
+    }
+  }
+  stats_enter(PHASE_FULL);
+  prehash_run(jobs, n, prehash_full, F_HASH_FULL);
+  stats_leave();
+
+done:
+  free(jobs);
+  free(run);
+  return;
+}
+
+
+/* Run the chosen actions on every duplicate set in a file list */
+static void act_on_sets(file_t *files)
+{
+  if (ISFLAG(flags, F_DELETEFILES)) {
+    if (ISFLAG(flags, F_NOPROMPT)) deletefiles(files, 0, 0);
+    else deletefiles(files, 1, stdin);
+  }
+#ifndef NO_SYMLINKS
+  if (ISFLAG(flags, F_MAKESYMLINKS)) linkfiles(files, 0);
+#endif
+#ifndef NO_HARDLINKS
+  if (ISFLAG(flags, F_HARDLINKFILES)) linkfiles(files, 1);
+#endif /* NO_HARDLINKS */
+#ifdef ENABLE_DEDUPE
+  if (ISFLAG(flags, F_DEDUPEFILES)) dedupefiles(files);
+#endif /* ENABLE_DEDUPE */
+#if defined ENABLE_APFS || defined ENABLE_REFLINK
+  if (ISFLAG(flags, F_CLONEFILES)) clonefiles(files);
+#endif
+  if (ISFLAG(flags, F_PRINTMATCHES)) {
+    if (output_format == OUTPUT_TEXT) printmatches(files);
+    else output_sets(files);
+  }
+  return;
+}
+
+
+/* --stream: nothing that happens later can change the duplicate sets of a
+ * size group once it has been matched, so act on them right away and
+ * free the whole group. */
+static void stream_group(file_t ** const restrict group, const size_t count)
+{
+  file_t *sets = NULL, *tail = NULL;
+
+  for (size_t i = 0; i < count; i++) {
+    group[i]->next = NULL;
+    if (!ISFLAG(group[i]->flags, F_HAS_DUPES)) continue;
+    if (tail == NULL) sets = group[i];
+    else tail->next = group[i];
+    tail = group[i];
+  }
+
+  if (sets != NULL) {
+    if (!ISFLAG(flags, F_HIDEPROGRESS)) fprintf(stderr, "\r%60s\r", " ");
+    stats_enter(PHASE_ACTION);
+    act_on_sets(sets);
+    if (ISFLAG(flags, F_SUMMARIZEMATCHES)) summarize_add(sets);
+    stats_leave();
+    for (; sets != NULL; sets = sets->next) streamed_sets++;
+    /* Whoever reads the output is waiting for it now, not at exit */
+    outbuf_flush();
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    string_free(group[i]->d_name);
+    string_free(group[i]);
+  }
+  return;
+}
+
+
+/* Match all files in the in-memory file list, one size at a time
+ * The file list itself is left in its original order; with --stream its
+ * files are acted on and freed group by group instead
+ * Returns 1 if the user aborted matching, 0 otherwise */
+static int match_filelist(file_t *files)
+{
+  file_t **sorted;
+  size_t count = 0, first, last, batch_end, group;
+  int aborted = 0;
+
+  for (file_t *curfile = files; curfile != NULL; curfile = curfile->next) count++;
+  sorted = (file_t **)malloc(sizeof(file_t *) * count);
+  if (sorted == NULL) oom("match_filelist() sorted");
+  count = 0;
+  for (file_t *curfile = files; curfile != NULL; curfile = curfile->next) sorted[count++] = curfile;
+  if (pointer_mergesort((void **)sorted, count, sort_files_by_size) != 0) oom("match_filelist() sort");
+
+  /* Files are hashed, matched and confirmed in batches of whole size
+   * groups; --stream uses small batches so that the first sets come out
+   * long before everything has been read */
+  for (first = 0; first < count && aborted == 0; first = batch_end) {
+    if (!ISFLAG(flags, F_STREAM)) batch_end = count;
+    else {
+      batch_end = (count - first > STREAM_BATCH) ? first + STREAM_BATCH : count;
+      while (batch_end < count && sorted[batch_end]->size == sorted[batch_end - 1]->size) batch_end++;
+    }
+    prehash_files(sorted + first, batch_end - first);
+
+    for (group = first; group < batch_end && aborted == 0; group = last) {
+      for (last = group + 1; last < batch_end && sorted[last]->size == sorted[group]->size; last++);
+      /* A file with a unique size can't have any duplicates */
+      if (last - group == 1) progress++;
+      else aborted = match_sizegroup(sorted + group, last - group);
+    }
+    /* Only what was matched before an abort is used */
+    batch_end = group;
+    if (confirm_sets(sorted + first, batch_end - first) != 0) aborted = 1;
+
+    for (group = first; group < batch_end; group = last) {
+      for (last = group + 1; last < batch_end && sorted[last]->size == sorted[group]->size; last++);
+      if (last - group > 1) finish_sizegroup(sorted + group, last - group);
+      if (ISFLAG(flags, F_STREAM)) stream_group(sorted + group, last - group);
+    }
+  }
+
+  free(sorted);
+  return aborted;
+}
+
+
+/* Match size groups merged from --max-memory run files. Only files
+ * that end up in duplicate sets are kept; the rest are freed right away.
+ * The kept files are linked through file->next to *filelistp, except
+ * with --stream, which acts on them straight away and keeps nothing.
+ * Returns 1 if the user aborted matching, 0 otherwise */
+static int match_spilled(file_t ** const restrict filelistp)
+{
+  file_t **group = NULL;
+  file_t *curfile, *tail = NULL, *next;
+  size_t count, group_max = 0, i;
+  int aborted = 0;
+
+  extsort_merge_init();
+  *filelistp = NULL;
+  while (aborted == 0 && (curfile = extsort_next_group(&count)) != NULL) {
+    if (count > group_max) {
+      group_max = count;
+      free(group);
+      group = (file_t **)malloc(sizeof(file_t *) * group_max);
+      if (group == NULL) oom("match_spilled() group");
+    }
+    for (i = 0; i < count; i++, curfile = next) {
+      next = curfile->next;
+      curfile->next = NULL;
+      group[i] = curfile;
+    }
+
+    if (count > 1) {
+      prehash_files(group, count);
+      aborted = match_sizegroup(group, count);
+      if (confirm_sets(group, count) != 0) aborted = 1;
+      finish_sizegroup(group, count);
+    } else progress++;
+    if (ISFLAG(flags, F_STREAM)) {
+      stream_group(group, count);
+      continue;
+    }
+
+    /* Link each duplicate set into the file list behind its first file */
+    for (i = 0; i < count; i++) {
+      if (!ISFLAG(group[i]->flags, F_HAS_DUPES)) continue;
+      for (curfile = group[i]; curfile != NULL; curfile = curfile->duplicates) {
+        if (tail == NULL) *filelistp = curfile;
+        else tail->next = curfile;
+        tail = curfile;
+      }
+    }
+    /* Files that were not linked above are not duplicates of anything */
+    for (i = 0; i < count; i++) {
+      if (group[i]->next == NULL && group[i] != tail) {
+        string_free(group[i]->d_name);
+        string_free(group[i]);
+      }
+    }
+  }
+
+  free(group);
+  extsort_cleanup();
+  return aborted;
+}
+
+
+/* Read every file once for --blocks; get_filehash() feeds the chunker */
+static int scan_blocks(file_t *files)
+{
+  for (; files != NULL; files = files->next) {
+    if (interrupt) return 1;
+    if (files->size <= 0) continue;
+    if (!ISFLAG(flags, F_HIDEPROGRESS)) update_progress("blocks", -1);
+    blocks_file_begin(files);
+    stats_enter(PHASE_FULL);
+    blocks_file_end(get_filehash(files, 0) != NULL && !interrupt);
+    stats_leave();
+    progress++;
+    update_status(filecount);
+  }
+  return interrupt;
+}
+
+
+static inline void help_text(void)
+{
+  printf("Usage: jdupes [options] FILES and/or DIRECTORIES...\n\n");
+
+  printf("Duplicate file sets will be printed by default unless a different action\n");
+  printf("option is specified (delete, summarize, link, dedupe, etc.)\n");
+#ifdef LOUD
+  printf(" -@ --loud        \toutput annoying low-level debug info while running\n");
+#endif
+  printf(" -0 --printnull   \toutput nulls instead of CR/LF (like 'find -print0')\n");
+  printf(" -1 --one-file-system \tdo not match files on different filesystems/devices\n");
+  printf(" -A --nohidden    \texclude hidden files from consideration\n");
+#ifdef ENABLE_DEDUPE
+  printf(" -B --dedupe      \tsend matches to filesystem for block-level deduplication\n");
+#endif
+#ifdef ENABLE_APFS
   printf(" -a --clonefile   \tuse clonefile to deduplicate on apfs\n");
+#endif
+#ifdef ENABLE_REFLINK
+  printf(" -a --reflink     \treplace duplicates with reflink clones of the first\n");
+  printf("                  \tfile in each set (btrfs, XFS, etc.)\n");
 #endif
   printf(" -C --chunksize=# \toverride I/O chunk size (min %d, max %d)\n", MIN_CHUNK_SIZE, MAX_CHUNK_SIZE);
+  printf("    --confirm-memory=SIZE\tuse at most SIZE bytes of buffers for confirming\n");
+  printf("                  \tmatches byte for byte in parallel (default 64M)\n");
   printf(" -d --delete      \tprompt user for files to preserve and delete all\n");
   printf("                  \tothers; important: under particular circumstances,\n");
   printf("                  \tdata may be lost when using this option together\n");
@@ -1498,11 +2589,22 @@ static inline void help_text(void)
   printf(" -D --debug       \toutput debug statistics after completion\n");
 #endif
   printf(" -f --omitfirst   \tomit the first file in each set of matches\n");
+  printf("    --files-from=FILE\tcheck the files named in FILE ('-' for standard\n");
+  printf("                  \tinput), one per line or separated by NUL bytes\n");
+  printf("    --files-from-columns=LIST\teach name in the --files-from list comes\n");
+  printf("                  \tafter these tab-separated fields, which are used\n");
+  printf("                  \tinstead of looking the files up: size, inode and\n");
+  printf("                  \tdevice (all required) and mtime, in the order given\n");
   printf(" -h --help        \tdisplay this help message\n");
 #ifndef NO_HARDLINKS
   printf(" -H --hardlinks   \ttreat any linked files as duplicate files. Normally\n");
   printf("                  \tlinked files are treated as non-duplicates for safety\n");
 #endif
+  printf("    --hash-xattr[=MODE]\tkeep file hashes in a 'user.jdupes.hash' extended\n");
+  printf("                  \tattribute and reuse them while the size, inode and\n");
+  printf("                  \tmtime are unchanged; MODE 'ro' only reads them\n");
+  printf("    --hash-xattr-verify=PCT\thash PCT percent of files with saved hashes\n");
+  printf("                  \tagain and report attributes that are stale or forged\n");
   printf(" -i --reverse     \treverse (invert) the match sort order\n");
 #ifndef NO_USER_ORDER
   printf(" -I --isolate     \tfiles in the same specified directory won't match\n");
@@ -1517,10 +2619,38 @@ static inline void help_text(void)
  #endif /* ON_WINDOWS */
 #endif /* NO_HARDLINKS */
   printf(" -m --summarize   \tsummarize dupe information\n");
+  printf("    --max-memory=SIZE\tkeep at most SIZE bytes of scanned file info in memory;\n");
+  printf("                  \tthe rest is sorted by size into temporary files\n");
+  printf("    --blocks[=SIZE]\tfind blocks shared between files instead of whole\n");
+  printf("                  \tfile duplicates using content-defined chunks of\n");
+  printf("                  \tSIZE bytes on average (default 64K); with -B,\n");
+  printf("                  \tshared blocks are deduplicated\n");
+  printf("    --dirs        \treport whole directory trees that are duplicates as\n");
+  printf("                  \tsingle sets; -d and -l act on whole directories\n");
+  printf("    --size-prepass\tscan everything once for file sizes only, then keep\n");
+  printf("                  \tinfo only for files whose size is not unique\n");
+  printf("    --stats=FILE  \twrite per-phase timing and I/O statistics to FILE\n");
+  printf("                  \tas JSON when finished\n");
+  printf("    --status-fd=N \tstream progress records (one JSON object per line)\n");
+  printf("                  \tto file descriptor N about once a second\n");
+  printf("    --status-socket=PATH\tserve the same progress records to clients of\n");
+  printf("                  \ta Unix socket created at PATH\n");
+  printf("    --io-threads=[PATH:]N\tread with N threads per device (default %d, or 1\n", IOQ_DEFAULT_THREADS);
+  printf("                  \tfor rotating disks); with PATH, only for the device\n");
+  printf("                  \tholding PATH; 0 reads everything in one thread\n");
+  printf("    --max-read-rate=N\tread file data at no more than N MiB per second\n");
+  printf("    --max-iops=N  \tmake no more than N file read requests per second\n");
+  printf("    --io-priority=CLASS\tset the I/O scheduling class (Linux only): 'idle'\n");
+  printf("                  \tor 'best-effort[:LEVEL]' (LEVEL 0-7, default 7)\n");
+  printf("    --stream      \tprint (or act on) each duplicate set as soon as all\n");
+  printf("                  \tfiles of its size have been matched\n");
   printf(" -M --printwithsummary\twill print matches and --summarize at the end\n");
   printf(" -N --noprompt    \ttogether with --delete, preserve the first file in\n");
   printf("                  \teach set of duplicates and delete the rest without\n");
   printf("                  \tprompting the user\n");
+  printf("    --output=FORMAT\tprint matches as 'text' (the default), 'json' (one\n");
+  printf("                  \tdocument), 'ndjson' (one set per line) or 'binary'\n");
+  printf("                  \twith size, hashes, inode, device and mtime\n");
   printf(" -o --order=BY    \tselect sort order for output, linking and deleting; by\n");
 #ifndef NO_USER_ORDER
   printf(" -O --paramorder  \tParameter order is more important than selected -O sort\n");
@@ -1549,8 +2679,11 @@ static inline void help_text(void)
   printf(" -x --xsize=SIZE  \texclude files of size < SIZE bytes from consideration\n");
   printf("    --xsize=+SIZE \t'+' specified before SIZE, exclude size > SIZE\n");
   printf(" -X --exclude=spec:info\texclude files based on specified criteria\n");
-  printf("                  \tspecs: size+-=\n");
-  printf("                  \tExclusions are cumulative: -X dir:abc -X dir:efg\n");
+  printf("                  \tspecs: size+-=, dir, name, path, ext");
+#ifndef ON_WINDOWS
+  printf(", regex");
+#endif
+  printf("\n                  \tExclusions are cumulative: -X dir:abc -X dir:efg\n");
   printf(" -z --zeromatch   \tconsider zero-length files to be duplicates\n");
   printf(" -Z --softabort   \tIf the user aborts (i.e. CTRL-C) act on matches so far\n");
 #ifndef ON_WINDOWS
@@ -1570,14 +2703,12 @@ int main(int argc, char **argv)
 #endif
 {
   static file_t *files = NULL;
-  static file_t *curfile;
   static char **oldargv;
   static char *xs;
   static int firstrecurse;
   static int opt;
   static int pm = 1;
   static int partialonly_spec = 0;
-  static ordertype_t ordertype = ORDER_NAME;
   static long manual_chunk_size = 0;
 #ifndef ON_WINDOWS
   static struct proc_cacheinfo pci;
@@ -1592,6 +2723,7 @@ int main(int argc, char **argv)
     { "nohidden", 0, 0, 'A' },
     { "dedupe", 0, 0, 'B' },
     { "clonefile", 0, 0, 'a' },
+    { "reflink", 0, 0, 'a' },
     { "chunksize", 1, 0, 'C' },
     { "delete", 0, 0, 'd' },
     { "debug", 0, 0, 'D' },
@@ -1624,6 +2756,24 @@ int main(int argc, char **argv)
     { "exclude", 1, 0, 'X' },
     { "zeromatch", 0, 0, 'z' },
     { "softabort", 0, 0, 'Z' },
+    { "max-memory", 1, 0, OPT_MAXMEMORY },
+    { "size-prepass", 0, 0, OPT_SIZEPREPASS },
+    { "blocks", 2, 0, OPT_BLOCKS },
+    { "dirs", 0, 0, OPT_DIRS },
+    { "stats", 1, 0, OPT_STATS },
+    { "status-fd", 1, 0, OPT_STATUSFD },
+    { "status-socket", 1, 0, OPT_STATUSSOCKET },
+    { "io-threads", 1, 0, OPT_IOTHREADS },
+    { "max-read-rate", 1, 0, OPT_MAXREADRATE },
+    { "max-iops", 1, 0, OPT_MAXIOPS },
+    { "io-priority", 1, 0, OPT_IOPRIORITY },
+    { "stream", 0, 0, OPT_STREAM },
+    { "output", 1, 0, OPT_OUTPUT },
+    { "files-from", 1, 0, OPT_FILESFROM },
+    { "files-from-columns", 1, 0, OPT_FILESFROMCOLUMNS },
+    { "hash-xattr", 2, 0, OPT_HASHXATTR },
+    { "hash-xattr-verify", 1, 0, OPT_HASHXATTRVERIFY },
+    { "confirm-memory", 1, 0, OPT_CONFIRMMEMORY },
     { NULL, 0, 0, 0 }
   };
 #define GETOPT getopt_long
@@ -1819,6 +2969,147 @@ int main(int argc, char **argv)
     case 'X':
       add_exclude(optarg);
       break;
+    case OPT_MAXMEMORY:
+      {
+        const int64_t size = strtosize(optarg);
+        if (size <= 0) {
+          fprintf(stderr, "invalid value for --max-memory: '%s'\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        max_memory = (uintmax_t)size;
+      }
+      break;
+    case OPT_SIZEPREPASS:
+      size_prepass = 1;
+      break;
+    case OPT_BLOCKS:
+      {
+        const int64_t size = (optarg == NULL) ? BLOCKS_DEFAULT_AVG : strtosize(optarg);
+        if (size < BLOCKS_MIN_AVG || size > BLOCKS_MAX_AVG || (size & (size - 1)) != 0) {
+          fprintf(stderr, "invalid value for --blocks: '%s' (must be a power of two from %d to %d)\n",
+              optarg, BLOCKS_MIN_AVG, BLOCKS_MAX_AVG);
+          exit(EXIT_FAILURE);
+        }
+        blocks_avg = (size_t)size;
+      }
+      break;
+    case OPT_DIRS:
+      dirs_mode = 1;
+      break;
+    case OPT_STATS:
+      stats_init(optarg);
+      break;
+    case OPT_STATUSFD:
+      {
+        char *end;
+        const long fd = strtol(optarg, &end, 10);
+        if (*optarg == '\0' || *end != '\0' || fd < 0 || fd > INT_MAX) {
+          fprintf(stderr, "invalid value for --status-fd: '%s'\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        status_init_fd((int)fd);
+      }
+      break;
+    case OPT_STATUSSOCKET:
+      status_init_socket(optarg);
+      break;
+    case OPT_IOTHREADS:
+      {
+        char *end;
+        char *count = strrchr(optarg, ':');
+        unsigned long threads;
+
+        count = (count == NULL) ? optarg : count + 1;
+        threads = strtoul(count, &end, 10);
+        if (*count == '\0' || *end != '\0' || threads > IOQ_MAX_THREADS) {
+          fprintf(stderr, "invalid value for --io-threads: '%s'\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        if (count == optarg) ioq_set_threads((unsigned int)threads);
+        else {
+          /* Cut the thread count off to leave the path */
+          *(count - 1) = '\0';
+          errno = 0;
+          if (ioq_set_device_threads(optarg, (unsigned int)threads) != 0) {
+            fprintf(stderr, "cannot set --io-threads for '%s': %s\n", optarg,
+                (errno != 0) ? strerror(errno) : "too many devices");
+            exit(EXIT_FAILURE);
+          }
+        }
+      }
+      break;
+    case OPT_MAXREADRATE:
+    case OPT_MAXIOPS:
+      {
+        char *end;
+        const double rate = strtod(optarg, &end);
+
+        if (*optarg == '\0' || *end != '\0' || !(rate > 0.0)) {
+          fprintf(stderr, "invalid value for --%s: '%s'\n",
+              (opt == OPT_MAXIOPS) ? "max-iops" : "max-read-rate", optarg);
+          exit(EXIT_FAILURE);
+        }
+        if (opt == OPT_MAXIOPS) throttle_set_iops(rate);
+        else throttle_set_rate(rate * 1048576.0);
+      }
+      break;
+    case OPT_IOPRIORITY:
+      if (throttle_set_priority(optarg) != 0) {
+        fprintf(stderr, "cannot set --io-priority to '%s': %s\n", optarg, strerror(errno));
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case OPT_STREAM:
+      SETFLAG(flags, F_STREAM);
+      break;
+    case OPT_OUTPUT:
+      if (output_set_format(optarg) != 0) {
+        fprintf(stderr, "invalid value for --output: '%s'\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case OPT_FILESFROM:
+      if (files_from != NULL) {
+        fprintf(stderr, "option --files-from can only be given once\n");
+        exit(EXIT_FAILURE);
+      }
+      files_from = optarg;
+      break;
+    case OPT_FILESFROMCOLUMNS:
+      if (filelist_set_columns(optarg) != 0
+          || !(filelist_columns & FILELIST_SIZE) || !(filelist_columns & FILELIST_INODE)
+          || !(filelist_columns & FILELIST_DEVICE)) {
+        /* An inode number means nothing without its device; -H and the
+         * hard link checks would match files on different filesystems */
+        fprintf(stderr, "invalid value for --files-from-columns: '%s'\n", optarg);
+        fprintf(stderr, "use a list of size, inode, device and mtime that includes size, inode and device\n");
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case OPT_HASHXATTR:
+      if (hashcache_set_mode(optarg) != 0) {
+        if (errno == ENOSYS) fprintf(stderr, "option --hash-xattr is not supported on this platform\n");
+        else fprintf(stderr, "invalid value for --hash-xattr: '%s' (use 'rw' or 'ro')\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case OPT_HASHXATTRVERIFY:
+      if (hashcache_set_verify(optarg) != 0) {
+        fprintf(stderr, "invalid value for --hash-xattr-verify: '%s' (use a percentage)\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      hashcache_verify = 1;
+      break;
+    case OPT_CONFIRMMEMORY:
+      {
+        const int64_t size = strtosize(optarg);
+        if (size < MIN_CHUNK_SIZE * 2 || (uint64_t)size > SIZE_MAX) {
+          fprintf(stderr, "invalid value for --confirm-memory: '%s' (at least %d)\n", optarg, MIN_CHUNK_SIZE * 2);
+          exit(EXIT_FAILURE);
+        }
+        confirm_memory = (size_t)size;
+      }
+      break;
     case '@':
 #ifdef LOUD_DEBUG
       SETFLAG(flags, F_DEBUG | F_LOUD | F_HIDEPROGRESS);
@@ -1880,24 +3171,24 @@ int main(int argc, char **argv)
       }
       break;
     case 'B':
-#ifdef ENABLE_BTRFS
+#ifdef ENABLE_DEDUPE
       SETFLAG(flags, F_DEDUPEFILES);
-      /* btrfs will do the byte-for-byte check itself */
+      /* The kernel will do the byte-for-byte check itself */
       SETFLAG(flags, F_QUICKCOMPARE);
       /* It is completely useless to dedupe zero-length extents */
       CLEARFLAG(flags, F_INCLUDEEMPTY);
 #else
-      fprintf(stderr, "This program was built without btrfs support\n");
+      fprintf(stderr, "This program was built without dedupe support\n");
       exit(EXIT_FAILURE);
 #endif
       break;
     case 'a':
-#ifdef ENABLE_APFS
+#if defined ENABLE_APFS || defined ENABLE_REFLINK
       SETFLAG(flags, F_CLONEFILES);
       /* It is completely useless to dedupe zero-length extents */
       CLEARFLAG(flags, F_INCLUDEEMPTY);
 #else
-      fprintf(stderr, "This program was built without btrfs support\n");
+      fprintf(stderr, "This program was built without clonefile/reflink support\n");
       exit(EXIT_FAILURE);
 #endif
       break;
@@ -1910,7 +3201,10 @@ int main(int argc, char **argv)
     }
   }
 
-  if (optind >= argc) {
+  /* A chunk size given with -C is used as-is on every device */
+  chunk_tune_init(auto_chunk_size, manual_chunk_size == 0);
+
+  if (optind >= argc && files_from == NULL) {
     fprintf(stderr, "no files or directories specified (use -h option for help)\n");
     string_malloc_destroy();
     exit(EXIT_FAILURE);
@@ -1940,7 +3234,7 @@ int main(int argc, char **argv)
     exit(EXIT_FAILURE);
   }
 
-#ifdef ENABLE_BTRFS
+#ifdef ENABLE_DEDUPE
   if (ISFLAG(flags, F_CONSIDERHARDLINKS) && ISFLAG(flags, F_DEDUPEFILES))
     fprintf(stderr, "warning: option --dedupe overrides the behavior of --hardlinks\n");
 #endif
@@ -1950,14 +3244,97 @@ int main(int argc, char **argv)
       !!ISFLAG(flags, F_DELETEFILES) +
       !!ISFLAG(flags, F_HARDLINKFILES) +
       !!ISFLAG(flags, F_MAKESYMLINKS) +
-      !!ISFLAG(flags, F_DEDUPEFILES);
+      !!ISFLAG(flags, F_DEDUPEFILES) +
+      !!ISFLAG(flags, F_CLONEFILES);
 
   if (pm > 1) {
-      fprintf(stderr, "Only one of --summarize, --printwithsummary, --delete,\n--linkhard, --linksoft, or --dedupe may be used\n");
+      fprintf(stderr, "Only one of --summarize, --printwithsummary, --delete,\n--linkhard, --linksoft, --dedupe, or --reflink may be used\n");
       string_malloc_destroy();
       exit(EXIT_FAILURE);
   }
   if (pm == 0) SETFLAG(flags, F_PRINTMATCHES);
+  if (output_format != OUTPUT_TEXT &&
+      (pm != 0 || blocks_avg != 0 || dirs_mode)) {
+    fprintf(stderr, "option --output only applies to printing matches; it is not compatible\nwith other actions, --summarize, --blocks or --dirs\n");
+    string_malloc_destroy();
+    exit(EXIT_FAILURE);
+  }
+
+  if (blocks_avg != 0) {
+    if (max_memory != 0 || size_prepass) {
+      fprintf(stderr, "option --blocks is not compatible with --max-memory or --size-prepass\n");
+      string_malloc_destroy();
+      exit(EXIT_FAILURE);
+    }
+    if (ISFLAG(flags, F_DELETEFILES) || ISFLAG(flags, F_HARDLINKFILES)
+        || ISFLAG(flags, F_MAKESYMLINKS) || ISFLAG(flags, F_CLONEFILES)) {
+      fprintf(stderr, "option --blocks can only be combined with --dedupe or --summarize\n");
+      string_malloc_destroy();
+      exit(EXIT_FAILURE);
+    }
+    blocks_init(blocks_avg);
+  }
+
+  if (dirs_mode) {
+    if (max_memory != 0 || size_prepass || blocks_avg != 0) {
+      fprintf(stderr, "option --dirs is not compatible with --max-memory, --size-prepass or --blocks\n");
+      string_malloc_destroy();
+      exit(EXIT_FAILURE);
+    }
+    if (ISFLAG(flags, F_HARDLINKFILES) || ISFLAG(flags, F_DEDUPEFILES) || ISFLAG(flags, F_CLONEFILES)) {
+      fprintf(stderr, "option --dirs can only be combined with --delete, --linksoft or --summarize\n");
+      string_malloc_destroy();
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (ISFLAG(flags, F_STREAM)) {
+    if (blocks_avg != 0 || dirs_mode) {
+      fprintf(stderr, "option --stream is not compatible with --blocks or --dirs\n");
+      string_malloc_destroy();
+      exit(EXIT_FAILURE);
+    }
+    if (ISFLAG(flags, F_DELETEFILES) && !ISFLAG(flags, F_NOPROMPT)) {
+      fprintf(stderr, "option --stream can only be combined with --delete if --noprompt is given\n");
+      string_malloc_destroy();
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (files_from != NULL) {
+    if (dirs_mode) {
+      fprintf(stderr, "option --files-from is not compatible with --dirs\n");
+      string_malloc_destroy();
+      exit(EXIT_FAILURE);
+    }
+    if (size_prepass && strcmp(files_from, "-") == 0) {
+      fprintf(stderr, "option --size-prepass can't read a --files-from list from standard input\n");
+      string_malloc_destroy();
+      exit(EXIT_FAILURE);
+    }
+#ifndef NO_PERMS
+    if (filelist_columns != 0 && ISFLAG(flags, F_PERMISSIONS)) {
+      fprintf(stderr, "option --permissions needs a stat() of each file; it is not compatible\nwith --files-from-columns\n");
+      string_malloc_destroy();
+      exit(EXIT_FAILURE);
+    }
+#endif
+  } else if (filelist_columns != 0) {
+    fprintf(stderr, "option --files-from-columns is only used with --files-from\n");
+    string_malloc_destroy();
+    exit(EXIT_FAILURE);
+  }
+
+  if (hashcache_verify && hashcache_mode == 0) {
+    fprintf(stderr, "option --hash-xattr-verify is only used with --hash-xattr\n");
+    string_malloc_destroy();
+    exit(EXIT_FAILURE);
+  }
+
+  exclude_compile(ISFLAG(flags, F_EXCLUDEHIDDEN) ? 1 : 0);
+
+  /* Bounded memory runs need file records that can really be freed */
+  if (max_memory != 0) string_malloc_passthrough(1);
 
   if (ISFLAG(flags, F_RECURSEAFTER)) {
     firstrecurse = nonoptafter("--recurse:", argc, oldargv, argv);
@@ -1970,38 +3347,46 @@ int main(int argc, char **argv)
       string_malloc_destroy();
       exit(EXIT_FAILURE);
     }
+  }
 
-    /* F_RECURSE is not set for directories before --recurse: */
-    for (int x = optind; x < firstrecurse; x++) {
-      slash_convert(argv[x]);
-      grokdir(argv[x], &files, 0);
-      user_item_count++;
-    }
-
-    /* Set F_RECURSE for directories after --recurse: */
-    SETFLAG(flags, F_RECURSE);
-
-    for (int x = firstrecurse; x < argc; x++) {
+  stats_enter(PHASE_SCAN);
+  /* --size-prepass scans everything twice; the first time only for sizes */
+  for (scan_pass = size_prepass ? SCAN_SIZES : SCAN_FILES; ; scan_pass = SCAN_FILES) {
+    for (int x = optind; x < argc; x++) {
       slash_convert(argv[x]);
-      grokdir(argv[x], &files, 1);
+      /* Only directories given after --recurse: are recursed with -R */
+      if (ISFLAG(flags, F_RECURSEAFTER)) grokdir(argv[x], &files, x >= firstrecurse);
+      else grokdir(argv[x], &files, ISFLAG(flags, F_RECURSE));
       user_item_count++;
     }
-  } else {
-    for (int x = optind; x < argc; x++) {
-      slash_convert(argv[x]);
-      grokdir(argv[x], &files, ISFLAG(flags, F_RECURSE));
+    /* A file list counts as one more specified item */
+    if (files_from != NULL) {
+      grokfilelist(files_from, &files);
       user_item_count++;
     }
+    if (scan_pass == SCAN_FILES) break;
+
+    /* Start the real scan from scratch */
+    travdone_clear();
+    user_item_count = 1;
+    progress = 0;
+    item_progress = 0;
   }
+  stats_leave();
+
+  /* Files of a unique size are never hashed or sorted into size groups;
+   * blocks can be shared between files of any size though */
+  if (blocks_avg == 0 && !dirs_mode) files = prune_unique_sizes(files);
 
   if (ISFLAG(flags, F_REVERSESORT)) sort_direction = -1;
   if (!ISFLAG(flags, F_HIDEPROGRESS)) fprintf(stderr, "\n");
-  if (!files) {
+  if (!files && extsort_run_count() == 0) {
     fwprint(stderr, "No duplicates found.", 1);
+    if (output_format != OUTPUT_TEXT) output_finish();
+    stats_write(filecount, dupecount);
     exit(EXIT_SUCCESS);
   }
 
-  curfile = files;
   progress = 0;
 
   /* Catch CTRL-C */
@@ -2011,109 +3396,68 @@ int main(int argc, char **argv)
   signal(SIGUSR1, sigusr1);
 #endif
 
-  while (curfile) {
-    static file_t **match = NULL;
-    static FILE *file1;
-    static FILE *file2;
-
-    if (interrupt) {
+  if (blocks_avg != 0) {
+    stats_enter(PHASE_MATCH);
+    opt = scan_blocks(files);
+    stats_leave();
+    if (opt != 0) {
       fprintf(stderr, "\nStopping file scan due to user abort\n");
       if (!ISFLAG(flags, F_SOFTABORT)) exit(EXIT_FAILURE);
-      interrupt = 0;  /* reset interrupt for re-use */
-      goto skip_file_scan;
-    }
-
-    LOUD(fprintf(stderr, "\nMAIN: current file: %s\n", curfile->d_name));
-
-    if (!checktree) registerfile(&checktree, NONE, curfile);
-    else match = checkmatch(checktree, curfile);
-
-    /* Byte-for-byte check that a matched pair are actually matched */
-    if (match != NULL) {
-      /* Quick or partial-only compare will never run confirmmatch()
-       * Also skip match confirmation for hard-linked files
-       * (This set of comparisons is ugly, but quite efficient) */
-      if (ISFLAG(flags, F_QUICKCOMPARE) || ISFLAG(flags, F_PARTIALONLY) ||
-           (ISFLAG(flags, F_CONSIDERHARDLINKS) &&
-           (curfile->inode == (*match)->inode) &&
-           (curfile->device == (*match)->device))
-         ) {
-        LOUD(fprintf(stderr, "MAIN: notice: quick or partial-only match (-Q/-T)\n"));
-        registerpair(match, curfile,
-            (ordertype == ORDER_TIME) ? sort_pairs_by_mtime : sort_pairs_by_filename);
-        dupecount++;
-        goto skip_full_check;
-      }
-
-#ifdef UNICODE
-      if (!M2W(curfile->d_name, wstr)) file1 = NULL;
-      else file1 = _wfopen(wstr, FILE_MODE_RO);
-#else
-      file1 = fopen(curfile->d_name, FILE_MODE_RO);
-#endif
-      if (!file1) {
-        curfile = curfile->next;
-        continue;
-      }
-
-#ifdef UNICODE
-      if (!M2W((*match)->d_name, wstr)) file2 = NULL;
-      else file2 = _wfopen(wstr, FILE_MODE_RO);
-#else
-      file2 = fopen((*match)->d_name, FILE_MODE_RO);
-#endif
-      if (!file2) {
-        fclose(file1);
-        curfile = curfile->next;
-        continue;
-      }
-
-      if (confirmmatch(file1, file2, curfile->size)) {
-        LOUD(fprintf(stderr, "MAIN: registering matched file pair\n"));
-        registerpair(match, curfile,
-            (ordertype == ORDER_TIME) ? sort_pairs_by_mtime : sort_pairs_by_filename);
-        dupecount++;
-      } DBG(else hash_fail++;)
-
-      fclose(file1);
-      fclose(file2);
     }
+    if (!ISFLAG(flags, F_HIDEPROGRESS)) fprintf(stderr, "\r%60s\r", " ");
+    signal(SIGINT, SIG_DFL);
+    stats_enter(PHASE_ACTION);
+    blockmatch();
+    stats_leave();
+    blocks_cleanup();
+    string_malloc_destroy();
+    stats_write(filecount, dupecount);
+    exit(EXIT_SUCCESS);
+  }
 
-skip_full_check:
-    curfile = curfile->next;
-
-    if (!ISFLAG(flags, F_HIDEPROGRESS)) update_progress(NULL, -1);
-    progress++;
+  /* If --max-memory sent anything to disk, the rest must go there too */
+  stats_enter(PHASE_MATCH);
+  if (extsort_run_count() != 0) {
+    extsort_spill(files);
+    opt = match_spilled(&files);
+  } else opt = match_filelist(files);
+  stats_leave();
+  /* Every set has been acted on and freed already */
+  if (ISFLAG(flags, F_STREAM)) files = NULL;
+
+  if (opt != 0) {
+    fprintf(stderr, "\nStopping file scan due to user abort\n");
+    if (!ISFLAG(flags, F_SOFTABORT)) exit(EXIT_FAILURE);
+    interrupt = 0;  /* reset interrupt for re-use */
+    goto skip_file_scan;
   }
 
   if (!ISFLAG(flags, F_HIDEPROGRESS)) fprintf(stderr, "\r%60s\r", " ");
 
 skip_file_scan:
+  hashcache_report();
   /* Stop catching CTRL+C */
   signal(SIGINT, SIG_DFL);
-  if (ISFLAG(flags, F_DELETEFILES)) {
-    if (ISFLAG(flags, F_NOPROMPT)) deletefiles(files, 0, 0);
-    else deletefiles(files, 1, stdin);
+  stats_enter(PHASE_ACTION);
+  if (dirs_mode) {
+    dirmatch(files, argv + optind, argc - optind);
+    stats_leave();
+    string_malloc_destroy();
+    stats_write(filecount, dupecount);
+    exit(EXIT_SUCCESS);
   }
-#ifndef NO_SYMLINKS
-  if (ISFLAG(flags, F_MAKESYMLINKS)) linkfiles(files, 0);
-#endif
-#ifndef NO_HARDLINKS
-  if (ISFLAG(flags, F_HARDLINKFILES)) linkfiles(files, 1);
-#endif /* NO_HARDLINKS */
-#ifdef ENABLE_BTRFS
-  if (ISFLAG(flags, F_DEDUPEFILES)) dedupefiles(files);
-#endif /* ENABLE_BTRFS */
-#ifdef ENABLE_APFS
-  if (ISFLAG(flags, F_CLONEFILES)) clonefiles(files);
-#endif /* ENABLE_APFS */
-  if (ISFLAG(flags, F_PRINTMATCHES)) printmatches(files);
+  if (!ISFLAG(flags, F_STREAM)) act_on_sets(files);
+  else if (streamed_sets == 0 && ISFLAG(flags, F_PRINTMATCHES)) fwprint(stderr, "No duplicates found.", 1);
+  if (output_format != OUTPUT_TEXT) output_finish();
   if (ISFLAG(flags, F_SUMMARIZEMATCHES)) {
     if (ISFLAG(flags, F_PRINTMATCHES)) printf("\n\n");
-    summarizematches(files);
+    if (ISFLAG(flags, F_STREAM)) summarize_print();
+    else summarizematches(files);
   }
+  stats_leave();
 
   string_malloc_destroy();
+  stats_write(filecount, dupecount);
 
 #ifdef DEBUG
   if (ISFLAG(flags, F_DEBUG)) {
@@ -2130,9 +3474,9 @@ skip_file_scan:
     if (manual_chunk_size > 0) fprintf(stderr, "I/O chunk size: %ld KiB (manually set)\n", manual_chunk_size >> 10);
     else {
 #ifndef ON_WINDOWS
-      fprintf(stderr, "I/O chunk size: %" PRIuMAX " KiB (%s)\n", (uintmax_t)(auto_chunk_size >> 10), (pci.l1 + pci.l1d) != 0 ? "dynamically sized" : "default size");
+      fprintf(stderr, "I/O chunk size: %" PRIuMAX " KiB (%s), tuned per device\n", (uintmax_t)(auto_chunk_size >> 10), (pci.l1 + pci.l1d) != 0 ? "dynamically sized" : "default size");
 #else
-      fprintf(stderr, "I/O chunk size: %" PRIuMAX " KiB (default size)\n", (uintmax_t)(auto_chunk_size >> 10));
+      fprintf(stderr, "I/O chunk size: %" PRIuMAX " KiB (default size), tuned per device\n", (uintmax_t)(auto_chunk_size >> 10));
 #endif
     }
 #ifdef ON_WINDOWS
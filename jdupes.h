@@ -36,10 +36,13 @@ extern "C" {
 
 #include "xxhash.h"
 
-/* Optional btrfs support */
-#ifdef ENABLE_BTRFS
-#include <sys/ioctl.h>
-#include <linux/btrfs.h>
+/* Optional block-level dedupe support; ENABLE_BTRFS is the old name */
+#if defined ENABLE_BTRFS && !defined ENABLE_DEDUPE
+ #define ENABLE_DEDUPE
+#endif
+/* Linux reflink cloning relies on the same kernel support as dedupe */
+#if defined ENABLE_DEDUPE && !defined ENABLE_APFS
+ #define ENABLE_REFLINK
 #endif
 
 /* Set hash type (change this if swapping in a different hash function) */
@@ -145,6 +148,7 @@ extern uint_fast32_t flags;
 #define F_PRINTNULL		0x01000000U
 #define F_PARTIALONLY		0x02000000U
 #define F_CLONEFILES		0x04000000U
+#define F_STREAM		0x08000000U
 
 #define F_LOUD			0x40000000U
 #define F_DEBUG			0x80000000U
@@ -155,6 +159,12 @@ extern uint_fast32_t flags;
 #define F_HASH_FULL		0x00000004U
 #define F_HAS_DUPES		0x00000008U
 #define F_IS_SYMLINK		0x00000010U
+#define F_LISTED_STAT		0x00000020U
+#define F_XATTR_SEEN		0x00000040U
+#define F_XATTR_PARTIAL		0x00000080U
+#define F_XATTR_FULL		0x00000100U
+#define F_XATTR_VERIFY		0x00000200U
+#define F_CONFIRM		0x00000400U
 
 /* Extra print flags */
 #define P_PARTIAL		0x00000001U
@@ -192,6 +202,7 @@ typedef struct _file {
   jdupes_hash_t filehash_partial;
   jdupes_hash_t filehash;
   time_t mtime;
+  uint32_t mtime_nsec;  /* Only filled in by hashcache_load() */
   uint32_t flags;  /* Status flags */
 #ifndef NO_USER_ORDER
   unsigned int user_order; /* Order of the originating command-line parameter */
@@ -239,6 +250,10 @@ struct exclude {
 #define X_SIZE_EQ		0x00000002U
 #define X_SIZE_GT		0x00000004U
 #define X_SIZE_LT		0x00000008U
+#define X_NAME			0x00000010U
+#define X_PATH			0x00000020U
+#define X_EXT			0x00000040U
+#define X_REGEX			0x00000080U
 /* The X-than-or-equal are combination flags */
 #define X_SIZE_GTEQ		0x00000006U
 #define X_SIZE_LTEQ		0x0000000aU
@@ -248,7 +263,7 @@ struct exclude {
 /* Flags that use numeric offset instead of a string */
 #define XX_EXCL_OFFSET		0x0000000eU
 /* Flags that require a data parameter */
-#define XX_EXCL_DATA		0x0000000fU
+#define XX_EXCL_DATA		0x000000ffU
 
 /* Exclude definition array */
 struct exclude_tags {
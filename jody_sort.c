@@ -5,6 +5,7 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include "jody_sort.h"
 
 #define IS_NUM(a) (((a >= '0') && (a <= '9')) ? 1 : 0)
@@ -67,6 +68,9 @@ extern int numeric_sort(const char * restrict c1,
       if (precompare != 0) return precompare;
     }
 
+    /* Names that differ only in leading zeroes can end here */
+    if (*c1 == '\0' || *c2 == '\0') break;
+
     /* Do normal comparison */
     if (*c1 == *c2 && *c1 != '\0' && *c2 != '\0') {
       c1++; c2++;
@@ -89,3 +93,102 @@ extern int numeric_sort(const char * restrict c1,
   /* Fall through: the strings are equal */
   return 0;
 }
+
+
+/* Turn a name into a sort key: a byte string that sorts with memcmp()
+ * (shorter keys first on a tie) the way people expect numbered names to
+ * sort, so a list can be sorted without parsing names over and over.
+ *
+ * Each run of digits becomes a marker byte, the number of digits left
+ * after leading zeroes and the digits themselves, so longer numbers sort
+ * later; as with numeric_sort(), zeroes on their own are skipped.
+ * Characters below '.' (spaces, most symbols and, with a signed char,
+ * all non-ASCII bytes) get an escape byte that puts them after the
+ * rest. Names that are equal apart from leading zeroes are told apart by
+ * the zero counts, which follow a 0x00 byte at the end. The key is at
+ * most NUMERIC_SORT_KEY_MAX(strlen(name)) bytes long. */
+extern size_t numeric_sort_key(const char * restrict name, unsigned char * restrict key)
+{
+  const char *p, *start;
+  unsigned char *k = key;
+  size_t digits;
+
+  if (name == NULL || key == NULL) return 0;
+
+  for (p = name; *p != '\0';) {
+    if (IS_NUM(*p)) {
+      while (*p == '0') p++;
+      start = p;
+      while (IS_NUM(*p)) p++;
+      digits = (size_t)(p - start);
+      /* A number that is all zeroes sorts as if it wasn't there */
+      if (digits == 0) continue;
+      *k++ = '0';
+      if (digits < 254) *k++ = (unsigned char)(digits + 1);
+      else {
+        *k++ = 0xff;
+        *k++ = (unsigned char)(0x80 | ((digits >> 7) & 0x7f));
+        *k++ = (unsigned char)(0x80 | (digits & 0x7f));
+      }
+      memcpy(k, start, digits);
+      k += digits;
+    } else if (*p < '.') {
+      *k++ = 0x80;
+      *k++ = (unsigned char)(*p + 129);
+      p++;
+    } else *k++ = (unsigned char)*p++;
+  }
+
+  /* Leading zero counts of each number, for otherwise equal names */
+  *k++ = '\0';
+  for (p = name; *p != '\0';) {
+    if (IS_NUM(*p)) {
+      start = p;
+      while (*p == '0') p++;
+      *k++ = (unsigned char)((p - start > 254) ? 255 : p - start + 1);
+      while (IS_NUM(*p)) p++;
+    } else p++;
+  }
+  return (size_t)(k - key);
+}
+
+
+/* Stable merge sort of an array of pointers
+ * Equal items keep their original relative order, which qsort() does
+ * not guarantee. Returns -1 if the scratch array can't be allocated */
+extern int pointer_mergesort(void **base, const size_t count,
+                int (*compare)(const void *, const void *))
+{
+  void **scratch, **src, **dst, **swap;
+  size_t width, left, mid, right, l, r, out;
+
+  if (base == NULL || compare == NULL) return -1;
+  if (count < 2) return 0;
+
+  scratch = (void **)malloc(sizeof(void *) * count);
+  if (scratch == NULL) return -1;
+
+  src = base;
+  dst = scratch;
+  for (width = 1; width < count; width <<= 1) {
+    for (left = 0; left < count; left += width << 1) {
+      mid = left + width;
+      if (mid > count) mid = count;
+      right = mid + width;
+      if (right > count) right = count;
+      l = left; r = mid; out = left;
+      while (l < mid && r < right) {
+        /* Take from the left run on ties to keep the sort stable */
+        if (compare(src[r], src[l]) < 0) dst[out++] = src[r++];
+        else dst[out++] = src[l++];
+      }
+      while (l < mid) dst[out++] = src[l++];
+      while (r < right) dst[out++] = src[r++];
+    }
+    swap = src; src = dst; dst = swap;
+  }
+
+  if (src != base) memcpy(base, src, sizeof(void *) * count);
+  free(scratch);
+  return 0;
+}
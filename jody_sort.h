@@ -8,8 +8,16 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
+
+/* Longest key numeric_sort_key() can make from a name of len bytes */
+#define NUMERIC_SORT_KEY_MAX(len) ((len) * 3 + 2)
+
 extern int numeric_sort(const char * restrict c1,
                 const char * restrict c2, int sort_direction);
+extern size_t numeric_sort_key(const char * restrict name, unsigned char * restrict key);
+extern int pointer_mergesort(void **base, const size_t count,
+                int (*compare)(const void *, const void *));
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,178 @@
+/* Buffered output writer
+ *
+ * Result lists can run to millions of lines, and going through stdio for
+ * every path and separator costs more than writing the data out. Output
+ * is collected here and written to standard output in large pieces. Any
+ * stdio output already waiting is flushed first so the two never end up
+ * out of order, but code that writes here must not mix in printf() calls
+ * of its own without calling outbuf_flush() first.
+ *
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#ifndef ON_WINDOWS
+ #include <unistd.h>
+ #include <sys/uio.h>
+#endif
+#include "jdupes.h"
+#include "jody_win_unicode.h"
+#include "outbuf.h"
+
+static char *outbuf = NULL;
+static size_t outbuf_used = 0;
+
+
+static void write_out(const char *p, size_t len)
+{
+  fflush(stdout);
+#ifdef ON_WINDOWS
+  if (fwrite(p, 1, len, stdout) != len || fflush(stdout) != 0) goto error_write;
+#else
+  while (len > 0) {
+    const ssize_t n = write(STDOUT_FILENO, p, len);
+
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      goto error_write;
+    }
+    p += n;
+    len -= (size_t)n;
+  }
+#endif
+  return;
+
+error_write:
+  fprintf(stderr, "error writing output: %s\n", strerror(errno));
+  exit(EXIT_FAILURE);
+}
+
+
+#ifndef ON_WINDOWS
+/* Write two pieces of data with as few system calls as possible */
+static void write_two(const char *p1, size_t len1, const char *p2, size_t len2)
+{
+  struct iovec iov[2];
+
+  fflush(stdout);
+  while (len1 > 0) {
+    ssize_t n;
+
+    iov[0].iov_base = (void *)(uintptr_t)p1;
+    iov[0].iov_len = len1;
+    iov[1].iov_base = (void *)(uintptr_t)p2;
+    iov[1].iov_len = len2;
+    n = writev(STDOUT_FILENO, iov, 2);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "error writing output: %s\n", strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    if ((size_t)n >= len1) {
+      p2 += (size_t)n - len1;
+      len2 -= (size_t)n - len1;
+      len1 = 0;
+    } else {
+      p1 += n;
+      len1 -= (size_t)n;
+    }
+  }
+  write_out(p2, len2);
+  return;
+}
+#endif
+
+
+/* Write out everything collected so far */
+extern void outbuf_flush(void)
+{
+  write_out(outbuf, outbuf_used);
+  outbuf_used = 0;
+  return;
+}
+
+
+extern void outbuf_write(const void * const restrict data, const size_t len)
+{
+  if (outbuf == NULL) {
+    outbuf = (char *)malloc(OUTBUF_SIZE);
+    if (outbuf == NULL) oom("outbuf_write()");
+  }
+  /* Anything too big for the buffer goes straight out behind it */
+  if (len > OUTBUF_SIZE) {
+#ifndef ON_WINDOWS
+    write_two(outbuf, outbuf_used, (const char *)data, len);
+#else
+    outbuf_flush();
+    write_out((const char *)data, len);
+#endif
+    outbuf_used = 0;
+    return;
+  }
+  if (outbuf_used + len > OUTBUF_SIZE) outbuf_flush();
+  memcpy(outbuf + outbuf_used, data, len);
+  outbuf_used += len;
+  return;
+}
+
+
+extern void outbuf_puts(const char * const restrict str)
+{
+  outbuf_write(str, strlen(str));
+  return;
+}
+
+
+extern void outbuf_putc(const char c)
+{
+  if (outbuf != NULL && outbuf_used < OUTBUF_SIZE) outbuf[outbuf_used++] = c;
+  else outbuf_write(&c, 1);
+  return;
+}
+
+
+/* Write a path and its terminator (cr = 1: newline, 2: NUL, 0: none) the
+ * way fwprint() would */
+extern void outbuf_path(const char * const restrict str, const int cr)
+{
+#ifdef UNICODE
+  /* Console output is wide; leave that to fwprint() */
+  if (out_mode == _O_U16TEXT) {
+    outbuf_flush();
+    fwprint(stdout, str, cr);
+    return;
+  }
+#endif
+  outbuf_puts(str);
+  if (cr == 2) outbuf_putc('\0');
+  else if (cr == 1) outbuf_putc('\n');
+  return;
+}
+
+
+extern void outbuf_printf(const char * const restrict fmt, ...)
+{
+  va_list ap;
+  char buf[256];
+  int len;
+
+  va_start(ap, fmt);
+  len = vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+  if (len < 0) return;
+  if ((size_t)len < sizeof(buf)) {
+    outbuf_write(buf, (size_t)len);
+    return;
+  }
+
+  /* Rare long messages take the slow way */
+  outbuf_flush();
+  va_start(ap, fmt);
+  vprintf(fmt, ap);
+  va_end(ap);
+  return;
+}
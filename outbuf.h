@@ -0,0 +1,33 @@
+/* jdupes buffered output writer
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#ifndef OUTBUF_H
+#define OUTBUF_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+/* Bytes collected before they are written out */
+#ifndef OUTBUF_SIZE
+ #define OUTBUF_SIZE 1048576
+#endif
+
+extern void outbuf_write(const void * const restrict data, const size_t len);
+extern void outbuf_puts(const char * const restrict str);
+extern void outbuf_putc(const char c);
+extern void outbuf_path(const char * const restrict str, const int cr);
+extern void outbuf_printf(const char * const restrict fmt, ...)
+#ifdef __GNUC__
+                __attribute__((format(printf, 1, 2)))
+#endif
+                ;
+extern void outbuf_flush(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* OUTBUF_H */
@@ -0,0 +1,495 @@
+/* Per-phase timing and I/O accounting
+ *
+ * Counters for bytes read, files opened and system calls are always kept
+ * since they cost one add each. Clocks are only read when --stats asks
+ * for a report. Each phase change reads the wall clock; the CPU clock is
+ * a real system call on most platforms, so it is not read around every
+ * single stat() call and stat() CPU time is charged to the phase that
+ * made the call (usually scanning).
+ *
+ * The same counters feed the --status-fd/--status-socket stream, which
+ * sends one JSON record per line at most once a second (and whenever the
+ * run enters a new top-level phase) so that long runs can be watched
+ * by other programs.
+ *
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <signal.h>
+#ifndef ON_WINDOWS
+ #include <sys/resource.h>
+ #include <poll.h>
+ #include <sys/socket.h>
+ #include <sys/un.h>
+#endif
+#include "jdupes.h"
+#include "runstats.h"
+#include "chunksize.h"
+
+/* Deepest expected nesting is match -> confirm; leave plenty of room */
+#define STATS_STACK_SIZE 8
+/* Nanoseconds between regular status records */
+#define STATUS_INTERVAL 1000000000U
+/* Status socket clients served at once; more are refused */
+#define STATUS_MAX_CLIENTS 8
+/* Long enough for any status record */
+#define STATUS_BUFSIZE 512
+
+struct phase_stats phase_stats[PHASE_MAX];
+struct cache_stats cache_stats;
+enum stats_phase stats_phase = PHASE_NONE;
+int status_enabled = 0;
+
+static const char * const phase_names[PHASE_MAX] = {
+  "other", "scan", "stat", "match", "partial_hash", "full_hash", "confirm", "action"
+};
+/* Phases short enough that reading the CPU clock would cost too much */
+static const int phase_no_cpu[PHASE_MAX] = { 0, 0, 1, 0, 0, 0, 0, 0 };
+
+static FILE *stats_fp = NULL;
+static enum stats_phase stack[STATS_STACK_SIZE];
+static unsigned int depth = 0;
+/* Innermost phase that CPU time is being charged to */
+static enum stats_phase cpu_phase = PHASE_NONE;
+static uint64_t start_wall, start_cpu, last_wall, last_cpu;
+static int clock_started = 0;
+
+/* Status stream state; the last progress numbers are kept so that a
+ * record can be sent on a phase change without asking the caller */
+static int status_fd = -1;
+#ifndef ON_WINDOWS
+static int status_listen = -1;
+static int status_clients[STATUS_MAX_CLIENTS];
+static unsigned int status_client_cnt = 0;
+static const char *status_path = NULL;
+#endif
+static uint64_t status_due = 0, status_last_time = 0, stage_start = 0;
+static uintmax_t status_last_bytes = 0, status_last_done = 0;
+static uintmax_t status_done = 0, status_total = 0, status_dupes = 0;
+
+
+static uint64_t wall_ns(void)
+{
+#ifdef ON_WINDOWS
+  static LARGE_INTEGER freq;
+  LARGE_INTEGER now;
+
+  if (freq.QuadPart == 0) QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&now);
+  return (uint64_t)((double)now.QuadPart * 1000000000.0 / (double)freq.QuadPart);
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000U + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+
+/* Monotonic clock for code outside this file that times things */
+extern uint64_t stats_clock(void)
+{
+  return wall_ns();
+}
+
+
+static uint64_t cpu_ns(void)
+{
+#ifdef ON_WINDOWS
+  FILETIME c, e, k, u;
+
+  if (GetProcessTimes(GetCurrentProcess(), &c, &e, &k, &u) == 0) return 0;
+  return ((((uint64_t)k.dwHighDateTime << 32) | k.dwLowDateTime)
+        + (((uint64_t)u.dwHighDateTime << 32) | u.dwLowDateTime)) * 100U;
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000U + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+
+static inline double ns_to_sec(const uint64_t ns)
+{
+  return (double)ns / 1000000000.0;
+}
+
+
+static void start_clock(void)
+{
+  if (clock_started) return;
+  clock_started = 1;
+  start_wall = last_wall = stage_start = status_last_time = wall_ns();
+  start_cpu = last_cpu = cpu_ns();
+  return;
+}
+
+
+/* Open the report file now so a bad path fails before any work is done */
+extern void stats_init(const char * const restrict path)
+{
+  if (path == NULL) nullptr("stats_init()");
+  stats_fp = fopen(path, "w");
+  if (stats_fp == NULL) {
+    fprintf(stderr, "error: cannot open --stats file '%s': %s\n", path, strerror(errno));
+    string_malloc_destroy();
+    exit(EXIT_FAILURE);
+  }
+  start_clock();
+  return;
+}
+
+
+/* Stream status records to an already open file descriptor */
+extern void status_init_fd(const int fd)
+{
+#ifndef ON_WINDOWS
+  /* The descriptor may be shared with standard output or error, so its
+   * flags are left alone; status_send() polls it before each record */
+  if (fcntl(fd, F_GETFL) == -1) {
+    fprintf(stderr, "error: --status-fd %d is not an open file descriptor\n", fd);
+    string_malloc_destroy();
+    exit(EXIT_FAILURE);
+  }
+#endif
+  status_fd = fd;
+  status_enabled = 1;
+  start_clock();
+  return;
+}
+
+
+/* Listen on a Unix socket; every connected client gets the status stream */
+extern void status_init_socket(const char * const restrict path)
+{
+#ifdef ON_WINDOWS
+  (void)path;
+  fprintf(stderr, "error: --status-socket is not supported on this platform\n");
+  string_malloc_destroy();
+  exit(EXIT_FAILURE);
+#else
+  struct sockaddr_un addr;
+  struct stat st;
+
+  if (path == NULL) nullptr("status_init_socket()");
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "error: --status-socket path is too long: '%s'\n", path);
+    string_malloc_destroy();
+    exit(EXIT_FAILURE);
+  }
+  /* Replace a stale socket from an earlier run, but nothing else */
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  status_listen = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (status_listen == -1
+      || bind(status_listen, (struct sockaddr *)&addr, sizeof(addr)) != 0
+      || listen(status_listen, STATUS_MAX_CLIENTS) != 0) {
+    fprintf(stderr, "error: cannot listen on --status-socket '%s': %s\n", path, strerror(errno));
+    string_malloc_destroy();
+    exit(EXIT_FAILURE);
+  }
+  fcntl(status_listen, F_SETFL, fcntl(status_listen, F_GETFL) | O_NONBLOCK);
+  status_path = path;
+  status_enabled = 1;
+  start_clock();
+  return;
+#endif
+}
+
+
+/* Write a whole record to the --status-fd descriptor. A reader that is
+ * not keeping up loses the record rather than stalling the run; one that
+ * went away or fails a write is dropped. */
+static void status_send_fd(const char * const restrict buf, const size_t len)
+{
+  size_t done = 0;
+
+#ifndef ON_WINDOWS
+  struct pollfd pfd;
+
+  pfd.fd = status_fd;
+  pfd.events = POLLOUT;
+  pfd.revents = 0;
+  if (poll(&pfd, 1, 0) == -1 || (pfd.revents & (POLLERR | POLLHUP | POLLNVAL))) {
+    LOUD(fprintf(stderr, "status_send_fd: fd %d went away\n", status_fd));
+    status_fd = -1;
+    return;
+  }
+  if (!(pfd.revents & POLLOUT)) return;
+#endif
+  while (done < len) {
+    const ssize_t w = write(status_fd, buf + done, len - done);
+
+    if (w == -1) {
+      if (errno == EINTR) continue;
+      LOUD(fprintf(stderr, "status_send_fd: fd %d failed: %s\n", status_fd, strerror(errno)));
+      status_fd = -1;
+      return;
+    }
+    done += (size_t)w;
+  }
+  return;
+}
+
+
+/* Write one record to every status reader, dropping readers that fail */
+static void status_send(const char * const restrict buf, const size_t len)
+{
+#ifndef ON_WINDOWS
+  /* A reader closing its end must not kill the run, but SIGPIPE stays at
+   * its default for standard output so that 'jdupes | head' still ends */
+  void (*old_sigpipe)(int) = signal(SIGPIPE, SIG_IGN);
+#endif
+
+  if (status_fd != -1) status_send_fd(buf, len);
+#ifndef ON_WINDOWS
+  if (status_listen != -1) {
+    int fd;
+
+    while ((fd = accept(status_listen, NULL, NULL)) != -1) {
+      if (status_client_cnt == STATUS_MAX_CLIENTS) {
+        close(fd);
+        continue;
+      }
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+      status_clients[status_client_cnt++] = fd;
+    }
+  }
+  for (unsigned int i = 0; i < status_client_cnt; i++) {
+    const ssize_t w = write(status_clients[i], buf, len);
+
+    /* A partial record would corrupt the stream, so drop the client */
+    if (w == (ssize_t)len || (w == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))) continue;
+    close(status_clients[i]);
+    status_clients[i--] = status_clients[--status_client_cnt];
+  }
+  signal(SIGPIPE, old_sigpipe);
+#endif
+  return;
+}
+
+
+/* Build and send a status record for the given time */
+static void status_emit(const uint64_t now, const char * const restrict stage_override)
+{
+  char buf[STATUS_BUFSIZE];
+  const enum stats_phase stage = (depth > 1) ? stack[1] : stats_phase;
+  const uintmax_t hashed = phase_stats[PHASE_PARTIAL].bytes_read + phase_stats[PHASE_FULL].bytes_read;
+  const uintmax_t compared = phase_stats[PHASE_CONFIRM].bytes_read;
+  const double elapsed = ns_to_sec(now - status_last_time);
+  double bps = 0.0, fps = 0.0;
+  int len;
+
+  if (elapsed > 0.0) {
+    bps = (double)(hashed + compared - status_last_bytes) / elapsed;
+    fps = (double)(status_done - status_last_done) / elapsed;
+  }
+  len = snprintf(buf, STATUS_BUFSIZE, "{\"time\": %.3f, \"stage\": \"%s\", \"phase\": \"%s\", "
+      "\"files\": %" PRIuMAX ", \"total\": %" PRIuMAX ", \"duplicates\": %" PRIuMAX ", "
+      "\"bytes_hashed\": %" PRIuMAX ", \"bytes_compared\": %" PRIuMAX ", "
+      "\"bytes_per_sec\": %.0f, \"files_per_sec\": %.1f, ",
+      ns_to_sec(now - start_wall), stage_override != NULL ? stage_override : phase_names[stage],
+      phase_names[stats_phase], status_done, status_total, status_dupes,
+      hashed, compared, bps, fps);
+  /* Queue depth and ETA only make sense once the total is known */
+  if (status_total != 0 && status_done <= status_total && stage_override == NULL) {
+    const double stage_time = ns_to_sec(now - stage_start);
+    const uintmax_t queued = status_total - status_done;
+
+    if (status_done != 0) len += snprintf(buf + len, (size_t)(STATUS_BUFSIZE - len),
+        "\"queued\": %" PRIuMAX ", \"eta_seconds\": %.1f}\n",
+        queued, stage_time * (double)queued / (double)status_done);
+    else len += snprintf(buf + len, (size_t)(STATUS_BUFSIZE - len),
+        "\"queued\": %" PRIuMAX ", \"eta_seconds\": null}\n", queued);
+  } else len += snprintf(buf + len, (size_t)(STATUS_BUFSIZE - len), "\"queued\": null, \"eta_seconds\": null}\n");
+
+  status_send(buf, (size_t)len);
+  status_last_time = now;
+  status_last_bytes = hashed + compared;
+  status_last_done = status_done;
+  status_due = now + STATUS_INTERVAL;
+  return;
+}
+
+
+/* Record progress; sends a status record if one is due */
+extern void status_update(const uintmax_t done, const uintmax_t total, const uintmax_t dupes)
+{
+  uint64_t now;
+
+  status_done = done;
+  status_total = total;
+  status_dupes = dupes;
+  now = wall_ns();
+  if (now >= status_due) status_emit(now, NULL);
+  return;
+}
+
+
+/* Entering a new top-level phase is sent right away */
+static void status_stage_change(void)
+{
+  const uint64_t now = wall_ns();
+
+  stage_start = now;
+  status_emit(now, NULL);
+  return;
+}
+
+
+/* Charge the time since the last phase change to the current phases */
+static void stats_charge(const int read_cpu)
+{
+  uint64_t now;
+
+  now = wall_ns();
+  phase_stats[stats_phase].wall_ns += now - last_wall;
+  last_wall = now;
+  if (read_cpu) {
+    now = cpu_ns();
+    phase_stats[cpu_phase].cpu_ns += now - last_cpu;
+    last_cpu = now;
+  }
+  return;
+}
+
+
+extern void stats_enter(const enum stats_phase phase)
+{
+  if (depth == STATS_STACK_SIZE) {
+    fprintf(stderr, "\ninternal error: stats_enter() nested too deeply, report this\n");
+    string_malloc_destroy();
+    exit(EXIT_FAILURE);
+  }
+  if (stats_fp != NULL) stats_charge(!phase_no_cpu[phase]);
+  stack[depth++] = stats_phase;
+  stats_phase = phase;
+  if (!phase_no_cpu[phase]) cpu_phase = phase;
+  phase_stats[phase].calls++;
+  if (status_enabled && depth == 1) status_stage_change();
+  return;
+}
+
+
+extern void stats_leave(void)
+{
+  const enum stats_phase leaving = stats_phase;
+
+  if (depth == 0) {
+    fprintf(stderr, "\ninternal error: stats_leave() without stats_enter(), report this\n");
+    string_malloc_destroy();
+    exit(EXIT_FAILURE);
+  }
+  if (stats_fp != NULL) stats_charge(!phase_no_cpu[leaving]);
+  stats_phase = stack[--depth];
+  if (!phase_no_cpu[leaving]) {
+    /* CPU time goes back to the innermost phase that takes it */
+    unsigned int i = depth;
+    cpu_phase = stats_phase;
+    while (phase_no_cpu[cpu_phase] && i > 0) cpu_phase = stack[--i];
+  }
+  return;
+}
+
+
+static inline double hit_rate(const uintmax_t hits, const uintmax_t misses)
+{
+  if (hits + misses == 0) return 0.0;
+  return (double)hits / (double)(hits + misses);
+}
+
+
+/* Send the last status record and shut the status stream down */
+static void status_finish(const uintmax_t files, const uintmax_t dupes)
+{
+  status_done = files;
+  status_total = files;
+  status_dupes = dupes;
+  status_emit(wall_ns(), "done");
+#ifndef ON_WINDOWS
+  for (unsigned int i = 0; i < status_client_cnt; i++) close(status_clients[i]);
+  status_client_cnt = 0;
+  if (status_listen != -1) {
+    close(status_listen);
+    unlink(status_path);
+    status_listen = -1;
+  }
+#endif
+  status_fd = -1;
+  status_enabled = 0;
+  return;
+}
+
+
+/* Finish up: write the JSON report if --stats was given and send the
+ * final status record if a status stream is active */
+extern void stats_write(const uintmax_t files, const uintmax_t dupes)
+{
+  uintmax_t bytes = 0, opened = 0, syscalls = 0;
+
+  if (status_enabled) status_finish(files, dupes);
+  if (stats_fp == NULL) return;
+  stats_charge(1);
+
+  fprintf(stats_fp, "{\n  \"version\": \"%s\",\n", VER);
+  fprintf(stats_fp, "  \"wall_seconds\": %.6f,\n", ns_to_sec(last_wall - start_wall));
+  fprintf(stats_fp, "  \"cpu_seconds\": %.6f,\n", ns_to_sec(last_cpu - start_cpu));
+  fprintf(stats_fp, "  \"files\": %" PRIuMAX ",\n", files);
+  fprintf(stats_fp, "  \"duplicates\": %" PRIuMAX ",\n", dupes);
+#ifndef ON_WINDOWS
+  {
+    struct rusage ru;
+
+    /* ru_maxrss is in KiB everywhere except macOS, where it is bytes */
+    if (getrusage(RUSAGE_SELF, &ru) == 0)
+ #ifdef __APPLE__
+      fprintf(stats_fp, "  \"max_rss_kib\": %ld,\n", (long)ru.ru_maxrss / 1024);
+ #else
+      fprintf(stats_fp, "  \"max_rss_kib\": %ld,\n", (long)ru.ru_maxrss);
+ #endif
+  }
+#endif
+  chunk_report(stats_fp);
+  fprintf(stats_fp, "  \"phases\": {\n");
+  for (int i = 0; i < PHASE_MAX; i++) {
+    const struct phase_stats * const ps = &phase_stats[i];
+
+    fprintf(stats_fp, "    \"%s\": { \"calls\": %" PRIuMAX ", \"wall_seconds\": %.6f, ",
+        phase_names[i], ps->calls, ns_to_sec(ps->wall_ns));
+    if (phase_no_cpu[i]) fprintf(stats_fp, "\"cpu_seconds\": null, ");
+    else fprintf(stats_fp, "\"cpu_seconds\": %.6f, ", ns_to_sec(ps->cpu_ns));
+    fprintf(stats_fp, "\"bytes_read\": %" PRIuMAX ", \"files_opened\": %" PRIuMAX ", \"syscalls\": %" PRIuMAX " }%s\n",
+        ps->bytes_read, ps->files_opened, ps->syscalls, (i != PHASE_MAX - 1) ? "," : "");
+    bytes += ps->bytes_read;
+    opened += ps->files_opened;
+    syscalls += ps->syscalls;
+  }
+  fprintf(stats_fp, "  },\n");
+  fprintf(stats_fp, "  \"bytes_read\": %" PRIuMAX ",\n", bytes);
+  fprintf(stats_fp, "  \"files_opened\": %" PRIuMAX ",\n", opened);
+  fprintf(stats_fp, "  \"syscalls\": %" PRIuMAX ",\n", syscalls);
+  fprintf(stats_fp, "  \"hash_cache\": {\n");
+  fprintf(stats_fp, "    \"partial_hits\": %" PRIuMAX ", \"partial_misses\": %" PRIuMAX ", \"partial_hit_rate\": %.4f,\n",
+      cache_stats.partial_hits, cache_stats.partial_misses,
+      hit_rate(cache_stats.partial_hits, cache_stats.partial_misses));
+  fprintf(stats_fp, "    \"full_hits\": %" PRIuMAX ", \"full_misses\": %" PRIuMAX ", \"full_hit_rate\": %.4f\n",
+      cache_stats.full_hits, cache_stats.full_misses,
+      hit_rate(cache_stats.full_hits, cache_stats.full_misses));
+  fprintf(stats_fp, "  }\n}\n");
+
+  if (fclose(stats_fp) != 0)
+    fprintf(stderr, "error: cannot write --stats file: %s\n", strerror(errno));
+  stats_fp = NULL;
+  return;
+}
@@ -0,0 +1,69 @@
+/* jdupes per-phase timing and I/O accounting for --stats and the
+ * --status-fd/--status-socket progress stream
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#ifndef RUNSTATS_H
+#define RUNSTATS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/* Program phases that time and I/O are charged to. Phases nest (stat()
+ * calls happen while scanning); time always goes to the innermost one. */
+enum stats_phase {
+  PHASE_NONE = 0,   /* Setup, option parsing, anything not listed below */
+  PHASE_SCAN,       /* Directory traversal */
+  PHASE_STAT,       /* stat()/lstat() of files and directories */
+  PHASE_MATCH,      /* Size grouping and match tree bookkeeping */
+  PHASE_PARTIAL,    /* Partial (first block) hashing */
+  PHASE_FULL,       /* Full file hashing */
+  PHASE_CONFIRM,    /* Byte-for-byte match confirmation */
+  PHASE_ACTION,     /* Printing, deleting, linking, etc. */
+  PHASE_MAX
+};
+
+struct phase_stats {
+  uint64_t wall_ns;
+  uint64_t cpu_ns;
+  uintmax_t calls;          /* Times this phase was entered */
+  uintmax_t bytes_read;
+  uintmax_t files_opened;
+  uintmax_t syscalls;
+};
+
+/* Hash reuse counters; a "hit" is a hash that did not need any I/O */
+struct cache_stats {
+  uintmax_t partial_hits;
+  uintmax_t partial_misses;
+  uintmax_t full_hits;
+  uintmax_t full_misses;
+};
+
+extern struct phase_stats phase_stats[PHASE_MAX];
+extern struct cache_stats cache_stats;
+extern enum stats_phase stats_phase;
+extern int status_enabled;
+
+/* Counters are cheap enough to always keep; they go to the current phase */
+#define STATS_BYTES(n) (phase_stats[stats_phase].bytes_read += (uintmax_t)(n))
+#define STATS_OPEN() (phase_stats[stats_phase].files_opened++)
+#define STATS_SYSCALL(n) (phase_stats[stats_phase].syscalls += (n))
+#define STATS_CACHE(a) (cache_stats.a++)
+
+extern void stats_init(const char * const restrict path);
+extern void stats_enter(const enum stats_phase phase);
+extern void stats_leave(void);
+extern void stats_write(const uintmax_t files, const uintmax_t dupes);
+extern uint64_t stats_clock(void);
+extern void status_init_fd(const int fd);
+extern void status_init_socket(const char * const restrict path);
+extern void status_update(const uintmax_t done, const uintmax_t total, const uintmax_t dupes);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RUNSTATS_H */
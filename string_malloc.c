@@ -44,6 +44,7 @@ uintmax_t sma_free_tails = 0;
 void *string_malloc(size_t len) { return malloc(len); }
 void string_free(void *ptr) { free(ptr); return; }
 void string_malloc_destroy(void) { return; }
+void string_malloc_passthrough(const int enable) { (void)enable; return; }
 
 #else /* Not SMA_PASSTHROUGH mode */
 
@@ -58,6 +59,10 @@ static unsigned int sma_pages = 0;
 static struct freelist sma_freelist[SMA_MAX_FREE];
 static int sma_freelist_cnt = 0;
 static size_t sma_nextfree = sizeof(uintptr_t);
+static int sma_passthrough = 0;
+
+/* Objects from the runtime pass-through mode have this size bit set */
+#define SMA_PASSTHROUGH_BIT 1
 
 
 /* Scan the freed chunk list for a suitably sized object */
@@ -143,6 +148,16 @@ void *string_malloc(size_t len)
 		len += sizeof(uintptr_t);
 	}
 
+	/* Runtime pass-through: objects can be truly freed later */
+	if (sma_passthrough) {
+		address = (size_t *)malloc(len + sizeof(size_t));
+		if (!address) return NULL;
+		*address = len | SMA_PASSTHROUGH_BIT;
+		address++;
+		DBG(sma_allocs++;)
+		return (void *)address;
+	}
+
 	/* Pass-through allocations larger than maximum object size to malloc() */
 	if (len > (SMA_PAGE_SIZE - sizeof(uintptr_t) - sizeof(size_t))) {
 		/* Allocate the space */
@@ -224,6 +239,13 @@ void string_free(void * const restrict addr)
 	/* Get address to real start of object and the object size */
 	sizeptr = (size_t *)addr - 1;
 	size = *(size_t *)sizeptr;
+
+	/* Pass-through objects go straight back to the system */
+	if (size & SMA_PASSTHROUGH_BIT) {
+		free(sizeptr);
+		DBG(sma_free_good++;)
+		return;
+	}
 	/* Calculate after-block pointer for merge checks */
 	after = (uintptr_t)addr + size;
 
@@ -274,6 +296,15 @@ sf_failed:
 	return;
 }
 
+/* Switch all further allocations to (or away from) plain malloc()
+ * This trades allocation speed for the ability to give memory back */
+void string_malloc_passthrough(const int enable)
+{
+	sma_passthrough = enable;
+	return;
+}
+
+
 /* Destroy all allocated pages */
 void string_malloc_destroy(void)
 {
@@ -288,7 +319,11 @@ void string_malloc_destroy(void)
 		cur = next;
 		sma_pages--;
 	}
+	/* Leave everything ready for a fresh start */
 	sma_head = NULL;
+	sma_curpage = NULL;
+	sma_nextfree = sizeof(uintptr_t);
+	sma_freelist_cnt = 0;
 	return;
 }
 
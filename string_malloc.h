@@ -23,6 +23,7 @@ extern uintmax_t sma_free_tails;
 extern void *string_malloc(size_t len);
 extern void string_free(void * const restrict addr);
 extern void string_malloc_destroy(void);
+extern void string_malloc_passthrough(const int enable);
 
 #ifdef __cplusplus
 }